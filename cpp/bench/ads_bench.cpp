@@ -0,0 +1,346 @@
+#include <benchmark/benchmark.h>
+#include <google/protobuf/arena.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include "ad_generator.h"
+#include "hash_ad_engine.h"
+#include "score_kernel.h"
+#include "../common/logging.h"
+
+/**
+ * Microbenchmarks for the GetAds generation path and the logging hot path.
+ *
+ * All inputs come from generators seeded with kSeed, so two runs measure the
+ * same work. On top of the usual --benchmark_* flags:
+ *
+ *   --save=FILE                write per-benchmark CPU time (ns) as TSV
+ *   --compare=FILE             compare against a file written by --save and
+ *                              exit with status 1 on regressions
+ *   --max-regression=PERCENT   allowed slowdown for --compare (default 10)
+ */
+
+static constexpr uint32_t kSeed = 42;
+
+// A fixed set of Contexts resembling real traffic: short queries, asins of
+// the generated form and an understanding on every other one
+static const std::vector<Context>& Contexts() {
+    static const std::vector<Context> contexts = []() {
+        static const char* const words[] = {"coffee", "maker", "running", "shoes", "wireless",
+                                            "headphones", "cast", "iron", "skillet", "desk",
+                                            "lamp", "usb", "charger", "yoga", "mat"};
+        std::mt19937 rng(kSeed);
+        std::uniform_int_distribution<int> word(0, 14);
+        std::uniform_int_distribution<int> digits(0, 999999);
+        std::vector<Context> result(64);
+        for (size_t i = 0; i < result.size(); ++i) {
+            Context& context = result[i];
+            context.set_query(std::string(words[word(rng)]) + " " + words[word(rng)]);
+            char asin[16];
+            std::snprintf(asin, sizeof(asin), "B%06d", digits(rng));
+            context.set_asin_id(asin);
+            if (i % 2 == 1) {
+                context.set_understanding("user wants " + context.query() + " for everyday use");
+            }
+        }
+        return result;
+    }();
+    return contexts;
+}
+
+static void BM_GenerateAds(benchmark::State& state) {
+    const int version = static_cast<int>(state.range(0));
+    AdGenerator generator;
+    const std::vector<Context>& contexts = Contexts();
+    size_t i = 0;
+    for (auto _ : state) {
+        google::protobuf::Arena arena;
+        AdsList* list = generator.generateAds(contexts[i++ % contexts.size()], version, &arena);
+        benchmark::DoNotOptimize(list);
+    }
+}
+BENCHMARK(BM_GenerateAds)->DenseRange(1, 3);
+
+// Generation with the top-K selection stage enabled
+static void BM_GenerateAdsTopK(benchmark::State& state) {
+    AdGenerator generator(makeHashAdEngine(), static_cast<size_t>(state.range(0)));
+    const std::vector<Context>& contexts = Contexts();
+    size_t i = 0;
+    for (auto _ : state) {
+        google::protobuf::Arena arena;
+        AdsList* list = generator.generateAds(contexts[i++ % contexts.size()], 3, &arena);
+        benchmark::DoNotOptimize(list);
+    }
+}
+BENCHMARK(BM_GenerateAdsTopK)->Arg(3);
+
+// Context score of one version, i.e. what calculateScore used to compute
+static void BM_VersionScore(benchmark::State& state) {
+    HashAdScorer scorer;
+    const std::vector<Context>& contexts = Contexts();
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(scorer.versionScore(contexts[i++ % contexts.size()], 3, nullptr));
+    }
+}
+BENCHMARK(BM_VersionScore);
+
+// Candidate retrieval including asin and ad id generation (generateAdId)
+static void BM_RetrieveCandidates(benchmark::State& state) {
+    HashCandidateRetriever retriever;
+    std::vector<AdCandidate> candidates;
+    const std::vector<Context>& contexts = Contexts();
+    size_t i = 0;
+    for (auto _ : state) {
+        candidates.clear();
+        retriever.retrieve(contexts[i++ % contexts.size()], 3, candidates);
+        benchmark::DoNotOptimize(candidates.data());
+    }
+}
+BENCHMARK(BM_RetrieveCandidates);
+
+static ScoreColumns RandomColumns(size_t count) {
+    std::mt19937 rng(kSeed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    ScoreColumns columns;
+    columns.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        columns.base_score[i] = unit(rng);
+        columns.boost[i] = unit(rng) * 0.2;
+        columns.prior[i] = unit(rng) * 0.1 - 0.05;
+    }
+    return columns;
+}
+
+static void BM_ScoreBatch(benchmark::State& state) {
+    ScoreColumns columns = RandomColumns(static_cast<size_t>(state.range(0)));
+    std::vector<double> scores(columns.size());
+    for (auto _ : state) {
+        scoreBatch(columns, versionMultiplier(3), scores.data());
+        benchmark::DoNotOptimize(scores.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetLabel(scoreKernelName());
+}
+BENCHMARK(BM_ScoreBatch)->Arg(8)->Arg(1024);
+
+static void BM_ScoreBatchScalar(benchmark::State& state) {
+    ScoreColumns columns = RandomColumns(static_cast<size_t>(state.range(0)));
+    std::vector<double> scores(columns.size());
+    for (auto _ : state) {
+        scoreBatchScalar(columns, versionMultiplier(3), scores.data());
+        benchmark::DoNotOptimize(scores.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ScoreBatchScalar)->Arg(8)->Arg(1024);
+
+static AdsList SampleAdsList() {
+    AdGenerator generator;
+    return generator.generateAds(Contexts()[1], 3);
+}
+
+static void BM_AdsListSerialize(benchmark::State& state) {
+    AdsList list = SampleAdsList();
+    std::string bytes;
+    for (auto _ : state) {
+        list.SerializeToString(&bytes);
+        benchmark::DoNotOptimize(bytes.data());
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(bytes.size()));
+}
+BENCHMARK(BM_AdsListSerialize);
+
+static void BM_AdsListParse(benchmark::State& state) {
+    std::string bytes = SampleAdsList().SerializeAsString();
+    for (auto _ : state) {
+        google::protobuf::Arena arena;
+        AdsList* list = google::protobuf::Arena::CreateMessage<AdsList>(&arena);
+        benchmark::DoNotOptimize(list->ParseFromString(bytes));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(bytes.size()));
+}
+BENCHMARK(BM_AdsListParse);
+
+static void BM_LogContextBuild(benchmark::State& state) {
+    for (auto _ : state) {
+        std::string line = logging::LogContext()
+            .add("version", 3)
+            .add("ads_count", 8)
+            .add("elapsed_ms", 51L)
+            .add("is_replacement", false)
+            .build("Received AdsList");
+        benchmark::DoNotOptimize(line.data());
+    }
+}
+BENCHMARK(BM_LogContextBuild);
+
+static void BM_LogFieldsBuild(benchmark::State& state) {
+    for (auto _ : state) {
+        logging::LogFields fields("Received AdsList");
+        fields.add("version", 3)
+              .add("ads_count", 8)
+              .add("elapsed_ms", 51L)
+              .add("is_replacement", false);
+        benchmark::DoNotOptimize(fields.view().data());
+    }
+}
+BENCHMARK(BM_LogFieldsBuild);
+
+// Swallows std::cout while an enabled-level benchmark runs, so the numbers
+// cover formatting and the stream write but not the terminal
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+};
+
+// Constructed once: the constructor logs its configuration
+static logging::Logger logger("BENCH");
+
+static void BM_LoggerLogEnabled(benchmark::State& state) {
+    logging::LogConfig::instance().set_level(logging::Level::INFO);
+    NullBuffer null_buffer;
+    std::streambuf* previous = std::cout.rdbuf(&null_buffer);
+    for (auto _ : state) {
+        logger.info_if_enabled("Received AdsList", [&](logging::LogFields& fields) {
+            fields.add("version", 3).add("ads_count", 8);
+        });
+    }
+    logger.flush();
+    std::cout.rdbuf(previous);
+}
+BENCHMARK(BM_LoggerLogEnabled);
+
+static void BM_LoggerLogDisabled(benchmark::State& state) {
+    logging::LogConfig::instance().set_level(logging::Level::WARN);
+    for (auto _ : state) {
+        logger.info_if_enabled("Received AdsList", [&](logging::LogFields& fields) {
+            fields.add("version", 3).add("ads_count", 8);
+        });
+    }
+    logging::LogConfig::instance().restore_startup();
+}
+BENCHMARK(BM_LoggerLogDisabled);
+
+// Prints like the console reporter and remembers each benchmark's CPU time
+// per iteration; with repetitions the fastest repetition is kept
+class RecordingReporter : public benchmark::ConsoleReporter {
+public:
+    void ReportRuns(const std::vector<Run>& runs) override {
+        ConsoleReporter::ReportRuns(runs);
+        for (const Run& run : runs) {
+            if (run.run_type != Run::RT_Iteration || run.error_occurred) {
+                continue;
+            }
+            double cpu_ns = run.GetAdjustedCPUTime() * 1e9 /
+                            benchmark::GetTimeUnitMultiplier(run.time_unit);
+            auto found = cpu_ns_.find(run.benchmark_name());
+            if (found == cpu_ns_.end() || cpu_ns < found->second) {
+                cpu_ns_[run.benchmark_name()] = cpu_ns;
+            }
+        }
+    }
+
+    const std::map<std::string, double>& results() const { return cpu_ns_; }
+
+private:
+    std::map<std::string, double> cpu_ns_;
+};
+
+static bool SaveResults(const std::string& path, const std::map<std::string, double>& results) {
+    std::ofstream out(path, std::ios::trunc);
+    out << "# benchmark\tcpu_ns\n";
+    for (const auto& result : results) {
+        out << result.first << '\t' << result.second << '\n';
+    }
+    return static_cast<bool>(out);
+}
+
+static bool LoadResults(const std::string& path, std::map<std::string, double>& results) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (line.empty() || line[0] == '#' || tab == std::string::npos) {
+            continue;
+        }
+        results[line.substr(0, tab)] = std::stod(line.substr(tab + 1));
+    }
+    return true;
+}
+
+// Returns the number of benchmarks slower than baseline by more than max_regression
+static int CompareResults(const std::map<std::string, double>& baseline,
+                          const std::map<std::string, double>& current, double max_regression) {
+    int regressions = 0;
+    std::printf("\n%-36s %14s %14s %9s\n", "Comparison", "baseline ns", "current ns", "change");
+    for (const auto& result : current) {
+        auto found = baseline.find(result.first);
+        if (found == baseline.end()) {
+            std::printf("%-36s %14s %14.1f %9s\n", result.first.c_str(), "-", result.second, "new");
+            continue;
+        }
+        double change = found->second > 0 ? (result.second / found->second - 1.0) * 100.0 : 0.0;
+        bool regressed = change > max_regression;
+        regressions += regressed ? 1 : 0;
+        std::printf("%-36s %14.1f %14.1f %+8.1f%%%s\n", result.first.c_str(), found->second,
+                    result.second, change, regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+    std::string save_path;
+    std::string compare_path;
+    double max_regression = 10.0;
+    // Take our flags out before handing the rest to the library
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--save=", 7) == 0) {
+            save_path = argv[i] + 7;
+        } else if (std::strncmp(argv[i], "--compare=", 10) == 0) {
+            compare_path = argv[i] + 10;
+        } else if (std::strncmp(argv[i], "--max-regression=", 17) == 0) {
+            max_regression = std::stod(argv[i] + 17);
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    int library_argc = static_cast<int>(args.size());
+    benchmark::Initialize(&library_argc, args.data());
+    if (benchmark::ReportUnrecognizedArguments(library_argc, args.data())) {
+        return 1;
+    }
+
+    std::map<std::string, double> baseline;
+    if (!compare_path.empty() && !LoadResults(compare_path, baseline)) {
+        std::cerr << "Cannot read baseline " << compare_path << std::endl;
+        return 1;
+    }
+
+    RecordingReporter reporter;
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    benchmark::Shutdown();
+
+    if (!save_path.empty() && !SaveResults(save_path, reporter.results())) {
+        std::cerr << "Cannot write " << save_path << std::endl;
+        return 1;
+    }
+    if (!compare_path.empty() &&
+        CompareResults(baseline, reporter.results(), max_regression) > 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -1,102 +1,339 @@
 #include "ads_client.h"
 #include "../common/logging.h"
+#include "../common/ads_delta.h"
 #include <iostream>
 #include <thread>
 #include <chrono>
 #include <random>
+#include <algorithm>
 #include <map>
 
 static logging::Logger logger("CLIENT");
 
-AdsClient::AdsClient(std::shared_ptr<Channel> channel)
-    : stub_(AdsService::NewStub(channel)) {
+// Client-side stage latencies, see metrics::Registry
+static metrics::Histogram& context_write_latency =
+    metrics::Registry::instance().histogram("client_context_write");
+static metrics::Histogram& read_latency =
+    metrics::Registry::instance().histogram("client_read");
+static metrics::Histogram& first_adslist_latency =
+    metrics::Registry::instance().histogram("client_time_to_first_adslist");
+static metrics::Histogram& session_latency =
+    metrics::Registry::instance().histogram("client_session_duration");
+
+// Outcome of the whole call, hedge included, on its root span
+static void endCallSpan(tracing::Span& span, const GetAdsResult& result) {
+    span.set("selected_version", result.ads_list.version())
+        .set("versions_received", static_cast<int64_t>(result.versions_received));
+    if (!result.status.ok() && !result.cancelled_by_client) {
+        span.setError(result.status.error_message());
+    }
+    span.end();
 }
 
+AdsClient::AdsClient(std::shared_ptr<Channel> channel, bool accept_delta)
+    : AdsClient(std::make_shared<ChannelPool>(std::move(channel)), accept_delta) {
+}
+
+AdsClient::AdsClient(std::shared_ptr<ChannelPool> pool, bool accept_delta,
+                     std::shared_ptr<HedgePolicy> hedging)
+    : pool_(std::move(pool)), accept_delta_(accept_delta), hedging_(std::move(hedging)) {
+}
+
+// Keeps the stream that delivers the first AdsList and cancels the other one
+// through its registered context
+struct AdsClient::HedgeRace {
+    std::mutex mu;
+    std::condition_variable cv;
+    int winner = -1;
+    bool primary_done = false;
+    ClientContext* contexts[2] = {nullptr, nullptr};
+
+    // False when the race is already decided, so the stream is not needed
+    bool enter(int attempt, ClientContext* context) {
+        std::lock_guard<std::mutex> lock(mu);
+        if (winner >= 0) {
+            return false;
+        }
+        contexts[attempt] = context;
+        return true;
+    }
+
+    // Must be called before the attempt's context is destroyed
+    void leave(int attempt) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            contexts[attempt] = nullptr;
+            if (attempt == 0) {
+                primary_done = true;
+            }
+        }
+        cv.notify_all();
+    }
+
+    // Whether attempt is the winner, becoming it if nobody was yet
+    bool claim(int attempt) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (winner >= 0) {
+                return winner == attempt;
+            }
+            winner = attempt;
+            if (contexts[1 - attempt] != nullptr) {
+                contexts[1 - attempt]->TryCancel();
+            }
+        }
+        cv.notify_all();
+        return true;
+    }
+
+    bool lost(int attempt) {
+        std::lock_guard<std::mutex> lock(mu);
+        return winner >= 0 && winner != attempt;
+    }
+};
+
 AdsList AdsClient::getAds(const std::string& query, const std::string& asin_id, const std::string& understanding) {
+    return getAdsResult(query, asin_id, understanding).ads_list;
+}
+
+GetAdsResult AdsClient::getAdsResult(const std::string& query, const std::string& asin_id,
+                                     const std::string& understanding, int timeout_ms) {
+    Context request;
+    request.set_query(query);
+    request.set_asin_id(asin_id);
+    return runGetAds(request, understanding, timeout_ms);
+}
+
+GetAdsResult AdsClient::getAdsBatchResult(const std::vector<BatchItem>& items,
+                                          const std::string& understanding, int timeout_ms) {
+    Context request;
+    request.mutable_items()->Reserve(static_cast<int>(items.size()));
+    for (const BatchItem& item : items) {
+        *request.add_items() = item;
+    }
+    return runGetAds(request, understanding, timeout_ms);
+}
+
+GetAdsResult AdsClient::runGetAds(const Context& request, const std::string& understanding,
+                                  int timeout_ms) {
+    metrics::ScopedTimer session_timer(session_latency);
+    GetAdsResult result;
+    result.timeout_ms = timeout_ms > 0 ? timeout_ms : generateRandomTimeout();
+    // The server reads the remaining budget from the deadline, and gRPC ends
+    // a Read that is still blocked when it expires
+    const auto deadline = std::chrono::system_clock::now() +
+                          std::chrono::milliseconds(result.timeout_ms);
+    // Each stream is a child span, so a hedge shows up next to its primary
+    tracing::Span call_span("AdsClient.getAds", tracing::startTrace());
+    call_span.set("timeout_ms", result.timeout_ms).set("batch_items", request.items_size());
+    const tracing::SpanContext trace = call_span.context();
+    if (!hedging_) {
+        runAttempt(request, understanding, deadline, pool_->acquire(), trace, nullptr, 0, result);
+        endCallSpan(call_span, result);
+        return result;
+    }
+
+    hedging_->onCall();
+    const int delay_ms = hedging_->delayMs();
+    HedgeRace race;
+    ChannelPool::Lease primary_lease = pool_->acquire();
+    const size_t primary_channel = primary_lease.index();
+    std::thread primary([this, &request, &understanding, deadline, &trace, &race, &result,
+                         lease = std::move(primary_lease)]() mutable {
+        runAttempt(request, understanding, deadline, std::move(lease), trace, &race, 0, result);
+    });
+
+    // Hedge when the first stream is still silent after the delay, unless
+    // the delay already used up the whole timeout
+    bool hedge_due;
+    {
+        std::unique_lock<std::mutex> lock(race.mu);
+        hedge_due = delay_ms < result.timeout_ms &&
+                    !race.cv.wait_for(lock, std::chrono::milliseconds(delay_ms), [&race]() {
+                        return race.winner >= 0 || race.primary_done;
+                    });
+    }
+    GetAdsResult hedge_result;
+    hedge_result.timeout_ms = result.timeout_ms;
+    if (hedge_due && hedging_->tryHedge()) {
+        logger.info_if_enabled("Hedging GetAds call", [&](logging::LogFields& fields) {
+            fields.add("delay_ms", delay_ms)
+                  .add("timeout_ms", result.timeout_ms)
+                  .add("primary_channel", primary_channel);
+        });
+        call_span.setFlag("hedged", true);
+        runAttempt(request, understanding, deadline, pool_->acquire(primary_channel),
+                   trace, &race, 1, hedge_result);
+    }
+    primary.join();
+
+    if (race.winner == 1) {
+        hedging_->recordHedgeWon();
+        call_span.setFlag("hedge_won", true);
+        endCallSpan(call_span, hedge_result);
+        return hedge_result;
+    }
+    endCallSpan(call_span, result);
+    return result;
+}
+
+void AdsClient::runAttempt(const Context& request, const std::string& understanding,
+                           std::chrono::system_clock::time_point deadline, ChannelPool::Lease lease,
+                           const tracing::SpanContext& trace, HedgeRace* race, int attempt,
+                           GetAdsResult& result) {
     logging::Timer overall_timer("bidirectional_stream");
+    const uint64_t stream_start_ns = metrics::now_ns();
+    tracing::Span stream_span("ads.AdsService/GetAds", trace, tracing::SpanKind::CLIENT, stream_start_ns);
+    stream_span.set("attempt", attempt).set("channel_index", static_cast<int64_t>(lease.index()));
+    const tracing::SpanContext stream_trace = stream_span.context();
     ClientContext context;
-    std::unique_ptr<ClientReaderWriter<Context, AdsList>> stream(stub_->GetAds(&context));
+    context.set_deadline(deadline);
+    if (stream_trace.valid()) {
+        context.AddMetadata(tracing::kTraceparentKey, stream_trace.traceparent());
+    }
+    if (race != nullptr && !race->enter(attempt, &context)) {
+        // The first stream delivered while this hedge was being set up
+        result.cancelled_by_client = true;
+        return;
+    }
+    std::unique_ptr<ClientReaderWriter<Context, AdsList>> stream(lease.stub().GetAds(&context));
     
-    std::string start_message = logging::LogContext()
-        .add("query", query)
-        .add("asin_id", asin_id)
-        .add("understanding_provided", !understanding.empty())
-        .build("Opening bidirectional stream");
-    logger.info(start_message);
+    logger.info_if_enabled("Opening bidirectional stream", [&](logging::LogFields& fields) {
+        fields.add("query", request.query())
+              .add("asin_id", request.asin_id())
+              .add("batch_items", request.items_size())
+              .add("hedge", attempt == 1)
+              .add("understanding_provided", !understanding.empty());
+        if (stream_trace.valid()) {
+            fields.add("trace_id", stream_trace.traceId());
+        }
+    });
     
     // Send Context messages in a separate thread
-    std::thread sender([this, &stream, &query, &asin_id, &understanding, &overall_timer]() {
-        sendContextMessages(stream.get(), query, asin_id, understanding, overall_timer);
+    SenderStop sender_stop;
+    std::thread sender([this, &stream, &request, &understanding, &overall_timer, &stream_trace, &sender_stop]() {
+        sendContextMessages(stream.get(), request, understanding, overall_timer, stream_trace, sender_stop);
     });
     
     // Receive AdsList messages with timeout logic
-    AdsList result = receiveAdsListWithTimeout(stream.get(), overall_timer);
+    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::system_clock::now());
+    receiveAdsListWithTimeout(stream.get(), overall_timer, stream_start_ns,
+                              std::max(0, static_cast<int>(remaining.count())), stream_trace,
+                              race, attempt, result);
+    if (race != nullptr && race->lost(attempt)) {
+        // The other stream of the hedged call delivered first
+        result.cancelled_by_client = true;
+    }
+    
+    // Finish() must not be called with messages still in flight, so drop the
+    // rest of the call when we stopped reading early
+    if (result.cancelled_by_client) {
+        context.TryCancel();
+    }
     
-    // Wait for sender thread to complete
+    // Wake the sender if it is still waiting to send the second Context
+    {
+        std::lock_guard<std::mutex> lock(sender_stop.mu);
+        sender_stop.stopped = true;
+    }
+    sender_stop.cv.notify_all();
     sender.join();
     
     // Finish the call
     Status status = stream->Finish();
-    if (!status.ok()) {
-        std::string error_message = logging::LogContext()
-            .add("error_code", status.error_code())
-            .add("error_message", status.error_message())
-            .add("elapsed_ms", overall_timer.elapsed_ms())
-            .build("GetAds RPC failed");
-        logger.error(error_message);
+    if (race != nullptr) {
+        race->leave(attempt);
+    }
+    lease.done(status);
+    result.status = status;
+    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+        // Our own deadline, i.e. the selection timeout, ended the call
+        result.cancelled_by_client = true;
+    }
+    stream_span.set("status_code", status.error_code())
+               .setFlag("cancelled_by_client", result.cancelled_by_client);
+    if (!status.ok() && !result.cancelled_by_client) {
+        stream_span.setError(status.error_message());
+    }
+    if (result.cancelled_by_client &&
+        (status.error_code() == grpc::StatusCode::CANCELLED ||
+         status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED)) {
+        logger.info_if_enabled("GetAds RPC cancelled after result selection", [&](logging::LogFields& fields) {
+            fields.add("total_duration_ms", overall_timer.elapsed_ms());
+        });
+    } else if (!status.ok()) {
+        logger.error_if_enabled("GetAds RPC failed", [&](logging::LogFields& fields) {
+            fields.add("error_code", status.error_code())
+                  .add("error_message", status.error_message())
+                  .add("elapsed_ms", overall_timer.elapsed_ms());
+        });
     } else {
-        std::string success_message = logging::LogContext()
-            .add("total_duration_ms", overall_timer.elapsed_ms())
-            .build("GetAds RPC completed successfully");
-        logger.info(success_message);
+        logger.info_if_enabled("GetAds RPC completed successfully", [&](logging::LogFields& fields) {
+            fields.add("total_duration_ms", overall_timer.elapsed_ms());
+        });
     }
-    
-    return result;
 }
 
 void AdsClient::sendContextMessages(ClientReaderWriter<Context, AdsList>* stream,
-                                  const std::string& query, 
-                                  const std::string& asin_id, 
+                                  const Context& request,
                                   const std::string& understanding,
-                                  const logging::Timer& overall_timer) {
+                                  const logging::Timer& overall_timer,
+                                  const tracing::SpanContext& trace,
+                                  SenderStop& stop) {
     // Send first Context message
-    Context context1;
-    context1.set_query(query);
-    context1.set_asin_id(asin_id);
+    Context context1 = request;
     context1.set_understanding(""); // Empty initially
+    context1.set_accept_delta(accept_delta_);
     
-    std::string first_context_message = logging::LogContext()
-        .add("context_number", 1)
-        .add("understanding_empty", true)
-        .add("elapsed_ms", overall_timer.elapsed_ms())
-        .build("Sending Context message");
-    logger.info(first_context_message);
+    logger.info_if_enabled("Sending Context message", [&](logging::LogFields& fields) {
+        fields.add("context_number", 1)
+              .add("understanding_empty", true)
+              .add("elapsed_ms", overall_timer.elapsed_ms());
+    });
     
-    if (stream->Write(context1)) {
+    bool written;
+    {
+        metrics::ScopedTimer write_timer(context_write_latency);
+        tracing::Span write_span("write Context", trace);
+        write_span.set("context_number", 1);
+        written = stream->Write(context1);
+    }
+    if (written) {
         logger.debug("First Context message sent successfully");
     } else {
         logger.error("Failed to send first Context message");
         return;
     }
     
-    // Wait 50ms before sending second message
+    // Wait 50ms before sending second message, unless the result was
+    // selected in the meantime
     logger.debug("Waiting 50ms before second Context message");
-    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    {
+        std::unique_lock<std::mutex> lock(stop.mu);
+        if (stop.cv.wait_for(lock, std::chrono::milliseconds(50), [&stop]() { return stop.stopped; })) {
+            logger.debug("Result selected before second Context message");
+            return;
+        }
+    }
     
     // Send second Context message with understanding
-    Context context2;
-    context2.set_query(query);
-    context2.set_asin_id(asin_id);
+    Context context2 = request;
     context2.set_understanding(understanding);
+    context2.set_accept_delta(accept_delta_);
     
-    std::string second_context_message = logging::LogContext()
-        .add("context_number", 2)
-        .add("understanding_length", understanding.length())
-        .add("elapsed_ms", overall_timer.elapsed_ms())
-        .build("Sending Context message");
-    logger.info(second_context_message);
+    logger.info_if_enabled("Sending Context message", [&](logging::LogFields& fields) {
+        fields.add("context_number", 2)
+              .add("understanding_length", understanding.length())
+              .add("elapsed_ms", overall_timer.elapsed_ms());
+    });
     
-    if (stream->Write(context2)) {
+    {
+        metrics::ScopedTimer write_timer(context_write_latency);
+        tracing::Span write_span("write Context", trace);
+        write_span.set("context_number", 2);
+        written = stream->Write(context2);
+    }
+    if (written) {
         logger.debug("Second Context message sent successfully");
     } else {
         logger.error("Failed to send second Context message");
@@ -106,25 +343,27 @@ void AdsClient::sendContextMessages(ClientReaderWriter<Context, AdsList>* stream
     // Half-close the stream (client side done sending)
     stream->WritesDone();
     
-    std::string half_close_message = logging::LogContext()
-        .add("elapsed_ms", overall_timer.elapsed_ms())
-        .build("Half-closed client stream");
-    logger.info(half_close_message);
+    logger.info_if_enabled("Half-closed client stream", [&](logging::LogFields& fields) {
+        fields.add("elapsed_ms", overall_timer.elapsed_ms());
+    });
 }
 
-AdsList AdsClient::receiveAdsListWithTimeout(ClientReaderWriter<Context, AdsList>* stream, 
-                                            const logging::Timer& overall_timer) {
-    std::map<uint32_t, AdsList> adsListBuffer; // Buffer by version number
-    AdsList currentAdsList;
+void AdsClient::receiveAdsListWithTimeout(ClientReaderWriter<Context, AdsList>* stream, 
+                                          const logging::Timer& overall_timer,
+                                          uint64_t stream_start_ns, int timeoutMs,
+                                          const tracing::SpanContext& trace,
+                                          HedgeRace* race, int attempt, GetAdsResult& result) {
+    // Every received AdsList is parsed straight into this arena and the buffer
+    // holds pointers, so buffering a version costs no copy and the whole set
+    // is released in one shot when this call returns.
+    google::protobuf::Arena arena;
+    std::map<uint32_t, AdsList*> adsListBuffer; // Buffer by version number
     
-    // Generate random timeout (30-120ms jittered)
-    int timeoutMs = generateRandomTimeout();
-    std::string timeout_message = logging::LogContext()
-        .add("timeout_ms", timeoutMs)
-        .add("min_timeout", 30)
-        .add("max_timeout", 120)
-        .build("Generated random timeout for result selection");
-    logger.info(timeout_message);
+    logger.info_if_enabled("Generated random timeout for result selection", [&](logging::LogFields& fields) {
+        fields.add("timeout_ms", timeoutMs)
+              .add("min_timeout", 30)
+              .add("max_timeout", 120);
+    });
     
     auto startTime = std::chrono::steady_clock::now();
     auto timeoutDuration = std::chrono::milliseconds(timeoutMs);
@@ -135,62 +374,96 @@ AdsList AdsClient::receiveAdsListWithTimeout(ClientReaderWriter<Context, AdsList
         auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - startTime);
         
         if (elapsed >= timeoutDuration) {
-            std::string timeout_reached_message = logging::LogContext()
-                .add("timeout_ms", timeoutMs)
-                .add("elapsed_ms", overall_timer.elapsed_ms())
-                .add("versions_received", adsListBuffer.size())
-                .build("Timeout reached, proceeding with available results");
-            logger.info(timeout_reached_message);
+            logger.info_if_enabled("Timeout reached, proceeding with available results", [&](logging::LogFields& fields) {
+                fields.add("timeout_ms", timeoutMs)
+                      .add("elapsed_ms", overall_timer.elapsed_ms())
+                      .add("versions_received", adsListBuffer.size());
+            });
+            result.cancelled_by_client = true;
             break;
         }
         
-        AdsList adsList;
+        AdsList& adsList = *google::protobuf::Arena::CreateMessage<AdsList>(&arena);
+        metrics::Stopwatch read_watch;
         if (stream->Read(&adsList)) {
+            read_latency.record(read_watch.elapsed_ns());
+            // Mostly the wait for the server to produce the next version
+            tracing::Span("read AdsList", trace, tracing::SpanKind::INTERNAL, read_watch.start_ns())
+                .set("version", adsList.version())
+                .setFlag("delta", adsList.has_delta())
+                .end();
+            if (adsListBuffer.empty()) {
+                first_adslist_latency.record_since(stream_start_ns);
+            }
             uint32_t version = adsList.version();
             bool is_replacement = adsListBuffer.find(version) != adsListBuffer.end();
+            bool is_delta = adsList.has_delta();
+            if (is_delta) {
+                // Rebuild the full list from the buffered base version
+                auto base = adsListBuffer.find(adsList.delta().base_version());
+                AdsList& rebuilt = *google::protobuf::Arena::CreateMessage<AdsList>(&arena);
+                try {
+                    if (base == adsListBuffer.end()) {
+                        throw std::invalid_argument("base version was not received");
+                    }
+                    ads_delta::apply(*base->second, adsList, &rebuilt);
+                } catch (const std::exception& e) {
+                    logger.error_if_enabled("Dropping AdsList delta", [&](logging::LogFields& fields) {
+                        fields.add("version", version)
+                              .add("base_version", adsList.delta().base_version())
+                              .add("error_message", e.what());
+                    });
+                    continue;
+                }
+                adsList.Swap(&rebuilt);
+            }
+            if (race != nullptr && adsListBuffer.empty() && !race->claim(attempt)) {
+                logger.info_if_enabled("Other hedged stream delivered first", [&](logging::LogFields& fields) {
+                    fields.add("hedge", attempt == 1)
+                          .add("elapsed_ms", overall_timer.elapsed_ms());
+                });
+                break;
+            }
             
-            std::string receive_message = logging::LogContext()
-                .add("version", version)
-                .add("ads_count", adsList.ads_size())
-                .add("elapsed_ms", overall_timer.elapsed_ms())
-                .add("is_replacement", is_replacement)
-                .build("Received AdsList");
-            logger.info(receive_message);
+            logger.info_if_enabled("Received AdsList", [&](logging::LogFields& fields) {
+                fields.add("version", version)
+                      .add("ads_count", adsList.ads_size())
+                      .add("batch_items", adsList.items_size())
+                      .add("delta", is_delta)
+                      .add("elapsed_ms", overall_timer.elapsed_ms())
+                      .add("is_replacement", is_replacement);
+            });
             
             // Log debug details about the ads if debug level is enabled
             if (logger.is_debug_enabled()) {
                 for (int i = 0; i < adsList.ads_size(); i++) {
                     const auto& ad = adsList.ads(i);
-                    std::string ad_message = logging::LogContext()
-                        .add("version", version)
-                        .add("ad_index", i)
-                        .add("asin_id", ad.asin_id())
-                        .add("ad_id", ad.ad_id())
-                        .add("score", ad.score())
-                        .build("Ad details");
-                    logger.debug(ad_message);
+                    logger.debug_if_enabled("Ad details", [&](logging::LogFields& fields) {
+                        fields.add("version", version)
+                              .add("ad_index", i)
+                              .add("asin_id", ad.asin_id())
+                              .add("ad_id", ad.ad_id())
+                              .add("score", ad.score());
+                    });
                 }
             }
             
             // Buffer the AdsList by version (replace older versions)
             if (is_replacement) {
-                std::string replace_message = logging::LogContext()
-                    .add("version", version)
-                    .add("old_ads_count", adsListBuffer[version].ads_size())
-                    .add("new_ads_count", adsList.ads_size())
-                    .build("Replaced AdsList in buffer");
-                logger.debug(replace_message);
+                logger.debug_if_enabled("Replaced AdsList in buffer", [&](logging::LogFields& fields) {
+                    fields.add("version", version)
+                          .add("old_ads_count", adsListBuffer[version]->ads_size())
+                          .add("new_ads_count", adsList.ads_size());
+                });
             }
             
-            adsListBuffer[version] = adsList;
-            currentAdsList = adsList; // Keep track of the most recent
+            adsListBuffer[version] = &adsList;
         } else {
             // Stream ended, break out of loop
-            std::string stream_end_message = logging::LogContext()
-                .add("elapsed_ms", overall_timer.elapsed_ms())
-                .add("versions_received", adsListBuffer.size())
-                .build("Stream ended");
-            logger.info(stream_end_message);
+            logger.info_if_enabled("Stream ended", [&](logging::LogFields& fields) {
+                fields.add("elapsed_ms", overall_timer.elapsed_ms())
+                      .add("versions_received", adsListBuffer.size());
+            });
             break;
         }
     }
@@ -202,53 +475,52 @@ AdsList AdsClient::receiveAdsListWithTimeout(ClientReaderWriter<Context, AdsList
         versions_oss << pair.first;
     }
     
-    std::string buffer_state_message = logging::LogContext()
-        .add("buffer_size", adsListBuffer.size())
-        .add("available_versions", versions_oss.str())
-        .add("elapsed_ms", overall_timer.elapsed_ms())
-        .build("Buffer state at timeout");
-    logger.debug(buffer_state_message);
+    logger.debug_if_enabled("Buffer state at timeout", [&](logging::LogFields& fields) {
+        fields.add("buffer_size", adsListBuffer.size())
+              .add("available_versions", versions_oss.str())
+              .add("elapsed_ms", overall_timer.elapsed_ms());
+    });
     
+    result.versions_received = adsListBuffer.size();
     // Return the latest version available
     if (!adsListBuffer.empty()) {
         auto latestEntry = adsListBuffer.rbegin(); // Get highest version
         uint32_t finalVersion = latestEntry->first;
-        AdsList finalResult = latestEntry->second;
+        // The only copy: the result has to outlive the arena
+        AdsList& finalResult = result.ads_list;
+        finalResult = *latestEntry->second;
         
-        std::string final_result_message = logging::LogContext()
-            .add("selected_version", finalVersion)
-            .add("ads_count", finalResult.ads_size())
-            .add("total_duration_ms", overall_timer.elapsed_ms())
-            .add("versions_considered", adsListBuffer.size())
-            .build("FINAL RESULT: Selected AdsList");
-        logger.info(final_result_message);
+        logger.info_if_enabled("FINAL RESULT: Selected AdsList", [&](logging::LogFields& fields) {
+            fields.add("selected_version", finalVersion)
+                  .add("ads_count", finalResult.ads_size())
+                  .add("total_duration_ms", overall_timer.elapsed_ms())
+                  .add("versions_considered", adsListBuffer.size());
+            if (trace.valid()) {
+                fields.add("trace_id", trace.traceId());
+            }
+        });
         
         // Log performance summary
-        std::string perf_message = logging::LogContext()
-            .add("operation", "bidirectional_stream")
-            .add("total_duration_ms", overall_timer.elapsed_ms())
-            .add("timeout_used_ms", timeoutMs)
-            .add("versions_received", adsListBuffer.size())
-            .add("final_version", finalVersion)
-            .build("Performance summary");
-        logger.info(perf_message);
-        
-        return finalResult;
+        logger.info_if_enabled("Performance summary", [&](logging::LogFields& fields) {
+            fields.add("operation", "bidirectional_stream")
+                  .add("total_duration_ms", overall_timer.elapsed_ms())
+                  .add("timeout_used_ms", timeoutMs)
+                  .add("versions_received", adsListBuffer.size())
+                  .add("final_version", finalVersion);
+        });
     } else {
-        std::string no_result_message = logging::LogContext()
-            .add("total_duration_ms", overall_timer.elapsed_ms())
-            .add("timeout_ms", timeoutMs)
-            .add("buffer_size", adsListBuffer.size())
-            .build("FINAL RESULT: No AdsList received within timeout");
-        logger.warn(no_result_message);
-        return AdsList(); // Return empty AdsList
+        logger.warn_if_enabled("FINAL RESULT: No AdsList received within timeout", [&](logging::LogFields& fields) {
+            fields.add("total_duration_ms", overall_timer.elapsed_ms())
+                  .add("timeout_ms", timeoutMs)
+                  .add("buffer_size", adsListBuffer.size());
+        });
     }
 }
 
 int AdsClient::generateRandomTimeout() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<> dis(30, 120);
+    // One generator per thread: concurrent callers must not share its state
+    thread_local std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<> dis(30, 120);
     return dis(gen);
 }
 
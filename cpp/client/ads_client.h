@@ -1,13 +1,19 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
 #include <string>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <grpcpp/grpcpp.h>
+#include <google/protobuf/arena.h>
 #include "ads.grpc.pb.h"
+#include "channel_pool.h"
+#include "hedge_policy.h"
 #include "../common/logging.h"
+#include "../common/metrics.h"
+#include "../common/tracing.h"
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -16,30 +22,98 @@ using grpc::Status;
 using ads::Context;
 using ads::AdsList;
 using ads::AdsService;
+using ads::BatchItem;
+
+// Everything one GetAds call produced, for callers that need more than the
+// selected AdsList (e.g. ads_loadgen)
+struct GetAdsResult {
+    // Highest version received before the selection timeout; empty if none
+    AdsList ads_list;
+    // Final RPC status. CANCELLED or DEADLINE_EXCEEDED is expected when the
+    // selection timeout ended the call (see cancelled_by_client)
+    Status status;
+    // The call was cut off at the selection timeout rather than completed
+    bool cancelled_by_client = false;
+    int timeout_ms = 0;
+    size_t versions_received = 0;
+};
 
 class AdsClient {
 public:
-    AdsClient(std::shared_ptr<Channel> channel);
+    // With accept_delta the server may send versions 2 and 3 as an AdsDelta
+    // against the previous version; they are rebuilt into full lists here
+    AdsClient(std::shared_ptr<Channel> channel, bool accept_delta = false);
+    // Spreads calls over the pool's channels; the pool may be shared with
+    // other clients. With hedging, a call that has no AdsList after the
+    // policy's delay opens a second stream on another channel and keeps
+    // whichever stream delivers first, cancelling the other.
+    AdsClient(std::shared_ptr<ChannelPool> pool, bool accept_delta = false,
+              std::shared_ptr<HedgePolicy> hedging = nullptr);
     
     // Main method to get ads with bidirectional streaming
     AdsList getAds(const std::string& query, const std::string& asin_id, const std::string& understanding);
+
+    // Same, reporting the status and selection details. timeout_ms <= 0 uses
+    // the usual random 30-120ms selection timeout. The timeout is also the
+    // RPC deadline, so the server sees the client's budget and the call
+    // returns as soon as it expires even while a Read is blocked.
+    GetAdsResult getAdsResult(const std::string& query, const std::string& asin_id,
+                              const std::string& understanding, int timeout_ms = 0);
+
+    // Batch mode: one stream for all items, with understanding applied to
+    // each. The selected list holds one ItemAds per item, in order, in
+    // ads_list.items.
+    GetAdsResult getAdsBatchResult(const std::vector<BatchItem>& items,
+                                   const std::string& understanding, int timeout_ms = 0);
     
     // Shutdown the client
     void shutdown();
 
+    // Random selection timeout (30-120ms jittered); safe to call from any thread
+    static int generateRandomTimeout();
+
 private:
-    std::unique_ptr<AdsService::Stub> stub_;
+    std::shared_ptr<ChannelPool> pool_;
+    const bool accept_delta_;
+    std::shared_ptr<HedgePolicy> hedging_;
+
+    // The streams of one hedged call (0 is the first, 1 the hedge)
+    struct HedgeRace;
     
+    // Lets the receiving side stop the sender before its second Context
+    struct SenderStop {
+        std::mutex mu;
+        std::condition_variable cv;
+        bool stopped = false;
+    };
+
+    // One GetAds call; request carries the lookup (query and asin_id, or
+    // batch items) and is sent twice, the second time with understanding
+    GetAdsResult runGetAds(const Context& request, const std::string& understanding,
+                           int timeout_ms);
+
+    // One stream on lease's channel, ending at deadline at the latest, traced
+    // as a child of trace. race is null for an unhedged call.
+    void runAttempt(const Context& request, const std::string& understanding,
+                    std::chrono::system_clock::time_point deadline, ChannelPool::Lease lease,
+                    const tracing::SpanContext& trace, HedgeRace* race, int attempt,
+                    GetAdsResult& result);
+
     // Helper methods
     void sendContextMessages(ClientReaderWriter<Context, AdsList>* stream,
-                           const std::string& query, 
-                           const std::string& asin_id, 
+                           const Context& request,
                            const std::string& understanding,
-                           const logging::Timer& overall_timer);
-    
-    AdsList receiveAdsListWithTimeout(ClientReaderWriter<Context, AdsList>* stream,
-                                     const logging::Timer& overall_timer);
+                           const logging::Timer& overall_timer,
+                           const tracing::SpanContext& trace,
+                           SenderStop& stop);
     
-    // Random timeout generation (30-120ms jittered)
-    int generateRandomTimeout();
+    // stream_start_ns is the metrics::now_ns() at which the stream was opened.
+    // Fills result's ads_list, versions_received and cancelled_by_client; the
+    // latter is set when the timeout expired before the stream ended. With a
+    // race, reading stops as soon as the other stream delivered first.
+    void receiveAdsListWithTimeout(ClientReaderWriter<Context, AdsList>* stream,
+                                   const logging::Timer& overall_timer,
+                                   uint64_t stream_start_ns, int timeoutMs,
+                                   const tracing::SpanContext& trace,
+                                   HedgeRace* race, int attempt, GetAdsResult& result);
 };
\ No newline at end of file
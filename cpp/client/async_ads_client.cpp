@@ -0,0 +1,274 @@
+#include "async_ads_client.h"
+#include "../common/ads_delta.h"
+#include "../common/logging.h"
+#include "../common/metrics.h"
+#include <chrono>
+
+static logging::Logger logger("CLIENT");
+
+// Shared with AdsClient, see metrics::Registry
+static metrics::Histogram& first_adslist_latency =
+    metrics::Registry::instance().histogram("client_time_to_first_adslist");
+static metrics::Histogram& session_latency =
+    metrics::Registry::instance().histogram("client_session_duration");
+
+static std::chrono::system_clock::time_point FromNow(int ms) {
+    return std::chrono::system_clock::now() + std::chrono::milliseconds(ms);
+}
+
+/**
+ * One GetAds call. Owns itself from construction and deletes itself in
+ * OnDone. Two holds keep OnDone from running while an alarm is pending: one
+ * for the second-Context delay and one for the selection timeout.
+ */
+class AsyncAdsClient::Call final : public grpc::ClientBidiReactor<Context, AdsList> {
+public:
+    // request carries the lookup, as for AdsClient::runGetAds
+    Call(AsyncAdsClient* client, const Context& request, const std::string& understanding,
+         int timeout_ms, Callback done)
+        : client_(client), done_(std::move(done)), start_ns_(metrics::now_ns()),
+          span_("ads.AdsService/GetAds", tracing::startTrace(), tracing::SpanKind::CLIENT, start_ns_) {
+        result_.timeout_ms = timeout_ms > 0 ? timeout_ms : AdsClient::generateRandomTimeout();
+
+        first_context_ = request;
+        first_context_.set_understanding("");
+        second_context_ = request;
+        second_context_.set_understanding(understanding);
+        first_context_.set_accept_delta(client->accept_delta_);
+        second_context_.set_accept_delta(client->accept_delta_);
+
+        logger.info_if_enabled("Opening bidirectional stream", [&](logging::LogFields& fields) {
+            fields.add("query", request.query())
+                  .add("asin_id", request.asin_id())
+                  .add("batch_items", request.items_size())
+                  .add("understanding_provided", !understanding.empty())
+                  .add("timeout_ms", result_.timeout_ms);
+            if (span_.context().valid()) {
+                fields.add("trace_id", span_.context().traceId());
+            }
+        });
+
+        // Tells the server how long this client will wait for refinements
+        context_.set_deadline(FromNow(result_.timeout_ms));
+        if (span_.context().valid()) {
+            context_.AddMetadata(tracing::kTraceparentKey, span_.context().traceparent());
+        }
+        lease_ = client->pool_->acquire();
+        span_.set("timeout_ms", result_.timeout_ms)
+             .set("channel_index", static_cast<int64_t>(lease_.index()));
+        lease_.stub().async()->GetAds(&context_, this);
+        AddMultipleHolds(2);
+        selection_alarm_.Set(FromNow(result_.timeout_ms), [this](bool fired) { onSelectionTimeout(fired); });
+        StartWrite(&first_context_);
+        StartRead(&incoming_);
+        StartCall();
+    }
+
+    void OnWriteDone(bool ok) override {
+        if (!ok) {
+            // The stream is broken; OnReadDone will see it too
+            if (!second_context_sent_) {
+                RemoveHold();
+            }
+            return;
+        }
+        if (!second_context_sent_) {
+            second_context_sent_ = true;
+            delay_alarm_.Set(FromNow(50), [this](bool fired) {
+                if (fired) {
+                    StartWrite(&second_context_);
+                }
+                RemoveHold();
+            });
+            return;
+        }
+        StartWritesDone();
+    }
+
+    void OnReadDone(bool ok) override {
+        if (!ok) {
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                stream_ended_ = true;
+            }
+            logger.info("Stream ended");
+            // Nothing more can arrive; select now instead of at the timeout
+            selection_alarm_.Cancel();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            // A delta that cannot be rebuilt is dropped like a late list
+            if (!selected_ && (!incoming_.has_delta() || rebuildFromDelta())) {
+                if (result_.versions_received == 0) {
+                    first_adslist_latency.record_since(start_ns_);
+                }
+                result_.versions_received++;
+                // A higher or equal version replaces the current best
+                if (incoming_.version() >= result_.ads_list.version()) {
+                    result_.ads_list.Swap(&incoming_);
+                }
+            }
+        }
+        StartRead(&incoming_);
+    }
+
+    void OnDone(const Status& status) override {
+        session_latency.record_since(start_ns_);
+        lease_.done(status);
+        result_.status = status;
+        if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+            // The deadline can beat the selection alarm by a hair
+            result_.cancelled_by_client = true;
+        }
+        if (result_.cancelled_by_client &&
+            (status.error_code() == grpc::StatusCode::CANCELLED ||
+             status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED)) {
+            logger.info_if_enabled("GetAds RPC cancelled after result selection", [&](logging::LogFields& fields) {
+                fields.add("selected_version", result_.ads_list.version());
+            });
+        } else if (!status.ok()) {
+            logger.error_if_enabled("GetAds RPC failed", [&](logging::LogFields& fields) {
+                fields.add("error_code", status.error_code())
+                      .add("error_message", status.error_message());
+            });
+            span_.setError(status.error_message());
+        }
+        span_.set("selected_version", result_.ads_list.version())
+             .set("versions_received", static_cast<int64_t>(result_.versions_received))
+             .end();
+        AsyncAdsClient* client = client_;
+        Callback done = std::move(done_);
+        GetAdsResult result = std::move(result_);
+        delete this;
+        done(std::move(result));
+        client->callDone();
+    }
+
+private:
+    // Requires mu_. Replaces the delta in incoming_ with the full list; its
+    // base is the best list so far, which is always the previous version
+    bool rebuildFromDelta() {
+        AdsList rebuilt;
+        try {
+            ads_delta::apply(result_.ads_list, incoming_, &rebuilt);
+        } catch (const std::exception& e) {
+            logger.error_if_enabled("Dropping AdsList delta", [&](logging::LogFields& fields) {
+                fields.add("version", incoming_.version())
+                      .add("base_version", incoming_.delta().base_version())
+                      .add("error_message", e.what());
+            });
+            return false;
+        }
+        incoming_.Swap(&rebuilt);
+        return true;
+    }
+
+    // fired is false when the alarm was cancelled because the stream ended
+    void onSelectionTimeout(bool fired) {
+        bool cancel = false;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            selected_ = true;
+            cancel = fired && !stream_ended_;
+            result_.cancelled_by_client = cancel;
+        }
+        if (cancel) {
+            logger.info_if_enabled("Timeout reached, proceeding with available results", [&](logging::LogFields& fields) {
+                fields.add("timeout_ms", result_.timeout_ms)
+                      .add("versions_received", result_.versions_received);
+            });
+            // The server stops generating and OnDone follows with CANCELLED
+            context_.TryCancel();
+        }
+        RemoveHold();
+    }
+
+    AsyncAdsClient* client_;
+    ChannelPool::Lease lease_;
+    Callback done_;
+    const uint64_t start_ns_;
+    // Only the call as a whole is traced; its context goes to the server
+    tracing::Span span_;
+    ClientContext context_;
+    Context first_context_;
+    Context second_context_;
+    AdsList incoming_;
+    bool second_context_sent_ = false;
+    grpc::Alarm delay_alarm_;
+    grpc::Alarm selection_alarm_;
+
+    // Guards the fields below; reads and the alarms run on different threads
+    std::mutex mu_;
+    GetAdsResult result_;
+    bool selected_ = false;
+    bool stream_ended_ = false;
+};
+
+AsyncAdsClient::AsyncAdsClient(std::shared_ptr<Channel> channel, bool accept_delta)
+    : AsyncAdsClient(std::make_shared<ChannelPool>(std::move(channel)), accept_delta) {
+}
+
+AsyncAdsClient::AsyncAdsClient(std::shared_ptr<ChannelPool> pool, bool accept_delta)
+    : pool_(std::move(pool)), accept_delta_(accept_delta) {
+}
+
+AsyncAdsClient::~AsyncAdsClient() {
+    shutdown();
+}
+
+void AsyncAdsClient::getAds(const std::string& query, const std::string& asin_id,
+                            const std::string& understanding, Callback done, int timeout_ms) {
+    Context request;
+    request.set_query(query);
+    request.set_asin_id(asin_id);
+    start(request, understanding, std::move(done), timeout_ms);
+}
+
+void AsyncAdsClient::getAdsBatch(const std::vector<BatchItem>& items,
+                                 const std::string& understanding, Callback done, int timeout_ms) {
+    Context request;
+    request.mutable_items()->Reserve(static_cast<int>(items.size()));
+    for (const BatchItem& item : items) {
+        *request.add_items() = item;
+    }
+    start(request, understanding, std::move(done), timeout_ms);
+}
+
+void AsyncAdsClient::start(const Context& request, const std::string& understanding,
+                           Callback done, int timeout_ms) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_++;
+    }
+    new Call(this, request, understanding, timeout_ms, std::move(done));
+}
+
+std::future<GetAdsResult> AsyncAdsClient::getAds(const std::string& query,
+                                                 const std::string& asin_id,
+                                                 const std::string& understanding,
+                                                 int timeout_ms) {
+    auto promise = std::make_shared<std::promise<GetAdsResult>>();
+    std::future<GetAdsResult> future = promise->get_future();
+    getAds(query, asin_id, understanding,
+           [promise](GetAdsResult result) { promise->set_value(std::move(result)); },
+           timeout_ms);
+    return future;
+}
+
+size_t AsyncAdsClient::inFlight() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_flight_;
+}
+
+void AsyncAdsClient::callDone() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--in_flight_ == 0) {
+        idle_.notify_all();
+    }
+}
+
+void AsyncAdsClient::shutdown() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this]() { return in_flight_ == 0; });
+}
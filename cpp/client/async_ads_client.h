@@ -0,0 +1,70 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+#include "ads.grpc.pb.h"
+#include "ads_client.h"
+
+/**
+ * Non-blocking counterpart of AdsClient.
+ *
+ * Every call is a ClientBidiReactor driven by gRPC's callback threads, so a
+ * request costs no thread of its own no matter how many are in flight. The
+ * 50ms delay before the second Context and the selection timeout are
+ * grpc::Alarms rather than sleeping threads.
+ *
+ * Selection follows AdsClient: the timeout is sent as the RPC deadline;
+ * when it expires (or the stream ends first) the highest version received
+ * is chosen, the rest of the call is cancelled and the callback runs with
+ * the final status, on a gRPC thread. Callbacks must therefore not block.
+ */
+class AsyncAdsClient {
+public:
+    using Callback = std::function<void(GetAdsResult)>;
+
+    // accept_delta as for AdsClient
+    explicit AsyncAdsClient(std::shared_ptr<Channel> channel, bool accept_delta = false);
+    explicit AsyncAdsClient(std::shared_ptr<ChannelPool> pool, bool accept_delta = false);
+    // Waits for the calls still in flight
+    ~AsyncAdsClient();
+
+    AsyncAdsClient(const AsyncAdsClient&) = delete;
+    AsyncAdsClient& operator=(const AsyncAdsClient&) = delete;
+
+    // timeout_ms <= 0 uses the random 30-120ms selection timeout
+    void getAds(const std::string& query, const std::string& asin_id,
+                const std::string& understanding, Callback done, int timeout_ms = 0);
+
+    std::future<GetAdsResult> getAds(const std::string& query, const std::string& asin_id,
+                                     const std::string& understanding, int timeout_ms = 0);
+
+    // Batch mode, as AdsClient::getAdsBatchResult
+    void getAdsBatch(const std::vector<BatchItem>& items, const std::string& understanding,
+                     Callback done, int timeout_ms = 0);
+
+    size_t inFlight();
+
+    // Blocks until every call started so far has run its callback
+    void shutdown();
+
+private:
+    class Call;
+
+    void start(const Context& request, const std::string& understanding, Callback done,
+               int timeout_ms);
+    void callDone();
+
+    std::shared_ptr<ChannelPool> pool_;
+    const bool accept_delta_;
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    size_t in_flight_ = 0;
+};
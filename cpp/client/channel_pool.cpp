@@ -0,0 +1,176 @@
+#include "channel_pool.h"
+#include "../common/logging.h"
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+static logging::Logger logger("CLIENT");
+
+// Distinct per channel so channels to one target are never shared
+static const char* kChannelIndexArg = "ads.channel_pool_index";
+
+ChannelPool::Lease::Lease(Lease&& other) noexcept
+    : pool_(other.pool_), index_(other.index_), generation_(other.generation_),
+      stub_(std::move(other.stub_)) {
+    other.pool_ = nullptr;
+}
+
+ChannelPool::Lease& ChannelPool::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        if (pool_ != nullptr) {
+            pool_->release(index_, generation_, nullptr);
+        }
+        pool_ = other.pool_;
+        index_ = other.index_;
+        generation_ = other.generation_;
+        stub_ = std::move(other.stub_);
+        other.pool_ = nullptr;
+    }
+    return *this;
+}
+
+ChannelPool::Lease::~Lease() {
+    if (pool_ != nullptr) {
+        pool_->release(index_, generation_, nullptr);
+    }
+}
+
+void ChannelPool::Lease::done(const grpc::Status& status) {
+    if (pool_ != nullptr) {
+        pool_->release(index_, generation_, &status);
+        pool_ = nullptr;
+    }
+}
+
+ChannelPool::ChannelPool(std::string target, Options options)
+    : target_(std::move(target)), options_(std::move(options)),
+      evictions_(metrics::Registry::instance().counter(
+          "ads_client_channel_evictions_total", "",
+          "Pooled channels recreated after repeated UNAVAILABLE calls")) {
+    if (options_.size == 0) {
+        throw std::invalid_argument("ChannelPool requires at least one channel");
+    }
+    slots_.resize(options_.size);
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        slots_[i].channel = createChannel(i);
+        slots_[i].stub = ads::AdsService::NewStub(slots_[i].channel);
+    }
+}
+
+ChannelPool::ChannelPool(std::shared_ptr<grpc::Channel> channel)
+    : options_([]() {
+          Options options;
+          options.size = 1;
+          options.eviction_failures = 0;
+          return options;
+      }()),
+      evictions_(metrics::Registry::instance().counter(
+          "ads_client_channel_evictions_total", "",
+          "Pooled channels recreated after repeated UNAVAILABLE calls")) {
+    slots_.resize(1);
+    slots_[0].stub = ads::AdsService::NewStub(channel);
+    slots_[0].channel = std::move(channel);
+}
+
+ChannelPool::Selection ChannelPool::parseSelection(const std::string& name) {
+    if (name == "round-robin") {
+        return Selection::ROUND_ROBIN;
+    }
+    if (name == "least-loaded") {
+        return Selection::LEAST_LOADED;
+    }
+    throw std::invalid_argument("unknown channel selection '" + name +
+                                "' (expected round-robin or least-loaded)");
+}
+
+std::shared_ptr<grpc::Channel> ChannelPool::createChannel(size_t index) {
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    args.SetInt(kChannelIndexArg, static_cast<int>(index));
+    return grpc::CreateCustomChannel(target_, options_.credentials, args);
+}
+
+bool ChannelPool::usable(Slot& slot) {
+    // false: only look, never kick off a connection attempt from here
+    return slot.channel->GetState(false) != GRPC_CHANNEL_TRANSIENT_FAILURE;
+}
+
+ChannelPool::Lease ChannelPool::acquire(size_t avoid) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t count = slots_.size();
+    if (count == 1) {
+        avoid = kNoChannel;
+    }
+    size_t chosen = count;
+    if (options_.selection == Selection::LEAST_LOADED) {
+        // Ties go to the round-robin order so idle channels are all used
+        size_t least = std::numeric_limits<size_t>::max();
+        for (size_t n = 0; n < count; ++n) {
+            size_t i = (next_ + n) % count;
+            if (i != avoid && slots_[i].in_flight < least && usable(slots_[i])) {
+                least = slots_[i].in_flight;
+                chosen = i;
+            }
+        }
+    } else {
+        for (size_t n = 0; n < count && chosen == count; ++n) {
+            size_t i = (next_ + n) % count;
+            if (i != avoid && usable(slots_[i])) {
+                chosen = i;
+            }
+        }
+    }
+    if (chosen == count) {
+        // Nothing looks healthy; let gRPC's own reconnect logic sort it out
+        chosen = next_ % count;
+        if (chosen == avoid) {
+            chosen = (chosen + 1) % count;
+        }
+    }
+    next_ = chosen + 1;
+
+    Slot& slot = slots_[chosen];
+    slot.in_flight++;
+    Lease lease;
+    lease.pool_ = this;
+    lease.index_ = chosen;
+    lease.generation_ = slot.generation;
+    lease.stub_ = slot.stub;
+    return lease;
+}
+
+size_t ChannelPool::inFlight(size_t index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return slots_.at(index).in_flight;
+}
+
+void ChannelPool::release(size_t index, uint64_t generation, const grpc::Status* status) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot& slot = slots_[index];
+    if (slot.generation != generation) {
+        // The channel was evicted while this call ran; its count went with it
+        return;
+    }
+    slot.in_flight--;
+    if (status == nullptr) {
+        return;
+    }
+    if (status->error_code() != grpc::StatusCode::UNAVAILABLE) {
+        slot.consecutive_failures = 0;
+        return;
+    }
+    if (options_.eviction_failures <= 0 || ++slot.consecutive_failures < options_.eviction_failures) {
+        return;
+    }
+    logger.warn_if_enabled("Recreating pooled channel after repeated failures", [&](logging::LogFields& fields) {
+        fields.add("channel_index", index)
+              .add("consecutive_failures", slot.consecutive_failures)
+              .add("error_message", status->error_message());
+    });
+    evictions_.add();
+    slot.channel = createChannel(index);
+    slot.stub = ads::AdsService::NewStub(slot.channel);
+    slot.in_flight = 0;
+    slot.consecutive_failures = 0;
+    slot.generation++;
+}
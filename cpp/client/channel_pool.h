@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <grpcpp/grpcpp.h>
+#include "ads.grpc.pb.h"
+#include "../common/metrics.h"
+
+/**
+ * A fixed number of independent channels (HTTP/2 connections) to one
+ * target, shared by AdsClient and AsyncAdsClient.
+ *
+ * Every channel gets its own subchannel pool and a distinct channel arg, so
+ * gRPC never collapses them into one connection: streams are spread over N
+ * connections instead of queueing behind one connection's
+ * max-concurrent-streams limit.
+ *
+ * acquire() picks a channel round-robin or by fewest streams in flight,
+ * skipping channels in TRANSIENT_FAILURE while any other is usable. A
+ * channel whose calls end UNAVAILABLE eviction_failures times in a row is
+ * replaced by a freshly created one; calls still running on the old one
+ * finish normally.
+ */
+class ChannelPool {
+public:
+    enum class Selection {
+        ROUND_ROBIN,
+        LEAST_LOADED
+    };
+
+    struct Options {
+        size_t size = 4;
+        Selection selection = Selection::ROUND_ROBIN;
+        // Consecutive UNAVAILABLE calls after which a channel is recreated
+        // (0 never evicts)
+        int eviction_failures = 3;
+        std::shared_ptr<grpc::ChannelCredentials> credentials = grpc::InsecureChannelCredentials();
+    };
+
+    /**
+     * One channel checked out for a call. It counts as in flight on its
+     * channel until done() is called or the lease is destroyed; done()
+     * feeds the call's status into the channel's health.
+     */
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&& other) noexcept;
+        ~Lease();
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ads::AdsService::Stub& stub() const { return *stub_; }
+        size_t index() const { return index_; }
+
+        void done(const grpc::Status& status);
+
+    private:
+        friend class ChannelPool;
+
+        ChannelPool* pool_ = nullptr;
+        size_t index_ = 0;
+        uint64_t generation_ = 0;
+        std::shared_ptr<ads::AdsService::Stub> stub_;
+    };
+
+    ChannelPool(std::string target, Options options);
+    // Wraps one existing channel; it is never evicted since it cannot be
+    // recreated
+    explicit ChannelPool(std::shared_ptr<grpc::Channel> channel);
+
+    ChannelPool(const ChannelPool&) = delete;
+    ChannelPool& operator=(const ChannelPool&) = delete;
+
+    static constexpr size_t kNoChannel = static_cast<size_t>(-1);
+
+    // avoid names a channel not to pick while the pool has any other, e.g.
+    // the one a hedged call's first stream is on
+    Lease acquire(size_t avoid = kNoChannel);
+
+    size_t size() const { return slots_.size(); }
+    // Streams currently in flight on channel index
+    size_t inFlight(size_t index);
+
+    static Selection parseSelection(const std::string& name);
+
+private:
+    struct Slot {
+        std::shared_ptr<grpc::Channel> channel;
+        std::shared_ptr<ads::AdsService::Stub> stub;
+        size_t in_flight = 0;
+        int consecutive_failures = 0;
+        // Bumped on eviction so results of calls on the old channel are ignored
+        uint64_t generation = 0;
+    };
+
+    std::shared_ptr<grpc::Channel> createChannel(size_t index);
+    // Requires mutex_
+    bool usable(Slot& slot);
+    void release(size_t index, uint64_t generation, const grpc::Status* status);
+
+    const std::string target_;
+    const Options options_;
+    metrics::Counter& evictions_;
+
+    std::mutex mutex_;
+    std::vector<Slot> slots_;
+    size_t next_ = 0;
+};
@@ -0,0 +1,87 @@
+#include "hedge_policy.h"
+#include <algorithm>
+#include <stdexcept>
+
+HedgePolicy::HedgePolicy(Options options)
+    : options_(options),
+      // Recorded per stream by AdsClient and AsyncAdsClient
+      first_adslist_latency_(metrics::Registry::instance().histogram("client_time_to_first_adslist")),
+      issued_(metrics::Registry::instance().counter(
+          "ads_client_hedges_total", "result=\"issued\"",
+          "Hedged GetAds streams by outcome")),
+      won_(metrics::Registry::instance().counter(
+          "ads_client_hedges_total", "result=\"won\"",
+          "Hedged GetAds streams by outcome")),
+      suppressed_(metrics::Registry::instance().counter(
+          "ads_client_hedges_total", "result=\"suppressed\"",
+          "Hedged GetAds streams by outcome")),
+      delay_gauge_(metrics::Registry::instance().counter(
+          "ads_client_hedge_delay_ms", "",
+          "Current wait for a first AdsList before hedging", metrics::Counter::Kind::GAUGE)),
+      delay_ms_(options.max_delay_ms),
+      tokens_(options.budget_burst) {
+    if (options_.percentile <= 0 || options_.percentile > 1) {
+        throw std::invalid_argument("hedge percentile must be in (0, 1]");
+    }
+    if (options_.min_delay_ms < 0 || options_.max_delay_ms < options_.min_delay_ms) {
+        throw std::invalid_argument("hedge delay bounds must satisfy 0 <= min <= max");
+    }
+    if (options_.budget_ratio < 0 || options_.budget_burst < 1) {
+        throw std::invalid_argument("hedge budget needs a ratio >= 0 and a burst >= 1");
+    }
+    delay_gauge_.add(delay_ms_.load());
+    last_snapshot_ = first_adslist_latency_.snapshot();
+}
+
+void HedgePolicy::onCall() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tokens_ = std::min(options_.budget_burst, tokens_ + options_.budget_ratio);
+}
+
+int HedgePolicy::delayMs() {
+    uint64_t now = metrics::now_ns();
+    uint64_t interval_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(options_.refresh_interval).count());
+    {
+        std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+        // Whoever holds the lock is refreshing or spending tokens; the
+        // current delay is good enough for everyone else
+        if (lock.owns_lock() && now - last_refresh_ns_ >= interval_ns) {
+            refreshDelay(now);
+        }
+    }
+    return delay_ms_.load(std::memory_order_relaxed);
+}
+
+void HedgePolicy::refreshDelay(uint64_t now_ns) {
+    last_refresh_ns_ = now_ns;
+    metrics::HistogramSnapshot current = first_adslist_latency_.snapshot();
+    metrics::HistogramSnapshot window = current.since(last_snapshot_);
+    if (window.count < options_.min_samples) {
+        // Keep accumulating into the same window
+        return;
+    }
+    last_snapshot_ = std::move(current);
+    uint64_t percentile_ns = window.percentile(options_.percentile);
+    int delay_ms = static_cast<int>((percentile_ns + 999999) / 1000000);
+    delay_ms = std::max(options_.min_delay_ms, std::min(options_.max_delay_ms, delay_ms));
+    int previous = delay_ms_.exchange(delay_ms);
+    delay_gauge_.add(delay_ms - previous);
+}
+
+bool HedgePolicy::tryHedge() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tokens_ >= 1) {
+            tokens_ -= 1;
+            issued_.add();
+            return true;
+        }
+    }
+    suppressed_.add();
+    return false;
+}
+
+void HedgePolicy::recordHedgeWon() {
+    won_.add();
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include "../common/metrics.h"
+
+/**
+ * When and how often AdsClient hedges a call.
+ *
+ * A call that has no AdsList after delayMs() opens a second, identical
+ * stream on another pooled channel; whichever stream delivers an AdsList
+ * first is kept and the other is cancelled. The delay follows a percentile
+ * of the client's time to first AdsList, recomputed every refresh_interval
+ * from the streams seen since the last refresh and clamped to
+ * [min_delay_ms, max_delay_ms]; until min_samples streams have been seen it
+ * is max_delay_ms.
+ *
+ * Hedges are paid for from a token bucket that earns budget_ratio tokens per
+ * call and holds at most budget_burst, so no more than about budget_ratio of
+ * all calls are hedged however slow the server gets. That keeps hedging
+ * from doubling the load on a backend that is slow because it is overloaded.
+ *
+ * One policy may be shared by any number of clients and threads.
+ */
+class HedgePolicy {
+public:
+    struct Options {
+        // Percentile of the time to first AdsList to wait before hedging
+        double percentile = 0.95;
+        int min_delay_ms = 5;
+        int max_delay_ms = 100;
+        // Hedges per call allowed in the long run, and the burst on top
+        double budget_ratio = 0.05;
+        double budget_burst = 10;
+        std::chrono::milliseconds refresh_interval{1000};
+        size_t min_samples = 20;
+    };
+
+    explicit HedgePolicy(Options options);
+
+    HedgePolicy(const HedgePolicy&) = delete;
+    HedgePolicy& operator=(const HedgePolicy&) = delete;
+
+    // Called once per call; earns the call's share of the hedge budget
+    void onCall();
+
+    // How long a call waits for its first AdsList before hedging
+    int delayMs();
+
+    // Spends one token for a hedge that is due; false when the budget is
+    // exhausted. Counts the hedge as issued or suppressed either way.
+    bool tryHedge();
+
+    // The hedge stream delivered the kept result
+    void recordHedgeWon();
+
+    int64_t issued() const { return issued_.value(); }
+    int64_t won() const { return won_.value(); }
+    int64_t suppressed() const { return suppressed_.value(); }
+
+private:
+    void refreshDelay(uint64_t now_ns);
+
+    const Options options_;
+    metrics::Histogram& first_adslist_latency_;
+    metrics::Counter& issued_;
+    metrics::Counter& won_;
+    metrics::Counter& suppressed_;
+    metrics::Counter& delay_gauge_;
+
+    std::atomic<int> delay_ms_;
+    std::mutex mutex_;
+    // Guarded by mutex_
+    double tokens_;
+    uint64_t last_refresh_ns_ = 0;
+    metrics::HistogramSnapshot last_snapshot_;
+};
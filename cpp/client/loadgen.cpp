@@ -0,0 +1,571 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <grpcpp/grpcpp.h>
+#include "ads_client.h"
+#include "async_ads_client.h"
+#include "hedge_policy.h"
+#include "../common/logging.h"
+#include "../common/metrics.h"
+
+/**
+ * Load generator for AdsService.GetAds built on AdsClient.
+ *
+ *   closed   every worker starts its next request when the previous one
+ *            returns, so the offered load adapts to the server
+ *   poisson  requests arrive with exponential gaps at --qps on average
+ *   fixed    requests arrive every 1/--qps seconds
+ *
+ * In the open-loop modes latency is measured from the scheduled arrival,
+ * so time spent queued behind busy workers counts against the server
+ * instead of being hidden (no coordinated omission).
+ *
+ * --client=async uses AsyncAdsClient instead of worker threads: closed loop
+ * keeps --concurrency calls in flight, open loop starts every arrival
+ * immediately with no bound on the calls in flight.
+ *
+ * --report=PATH appends the summary as one tab-separated row to PATH,
+ * writing a header line first when the file is new or empty, for scripts
+ * such as scripts/soak-cpp.sh.
+ */
+
+struct LoadgenOptions {
+    std::string target = "localhost:50051";
+    // Workers, i.e. GetAds streams in flight at most
+    size_t concurrency = 8;
+    // Channels in the shared ChannelPool; each has its own connection
+    size_t channels = 1;
+    // How calls pick a pooled channel: "round-robin" or "least-loaded"
+    std::string pick = "round-robin";
+    std::string mode = "closed";
+    // "sync" runs one AdsClient per worker thread, "async" multiplexes all
+    // calls over AsyncAdsClient
+    std::string client = "sync";
+    double qps = 100;
+    double duration_s = 10;
+    // Selection timeout passed to AdsClient (0 keeps the random 30-120ms)
+    int timeout_ms = 0;
+    // TSV lines "query<TAB>asin_id<TAB>understanding"; empty uses a built-in set
+    std::string corpus_path;
+    uint64_t seed = 1;
+    // Ask the server for delta-encoded refinements (Context.accept_delta)
+    bool delta = false;
+    // Items per request in batch mode (Context.items); 0 sends one query
+    // and asin_id per stream
+    size_t batch = 0;
+    // Appends a TSV summary row here when set
+    std::string report_path;
+    // Hedge slow calls (sync client only), see HedgePolicy
+    bool hedge = false;
+    HedgePolicy::Options hedge_options;
+};
+
+struct CorpusEntry {
+    std::string query;
+    std::string asin_id;
+    std::string understanding;
+};
+
+static bool ParseArgs(int argc, char** argv, LoadgenOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        try {
+            if (arg.rfind("--target=", 0) == 0) {
+                options.target = arg.substr(9);
+            } else if (arg.rfind("--concurrency=", 0) == 0) {
+                options.concurrency = std::stoul(arg.substr(14));
+            } else if (arg.rfind("--channels=", 0) == 0) {
+                options.channels = std::stoul(arg.substr(11));
+            } else if (arg.rfind("--pick=", 0) == 0) {
+                options.pick = arg.substr(7);
+            } else if (arg.rfind("--client=", 0) == 0) {
+                options.client = arg.substr(9);
+            } else if (arg.rfind("--mode=", 0) == 0) {
+                options.mode = arg.substr(7);
+            } else if (arg.rfind("--qps=", 0) == 0) {
+                options.qps = std::stod(arg.substr(6));
+            } else if (arg.rfind("--duration=", 0) == 0) {
+                options.duration_s = std::stod(arg.substr(11));
+            } else if (arg.rfind("--timeout-ms=", 0) == 0) {
+                options.timeout_ms = std::stoi(arg.substr(13));
+            } else if (arg.rfind("--corpus=", 0) == 0) {
+                options.corpus_path = arg.substr(9);
+            } else if (arg.rfind("--seed=", 0) == 0) {
+                options.seed = std::stoull(arg.substr(7));
+            } else if (arg == "--delta") {
+                options.delta = true;
+            } else if (arg.rfind("--batch=", 0) == 0) {
+                options.batch = std::stoul(arg.substr(8));
+            } else if (arg.rfind("--report=", 0) == 0) {
+                options.report_path = arg.substr(9);
+            } else if (arg == "--hedge") {
+                options.hedge = true;
+            } else if (arg.rfind("--hedge-percentile=", 0) == 0) {
+                options.hedge = true;
+                options.hedge_options.percentile = std::stod(arg.substr(19));
+            } else if (arg.rfind("--hedge-budget=", 0) == 0) {
+                options.hedge = true;
+                options.hedge_options.budget_ratio = std::stod(arg.substr(15));
+            } else {
+                std::cerr << "Unknown argument: " << arg << std::endl;
+                return false;
+            }
+        } catch (const std::logic_error&) {
+            // Thrown by std::stoul and friends for malformed or out-of-range numbers
+            std::cerr << "Invalid value in argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    if (options.mode != "closed" && options.mode != "poisson" && options.mode != "fixed") {
+        std::cerr << "Invalid --mode value '" << options.mode
+                  << "' (expected closed, poisson or fixed)" << std::endl;
+        return false;
+    }
+    if (options.client != "sync" && options.client != "async") {
+        std::cerr << "Invalid --client value '" << options.client
+                  << "' (expected sync or async)" << std::endl;
+        return false;
+    }
+    if (options.hedge && options.client != "sync") {
+        std::cerr << "--hedge requires --client=sync" << std::endl;
+        return false;
+    }
+    if (options.pick != "round-robin" && options.pick != "least-loaded") {
+        std::cerr << "Invalid --pick value '" << options.pick
+                  << "' (expected round-robin or least-loaded)" << std::endl;
+        return false;
+    }
+    if (options.concurrency == 0 || options.channels == 0) {
+        std::cerr << "--concurrency and --channels must be positive" << std::endl;
+        return false;
+    }
+    if (options.mode != "closed" && options.qps <= 0) {
+        std::cerr << "--qps must be positive in open-loop modes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static std::vector<CorpusEntry> LoadCorpus(const std::string& path) {
+    std::vector<CorpusEntry> corpus;
+    if (path.empty()) {
+        corpus.push_back({"coffee maker", "B000123456", "user wants high-quality coffee brewing equipment"});
+        corpus.push_back({"running shoes", "B000654321", "user trains for a marathon"});
+        corpus.push_back({"noise cancelling headphones", "B000777777", "user commutes by train"});
+        corpus.push_back({"cast iron skillet", "B000888888", ""});
+        return corpus;
+    }
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("cannot open corpus " + path);
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        CorpusEntry entry;
+        size_t first = line.find('\t');
+        size_t second = first == std::string::npos ? first : line.find('\t', first + 1);
+        entry.query = line.substr(0, first);
+        if (first != std::string::npos) {
+            entry.asin_id = line.substr(first + 1, second == std::string::npos
+                                                       ? std::string::npos : second - first - 1);
+        }
+        if (second != std::string::npos) {
+            entry.understanding = line.substr(second + 1);
+        }
+        corpus.push_back(std::move(entry));
+    }
+    if (corpus.empty()) {
+        throw std::runtime_error("corpus " + path + " has no entries");
+    }
+    return corpus;
+}
+
+// Per-worker tallies, merged once the run is over
+struct WorkerStats {
+    uint64_t requests = 0;
+    // Lookups answered, i.e. requests times batch items
+    uint64_t items = 0;
+    uint64_t errors = 0;
+    // Index 0 counts requests that received no AdsList before the timeout
+    uint64_t selected_versions[4] = {};
+
+    void add(const GetAdsResult& result, size_t batch) {
+        requests++;
+        items += batch > 0 ? batch : 1;
+        if (!result.status.ok() && !result.cancelled_by_client) {
+            errors++;
+        }
+        bool received = result.ads_list.ads_size() > 0 || result.ads_list.items_size() > 0;
+        uint32_t version = received ? result.ads_list.version() : 0;
+        selected_versions[std::min<uint32_t>(version, 3)]++;
+    }
+};
+
+// Arrival times handed from the open-loop scheduler to the workers
+class ArrivalQueue {
+public:
+    void push(uint64_t arrival_ns) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            arrivals_.push_back(arrival_ns);
+        }
+        cv_.notify_one();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    // Returns false once the queue is closed and drained
+    bool pop(uint64_t& arrival_ns) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return closed_ || !arrivals_.empty(); });
+        if (arrivals_.empty()) {
+            return false;
+        }
+        arrival_ns = arrivals_.front();
+        arrivals_.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<uint64_t> arrivals_;
+    bool closed_ = false;
+};
+
+static void RunScheduler(const LoadgenOptions& options, uint64_t end_ns, ArrivalQueue& queue) {
+    std::mt19937_64 rng(options.seed);
+    std::exponential_distribution<double> gap_s(options.qps);
+    double next_ns = static_cast<double>(metrics::now_ns());
+    for (;;) {
+        next_ns += options.mode == "poisson" ? gap_s(rng) * 1e9 : 1e9 / options.qps;
+        uint64_t arrival_ns = static_cast<uint64_t>(next_ns);
+        if (arrival_ns >= end_ns) {
+            break;
+        }
+        uint64_t now = metrics::now_ns();
+        if (arrival_ns > now) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(arrival_ns - now));
+        }
+        queue.push(arrival_ns);
+    }
+    queue.close();
+}
+
+// Draws options.batch corpus entries; the batch shares the first one's
+// understanding
+static void PickBatch(const std::vector<CorpusEntry>& corpus, size_t batch, std::mt19937_64& rng,
+                      std::uniform_int_distribution<size_t>& pick, std::vector<BatchItem>& items,
+                      std::string& understanding) {
+    items.resize(batch);
+    for (size_t i = 0; i < batch; ++i) {
+        const CorpusEntry& entry = corpus[pick(rng)];
+        items[i].set_query(entry.query);
+        items[i].set_asin_id(entry.asin_id);
+        if (i == 0) {
+            understanding = entry.understanding;
+        }
+    }
+}
+
+static void RunWorker(AdsClient& client, const std::vector<CorpusEntry>& corpus,
+                      const LoadgenOptions& options, size_t worker, uint64_t end_ns,
+                      ArrivalQueue* queue, metrics::Histogram& latency, WorkerStats& stats) {
+    std::mt19937_64 rng(options.seed + worker + 1);
+    std::uniform_int_distribution<size_t> pick(0, corpus.size() - 1);
+    std::vector<BatchItem> items;
+    std::string understanding;
+    for (;;) {
+        uint64_t start_ns;
+        if (queue != nullptr) {
+            if (!queue->pop(start_ns)) {
+                return;
+            }
+        } else {
+            start_ns = metrics::now_ns();
+            if (start_ns >= end_ns) {
+                return;
+            }
+        }
+        GetAdsResult result;
+        if (options.batch > 0) {
+            PickBatch(corpus, options.batch, rng, pick, items, understanding);
+            result = client.getAdsBatchResult(items, understanding, options.timeout_ms);
+        } else {
+            const CorpusEntry& entry = corpus[pick(rng)];
+            result = client.getAdsResult(entry.query, entry.asin_id, entry.understanding,
+                                         options.timeout_ms);
+        }
+        latency.record_since(start_ns);
+        stats.add(result, options.batch);
+    }
+}
+
+// Drives one AsyncAdsClient over the pool; completions arrive on gRPC threads
+class AsyncLoad {
+public:
+    AsyncLoad(const LoadgenOptions& options, const std::vector<CorpusEntry>& corpus,
+              const std::shared_ptr<ChannelPool>& pool, uint64_t end_ns,
+              metrics::Histogram& latency)
+        : options_(options), corpus_(corpus), end_ns_(end_ns), latency_(latency),
+          client_(pool, options.delta), rng_(options.seed), pick_(0, corpus.size() - 1) {
+    }
+
+    void run() {
+        if (options_.mode == "closed") {
+            for (size_t slot = 0; slot < options_.concurrency; ++slot) {
+                issue(slot, metrics::now_ns(), true);
+            }
+        } else {
+            std::mt19937_64 rng(options_.seed);
+            std::exponential_distribution<double> gap_s(options_.qps);
+            double next_ns = static_cast<double>(metrics::now_ns());
+            for (size_t arrival = 0;; ++arrival) {
+                next_ns += options_.mode == "poisson" ? gap_s(rng) * 1e9 : 1e9 / options_.qps;
+                uint64_t arrival_ns = static_cast<uint64_t>(next_ns);
+                if (arrival_ns >= end_ns_) {
+                    break;
+                }
+                uint64_t now = metrics::now_ns();
+                if (arrival_ns > now) {
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(arrival_ns - now));
+                }
+                issue(arrival, arrival_ns, false);
+            }
+        }
+        // Closed-loop completions keep issuing until end_ns, so this returns
+        // only once the last one is done
+        client_.shutdown();
+    }
+
+    WorkerStats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    void issue(size_t slot, uint64_t start_ns, bool closed_loop) {
+        AsyncAdsClient::Callback done = [this, slot, start_ns, closed_loop](GetAdsResult result) {
+            latency_.record_since(start_ns);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.add(result, options_.batch);
+            }
+            uint64_t now = metrics::now_ns();
+            if (closed_loop && now < end_ns_) {
+                issue(slot, now, true);
+            }
+        };
+        if (options_.batch > 0) {
+            std::vector<BatchItem> items;
+            std::string understanding;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                PickBatch(corpus_, options_.batch, rng_, pick_, items, understanding);
+            }
+            client_.getAdsBatch(items, understanding, std::move(done), options_.timeout_ms);
+            return;
+        }
+        const CorpusEntry* entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entry = &corpus_[pick_(rng_)];
+        }
+        client_.getAds(entry->query, entry->asin_id, entry->understanding, std::move(done),
+                       options_.timeout_ms);
+    }
+
+    const LoadgenOptions& options_;
+    const std::vector<CorpusEntry>& corpus_;
+    const uint64_t end_ns_;
+    metrics::Histogram& latency_;
+    AsyncAdsClient client_;
+
+    std::mutex mutex_;
+    std::mt19937_64 rng_;
+    std::uniform_int_distribution<size_t> pick_;
+    WorkerStats stats_;
+};
+
+int main(int argc, char** argv) {
+    LoadgenOptions options;
+    if (!ParseArgs(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--target=HOST:PORT] [--concurrency=N]"
+                  << " [--channels=M] [--pick=round-robin|least-loaded] [--client=sync|async] [--mode=closed|poisson|fixed] [--qps=R]"
+                  << " [--duration=SECONDS] [--timeout-ms=N] [--corpus=PATH] [--seed=N] [--delta] [--batch=N]"
+                  << " [--hedge] [--hedge-percentile=Q] [--hedge-budget=RATIO] [--report=PATH]"
+                  << std::endl;
+        return 1;
+    }
+    // Per-request INFO lines would dominate the run; LOG_LEVEL still wins
+    if (std::getenv("LOG_LEVEL") == nullptr) {
+        logging::LogConfig::instance().set_level(logging::Level::WARN);
+    }
+
+    std::vector<CorpusEntry> corpus;
+    try {
+        corpus = LoadCorpus(options.corpus_path);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    ChannelPool::Options pool_options;
+    pool_options.size = options.channels;
+    pool_options.selection = ChannelPool::parseSelection(options.pick);
+    auto pool = std::make_shared<ChannelPool>(options.target, pool_options);
+    std::shared_ptr<HedgePolicy> hedging;
+    if (options.hedge) {
+        try {
+            hedging = std::make_shared<HedgePolicy>(options.hedge_options);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "Load: target=" << options.target << " client=" << options.client
+              << " mode=" << options.mode
+              << " concurrency=" << options.concurrency << " channels=" << options.channels
+              << " pick=" << options.pick;
+    if (options.delta) {
+        std::cout << " delta=on";
+    }
+    if (options.batch > 0) {
+        std::cout << " batch=" << options.batch;
+    }
+    if (hedging) {
+        std::cout << " hedge=p" << options.hedge_options.percentile * 100
+                  << "/budget=" << options.hedge_options.budget_ratio;
+    }
+    if (options.mode != "closed") {
+        std::cout << " qps=" << options.qps;
+    }
+    std::cout << " duration=" << options.duration_s << "s corpus=" << corpus.size()
+              << " entries" << std::endl;
+
+    static metrics::Histogram& latency = metrics::Registry::instance().histogram("loadgen_latency");
+    const uint64_t start_ns = metrics::now_ns();
+    const uint64_t end_ns = start_ns + static_cast<uint64_t>(options.duration_s * 1e9);
+
+    std::vector<WorkerStats> stats;
+    if (options.client == "async") {
+        AsyncLoad load(options, corpus, pool, end_ns, latency);
+        load.run();
+        stats.push_back(load.stats());
+    } else {
+        std::vector<std::unique_ptr<AdsClient>> clients;
+        for (size_t i = 0; i < options.concurrency; ++i) {
+            clients.emplace_back(new AdsClient(pool, options.delta, hedging));
+        }
+        std::unique_ptr<ArrivalQueue> queue;
+        std::thread scheduler;
+        if (options.mode != "closed") {
+            queue.reset(new ArrivalQueue());
+            scheduler = std::thread(RunScheduler, std::cref(options), end_ns, std::ref(*queue));
+        }
+        stats.resize(options.concurrency);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < options.concurrency; ++i) {
+            workers.emplace_back(RunWorker, std::ref(*clients[i]), std::cref(corpus), std::cref(options),
+                                 i, end_ns, queue.get(), std::ref(latency), std::ref(stats[i]));
+        }
+        if (scheduler.joinable()) {
+            scheduler.join();
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+    const double elapsed_s = static_cast<double>(metrics::now_ns() - start_ns) / 1e9;
+
+    WorkerStats total;
+    for (const WorkerStats& worker : stats) {
+        total.requests += worker.requests;
+        total.items += worker.items;
+        total.errors += worker.errors;
+        for (int v = 0; v < 4; ++v) {
+            total.selected_versions[v] += worker.selected_versions[v];
+        }
+    }
+    metrics::HistogramSnapshot snapshot = latency.snapshot();
+
+    auto percent = [&total](uint64_t count) {
+        return total.requests == 0 ? 0.0 : 100.0 * static_cast<double>(count) / total.requests;
+    };
+    std::printf("Requests:   %llu in %.2fs (%.1f req/s)\n",
+                static_cast<unsigned long long>(total.requests), elapsed_s,
+                total.requests / elapsed_s);
+    if (options.batch > 0) {
+        std::printf("Items:      %llu (%.1f items/s, %zu per request)\n",
+                    static_cast<unsigned long long>(total.items), total.items / elapsed_s,
+                    options.batch);
+    }
+    std::printf("Errors:     %llu (%.2f%%)\n",
+                static_cast<unsigned long long>(total.errors), percent(total.errors));
+    std::printf("Latency ms: mean=%.2f p50=%.2f p90=%.2f p99=%.2f p99.9=%.2f max=%.2f\n",
+                snapshot.mean_ns() / 1e6, snapshot.percentile(0.50) / 1e6,
+                snapshot.percentile(0.90) / 1e6, snapshot.percentile(0.99) / 1e6,
+                snapshot.percentile(0.999) / 1e6, snapshot.max_ns / 1e6);
+    std::printf("Selected:   v1=%.1f%% v2=%.1f%% v3=%.1f%% none=%.1f%%\n",
+                percent(total.selected_versions[1]), percent(total.selected_versions[2]),
+                percent(total.selected_versions[3]), percent(total.selected_versions[0]));
+    if (hedging) {
+        std::printf("Hedges:     issued=%lld (%.2f%%) won=%lld suppressed=%lld delay=%dms\n",
+                    static_cast<long long>(hedging->issued()), percent(hedging->issued()),
+                    static_cast<long long>(hedging->won()),
+                    static_cast<long long>(hedging->suppressed()), hedging->delayMs());
+    }
+
+    if (!options.report_path.empty()) {
+        bool write_header;
+        {
+            std::ifstream existing(options.report_path);
+            write_header = !existing || existing.peek() == std::ifstream::traits_type::eof();
+        }
+        FILE* report = std::fopen(options.report_path.c_str(), "a");
+        if (report == nullptr) {
+            std::cerr << "Cannot append to " << options.report_path << std::endl;
+            return 1;
+        }
+        if (write_header) {
+            std::fprintf(report, "client\tmode\tconcurrency\ttarget_qps\tduration_s\trequests\trps\terrors_pct"
+                                 "\tmean_ms\tp50_ms\tp90_ms\tp99_ms\tp999_ms\tmax_ms"
+                                 "\tv1_pct\tv2_pct\tv3_pct\tnone_pct\n");
+        }
+        std::fprintf(report, "%s\t%s\t%zu\t%.1f\t%.2f\t%llu\t%.1f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f"
+                             "\t%.2f\t%.2f\t%.2f\t%.2f\n",
+                     options.client.c_str(), options.mode.c_str(), options.concurrency,
+                     options.mode == "closed" ? 0.0 : options.qps, elapsed_s,
+                     static_cast<unsigned long long>(total.requests), total.requests / elapsed_s,
+                     percent(total.errors), snapshot.mean_ns() / 1e6, snapshot.percentile(0.50) / 1e6,
+                     snapshot.percentile(0.90) / 1e6, snapshot.percentile(0.99) / 1e6,
+                     snapshot.percentile(0.999) / 1e6, snapshot.max_ns / 1e6,
+                     percent(total.selected_versions[1]), percent(total.selected_versions[2]),
+                     percent(total.selected_versions[3]), percent(total.selected_versions[0]));
+        std::fclose(report);
+    }
+    return 0;
+}
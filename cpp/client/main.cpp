@@ -1,55 +1,153 @@
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <vector>
 #include <grpcpp/grpcpp.h>
 #include "ads_client.h"
+#include "../common/metrics.h"
 
 using grpc::Channel;
 using grpc::CreateChannel;
 using grpc::InsecureChannelCredentials;
 
-void RunClient() {
-    std::string server_address("localhost:50051");
+struct ClientOptions {
+    std::string target = "localhost:50051";
+    // Ask the server for delta-encoded refinements (Context.accept_delta)
+    bool delta = false;
+    // Selection timeout (0 keeps the random 30-120ms)
+    int timeout_ms = 0;
+    std::string query = "coffee maker";
+    std::string asin_id = "B000123456";
+    // Items in batch mode (Context.items); item i > 0 asks for asin_id-i
+    size_t batch = 0;
+};
+
+// Only --flags are parsed; positional arguments (run-client.sh passes host,
+// port and the query) are ignored as before
+static bool ParseArgs(int argc, char** argv, ClientOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg.rfind("--", 0) != 0) {
+            continue;
+        }
+        try {
+            if (arg.rfind("--target=", 0) == 0) {
+                options.target = arg.substr(9);
+            } else if (arg == "--delta") {
+                options.delta = true;
+            } else if (arg.rfind("--timeout-ms=", 0) == 0) {
+                options.timeout_ms = std::stoi(arg.substr(13));
+            } else if (arg.rfind("--query=", 0) == 0) {
+                options.query = arg.substr(8);
+            } else if (arg.rfind("--asin-id=", 0) == 0) {
+                options.asin_id = arg.substr(10);
+            } else if (arg.rfind("--batch=", 0) == 0) {
+                options.batch = std::stoul(arg.substr(8));
+            } else {
+                std::cerr << "Unknown argument: " << arg << std::endl;
+                return false;
+            }
+        } catch (const std::logic_error&) {
+            // Thrown by std::stoi and std::stoul for malformed or out-of-range numbers
+            std::cerr << "Invalid value in argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void PrintAds(const google::protobuf::RepeatedPtrField<ads::Ad>& ads, const char* indent) {
+    for (int i = 0; i < ads.size(); ++i) {
+        const auto& ad = ads.Get(i);
+        std::cout << indent << "Ad " << (i + 1) << ": asin_id=" << ad.asin_id()
+                  << ", ad_id=" << ad.ad_id()
+                  << ", score=" << ad.score() << std::endl;
+    }
+}
+
+static void RunSingle(AdsClient& client, const ClientOptions& options, const std::string& understanding) {
+    // Call the bidirectional streaming method
+    AdsList result = client.getAdsResult(options.query, options.asin_id, understanding,
+                                         options.timeout_ms).ads_list;
+    
+    // Display results
+    if (result.ads_size() > 0) {
+        std::cout << "\n=== Final Result ===" << std::endl;
+        std::cout << "AdsList version: " << result.version() << std::endl;
+        std::cout << "Number of ads: " << result.ads_size() << std::endl;
+        
+        PrintAds(result.ads(), "");
+    } else {
+        std::cout << "No ads received" << std::endl;
+    }
+}
+
+// One stream for options.batch items; prints each item's ads in order
+static void RunBatch(AdsClient& client, const ClientOptions& options, const std::string& understanding) {
+    std::vector<BatchItem> items(options.batch);
+    for (size_t i = 0; i < items.size(); ++i) {
+        items[i].set_query(options.query);
+        items[i].set_asin_id(i == 0 ? options.asin_id : options.asin_id + "-" + std::to_string(i));
+    }
+    GetAdsResult result = client.getAdsBatchResult(items, understanding, options.timeout_ms);
+    const AdsList& list = result.ads_list;
+    if (list.items_size() == 0) {
+        std::cout << "No ads received" << std::endl;
+        return;
+    }
+    std::cout << "\n=== Final Result ===" << std::endl;
+    std::cout << "AdsList version: " << list.version() << std::endl;
+    std::cout << "Number of items: " << list.items_size() << std::endl;
+    for (int i = 0; i < list.items_size(); ++i) {
+        const std::string& asin_id = i < static_cast<int>(items.size()) ? items[i].asin_id() : "?";
+        std::cout << "Item " << (i + 1) << ": asin_id=" << asin_id
+                  << ", ads=" << list.items(i).ads_size() << std::endl;
+        PrintAds(list.items(i).ads(), "  ");
+    }
+}
+
+void RunClient(const ClientOptions& options) {
+    std::string server_address(options.target);
     
     // Create channel to server
     std::shared_ptr<Channel> channel = CreateChannel(server_address, InsecureChannelCredentials());
-    AdsClient client(channel);
+    AdsClient client(channel, options.delta);
     
     std::cout << "C++ Client connecting to " << server_address << std::endl;
     
     // Test parameters
-    std::string query = "coffee maker";
-    std::string asin_id = "B000123456";
     std::string understanding = "user wants high-quality coffee brewing equipment";
     
     try {
-        // Call the bidirectional streaming method
-        AdsList result = client.getAds(query, asin_id, understanding);
-        
-        // Display results
-        if (result.ads_size() > 0) {
-            std::cout << "\n=== Final Result ===" << std::endl;
-            std::cout << "AdsList version: " << result.version() << std::endl;
-            std::cout << "Number of ads: " << result.ads_size() << std::endl;
-            
-            for (int i = 0; i < result.ads_size(); ++i) {
-                const auto& ad = result.ads(i);
-                std::cout << "Ad " << (i + 1) << ": asin_id=" << ad.asin_id() 
-                          << ", ad_id=" << ad.ad_id() 
-                          << ", score=" << ad.score() << std::endl;
-            }
+        if (options.batch > 0) {
+            RunBatch(client, options, understanding);
         } else {
-            std::cout << "No ads received" << std::endl;
+            RunSingle(client, options, understanding);
         }
-        
     } catch (const std::exception& e) {
         std::cerr << "Exception: " << e.what() << std::endl;
     }
     
     client.shutdown();
+
+    // Stage latencies of this run
+    logging::Logger logger("CLIENT");
+    for (const auto& snapshot : metrics::Registry::instance().snapshot()) {
+        if (snapshot.count > 0) {
+            metrics::log_snapshot(logger, snapshot);
+        }
+    }
 }
 
 int main(int argc, char** argv) {
-    RunClient();
+    ClientOptions options;
+    if (!ParseArgs(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--target=HOST:PORT] [--delta] [--timeout-ms=N]"
+                  << " [--query=TEXT] [--asin-id=ID] [--batch=N]"
+                  << std::endl;
+        return 1;
+    }
+    RunClient(options);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <google/protobuf/arena.h>
+#include "ads.pb.h"
+
+/**
+ * Delta encoding of AdsList refinements (see AdsDelta in ads.proto).
+ *
+ * Versions 2 and 3 mostly reorder and rescore the ads of the previous
+ * version, so a delta against it carries a small base index and a score per
+ * ad instead of both id strings. Only clients that set Context.accept_delta
+ * receive deltas; everyone else gets full lists.
+ */
+namespace ads_delta {
+
+// Fills out (version and delta only) with the changes from base to target.
+// Returns false, leaving out unspecified, when the delta would not be
+// smaller than target itself; the caller then sends target in full.
+inline bool encode(const ads::AdsList& base, const ads::AdsList& target, ads::AdsList* out) {
+    out->Clear();
+    out->set_version(target.version());
+    ads::AdsDelta* delta = out->mutable_delta();
+    delta->set_base_version(base.version());
+
+    std::unordered_map<std::string_view, int> base_by_ad_id;
+    base_by_ad_id.reserve(static_cast<size_t>(base.ads_size()));
+    for (int i = 0; i < base.ads_size(); i++) {
+        base_by_ad_id.emplace(base.ads(i).ad_id(), i);
+    }
+
+    delta->mutable_base_index()->Reserve(target.ads_size());
+    delta->mutable_score()->Reserve(target.ads_size());
+    for (const ads::Ad& ad : target.ads()) {
+        auto it = base_by_ad_id.find(ad.ad_id());
+        if (it != base_by_ad_id.end() && base.ads(it->second).asin_id() == ad.asin_id()) {
+            delta->add_base_index(it->second);
+        } else {
+            delta->add_base_index(-1);
+            *delta->add_inserted() = ad;
+        }
+        delta->add_score(ad.score());
+    }
+    return out->ByteSizeLong() < target.ByteSizeLong();
+}
+
+// What to write for target: a delta against base, allocated on arena, when
+// base is set and the delta is smaller; otherwise target itself. Batched
+// lists (AdsList.items) always go out in full.
+inline const ads::AdsList& wireForm(const ads::AdsList* base, const ads::AdsList& target,
+                                    google::protobuf::Arena* arena) {
+    if (base == nullptr || target.items_size() > 0) {
+        return target;
+    }
+    ads::AdsList* delta = google::protobuf::Arena::CreateMessage<ads::AdsList>(arena);
+    return encode(*base, target, delta) ? *delta : target;
+}
+
+// Rebuilds the full list of a delta message against base, which must be the
+// list of delta.base_version. Throws std::invalid_argument if the delta does
+// not fit base.
+inline void apply(const ads::AdsList& base, const ads::AdsList& message, ads::AdsList* out) {
+    const ads::AdsDelta& delta = message.delta();
+    if (delta.base_version() != base.version()) {
+        throw std::invalid_argument("AdsDelta base version " + std::to_string(delta.base_version()) +
+                                    " does not match buffered version " +
+                                    std::to_string(base.version()));
+    }
+    if (delta.score_size() != delta.base_index_size()) {
+        throw std::invalid_argument("AdsDelta has mismatched base_index and score counts");
+    }
+    out->Clear();
+    out->set_version(message.version());
+    out->mutable_ads()->Reserve(delta.base_index_size());
+    int next_inserted = 0;
+    for (int i = 0; i < delta.base_index_size(); i++) {
+        int base_index = delta.base_index(i);
+        ads::Ad* ad = out->add_ads();
+        if (base_index < 0) {
+            if (next_inserted >= delta.inserted_size()) {
+                throw std::invalid_argument("AdsDelta references more inserted ads than it carries");
+            }
+            *ad = delta.inserted(next_inserted++);
+        } else if (base_index < base.ads_size()) {
+            ad->set_asin_id(base.ads(base_index).asin_id());
+            ad->set_ad_id(base.ads(base_index).ad_id());
+        } else {
+            throw std::invalid_argument("AdsDelta base index " + std::to_string(base_index) +
+                                        " is out of range");
+        }
+        ad->set_score(delta.score(i));
+    }
+}
+
+} // namespace ads_delta
@@ -2,13 +2,28 @@
 
 #include <iostream>
 #include <sstream>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <ctime>
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <map>
 #include <thread>
+#include <vector>
+#include <cerrno>
+#include <charconv>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
 
 /**
  * Structured logging utilities for consistent formatting across C++ implementations.
@@ -33,6 +48,12 @@ public:
         return *this;
     }
     
+    // Without this, string literals would bind to the bool overload
+    LogContext& add(const std::string& key, const char* value) {
+        context_[key] = value ? value : "";
+        return *this;
+    }
+    
     LogContext& add(const std::string& key, int value) {
         context_[key] = std::to_string(value);
         return *this;
@@ -53,7 +74,7 @@ public:
         return *this;
     }
     
-    LogContext& add(const std::string& key, uint64_t value) {
+    LogContext& add(const std::string& key, unsigned long long value) {
         context_[key] = std::to_string(value);
         return *this;
     }
@@ -104,6 +125,151 @@ public:
     }
 };
 
+// Record tags, checked by mode filters instead of scanning message text
+namespace tags {
+constexpr unsigned kNone = 0;
+// The record carries a timing measurement (set for any *_ms field)
+constexpr unsigned kTiming = 1u << 0;
+} // namespace tags
+
+// "<thread id>" of the calling thread, formatted once per thread
+inline const std::string& current_thread_id() {
+    thread_local const std::string thread_id = []() {
+        std::ostringstream oss;
+        oss << std::this_thread::get_id();
+        return oss.str();
+    }();
+    return thread_id;
+}
+
+/**
+ * Allocation-free alternative to LogContext for hot paths.
+ *
+ * Appends "message [key=value, key2=value2]" directly into an inline buffer
+ * (spilling to the heap only for unusually long lines) with std::to_chars,
+ * keeping fields in insertion order as in the examples of
+ * docs/logging-specification.md. Values are formatted like LogContext;
+ * doubles use three decimals.
+ *
+ * Combine with Logger::info_if_enabled() and friends so nothing is formatted
+ * for lines below the configured level. Fields whose key ends in "_ms" tag
+ * the record as tags::kTiming, which is what DEBUG_MODE=PERFORMANCE keeps.
+ */
+class LogFields {
+public:
+    explicit LogFields(std::string_view message) {
+        append(message.data(), message.size());
+    }
+
+    LogFields(const LogFields&) = delete;
+    LogFields& operator=(const LogFields&) = delete;
+
+    LogFields& add(std::string_view key, std::string_view value) {
+        begin_field(key);
+        append(value.data(), value.size());
+        return end_field();
+    }
+
+    LogFields& add(std::string_view key, const char* value) {
+        return add(key, std::string_view(value ? value : ""));
+    }
+
+    template <typename T,
+              typename std::enable_if<std::is_integral<T>::value &&
+                                      !std::is_same<T, bool>::value>::type* = nullptr>
+    LogFields& add(std::string_view key, T value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        return add(key, std::string_view(digits, result.ptr - digits));
+    }
+
+    template <typename T,
+              typename std::enable_if<std::is_enum<T>::value>::type* = nullptr>
+    LogFields& add(std::string_view key, T value) {
+        return add(key, static_cast<int>(value));
+    }
+
+    LogFields& add(std::string_view key, bool value) {
+        return add(key, std::string_view(value ? "true" : "false"));
+    }
+
+    LogFields& add(std::string_view key, double value) {
+        char digits[64];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value,
+                                    std::chars_format::fixed, 3);
+        if (result.ec != std::errc()) {
+            return add(key, std::string_view("overflow"));
+        }
+        return add(key, std::string_view(digits, result.ptr - digits));
+    }
+
+    LogFields& add(std::string_view key, std::thread::id value) {
+        if (value == std::this_thread::get_id()) {
+            return add(key, std::string_view(current_thread_id()));
+        }
+        std::ostringstream oss;
+        oss << value;
+        return add(key, std::string_view(oss.str()));
+    }
+
+    // Mark the record, e.g. tag(tags::kTiming) for a timing line without *_ms fields
+    LogFields& tag(unsigned record_tags) {
+        tags_ |= record_tags;
+        return *this;
+    }
+
+    unsigned tags() const { return tags_; }
+
+    std::string_view view() const {
+        return heap_.empty() ? std::string_view(buffer_, size_) : std::string_view(heap_);
+    }
+
+private:
+    void append(const char* data, size_t size) {
+        if (heap_.empty() && size_ + size <= sizeof(buffer_)) {
+            std::memcpy(buffer_ + size_, data, size);
+            size_ += size;
+        } else {
+            if (heap_.empty()) {
+                heap_.assign(buffer_, size_);
+            }
+            heap_.append(data, size);
+        }
+    }
+
+    // The buffer always ends in ']' once a field exists, so view() is valid
+    // between add() calls; the next field replaces it with ", "
+    void begin_field(std::string_view key) {
+        if (has_fields_) {
+            if (heap_.empty()) {
+                size_--;
+            } else {
+                heap_.pop_back();
+            }
+            append(", ", 2);
+        } else {
+            append(" [", 2);
+            has_fields_ = true;
+        }
+        append(key.data(), key.size());
+        append("=", 1);
+        if (key.size() > 3 && key.compare(key.size() - 3, 3, "_ms") == 0) {
+            tags_ |= tags::kTiming;
+        }
+    }
+
+    LogFields& end_field() {
+        append("]", 1);
+        return *this;
+    }
+
+    char buffer_[480];
+    size_t size_ = 0;
+    bool has_fields_ = false;
+    unsigned tags_ = tags::kNone;
+    std::string heap_;
+};
+
 class Timer {
 private:
     std::chrono::steady_clock::time_point start_time_;
@@ -123,115 +289,561 @@ public:
     }
 };
 
+enum class DebugModeKind {
+    NORMAL,
+    VERBOSE,
+    PERFORMANCE,
+    PROTOCOL,
+    ERRORS_ONLY
+};
+
+/**
+ * Process-wide logging configuration.
+ *
+ * LOG_LEVEL and DEBUG_MODE are parsed once, on first use, into atomics that
+ * every Logger reads on each call, so filtering costs a relaxed load instead
+ * of getenv. The setters change verbosity of a running process (ads_server
+ * calls increase_verbosity() on SIGUSR1 and restore_startup() on SIGUSR2).
+ */
+class LogConfig {
+public:
+    static LogConfig& instance() {
+        static LogConfig config;
+        return config;
+    }
+
+    // Lowest level that is emitted, after the debug mode adjustment
+    Level effective_level() const {
+        return static_cast<Level>(effective_level_.load(std::memory_order_relaxed));
+    }
+    Level level() const {
+        return static_cast<Level>(level_.load(std::memory_order_relaxed));
+    }
+    DebugModeKind debug_mode() const {
+        return static_cast<DebugModeKind>(debug_mode_.load(std::memory_order_relaxed));
+    }
+
+    void set_level(Level level) {
+        std::lock_guard<std::mutex> lock(mu_);
+        level_.store(static_cast<int>(level), std::memory_order_relaxed);
+        update_effective_level();
+    }
+
+    void set_debug_mode(DebugModeKind mode) {
+        std::lock_guard<std::mutex> lock(mu_);
+        debug_mode_.store(static_cast<int>(mode), std::memory_order_relaxed);
+        update_effective_level();
+    }
+
+    // One step more verbose: leave ERRORS_ONLY first, then lower the level
+    // towards DEBUG
+    void increase_verbosity() {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (debug_mode() == DebugModeKind::ERRORS_ONLY) {
+            debug_mode_.store(static_cast<int>(DebugModeKind::NORMAL), std::memory_order_relaxed);
+        } else if (level() > Level::DEBUG) {
+            level_.store(static_cast<int>(level()) - 1, std::memory_order_relaxed);
+        }
+        update_effective_level();
+    }
+
+    void restore_startup() {
+        std::lock_guard<std::mutex> lock(mu_);
+        level_.store(static_cast<int>(startup_level_), std::memory_order_relaxed);
+        debug_mode_.store(static_cast<int>(startup_debug_mode_), std::memory_order_relaxed);
+        update_effective_level();
+    }
+
+    static const char* level_name(Level level) {
+        switch (level) {
+            case Level::DEBUG: return "DEBUG";
+            case Level::INFO: return "INFO";
+            case Level::WARN: return "WARN";
+            case Level::ERROR: return "ERROR";
+            default: return "UNKNOWN";
+        }
+    }
+
+    static const char* debug_mode_name(DebugModeKind mode) {
+        switch (mode) {
+            case DebugModeKind::NORMAL: return "NORMAL";
+            case DebugModeKind::VERBOSE: return "VERBOSE";
+            case DebugModeKind::PERFORMANCE: return "PERFORMANCE";
+            case DebugModeKind::PROTOCOL: return "PROTOCOL";
+            case DebugModeKind::ERRORS_ONLY: return "ERRORS_ONLY";
+            default: return "UNKNOWN";
+        }
+    }
+
+private:
+    LogConfig() {
+        const char* log_level_env = std::getenv("LOG_LEVEL");
+        std::string log_level = log_level_env ? log_level_env : "INFO";
+        if (log_level == "DEBUG") startup_level_ = Level::DEBUG;
+        else if (log_level == "WARN") startup_level_ = Level::WARN;
+        else if (log_level == "ERROR") startup_level_ = Level::ERROR;
+        else startup_level_ = Level::INFO;
+
+        const char* debug_mode_env = std::getenv("DEBUG_MODE");
+        std::string debug_mode = debug_mode_env ? debug_mode_env : "NORMAL";
+        if (debug_mode == "VERBOSE") startup_debug_mode_ = DebugModeKind::VERBOSE;
+        else if (debug_mode == "PERFORMANCE") startup_debug_mode_ = DebugModeKind::PERFORMANCE;
+        else if (debug_mode == "PROTOCOL") startup_debug_mode_ = DebugModeKind::PROTOCOL;
+        else if (debug_mode == "ERRORS_ONLY") startup_debug_mode_ = DebugModeKind::ERRORS_ONLY;
+        else startup_debug_mode_ = DebugModeKind::NORMAL;
+
+        restore_startup();
+    }
+
+    // Caller holds mu_
+    void update_effective_level() {
+        Level effective = level();
+        // Adjust level based on debug mode
+        if (debug_mode() == DebugModeKind::ERRORS_ONLY) {
+            effective = Level::ERROR;
+        } else if (debug_mode() == DebugModeKind::VERBOSE) {
+            effective = Level::DEBUG;
+        }
+        effective_level_.store(static_cast<int>(effective), std::memory_order_relaxed);
+    }
+
+    Level startup_level_ = Level::INFO;
+    DebugModeKind startup_debug_mode_ = DebugModeKind::NORMAL;
+    std::atomic<int> level_{static_cast<int>(Level::INFO)};
+    std::atomic<int> debug_mode_{static_cast<int>(DebugModeKind::NORMAL)};
+    std::atomic<int> effective_level_{static_cast<int>(Level::INFO)};
+    // Serializes writers so the effective level matches the latest pair
+    std::mutex mu_;
+};
+
 class DebugMode {
 public:
     static bool is_verbose() {
-        const char* debug_mode = std::getenv("DEBUG_MODE");
-        return debug_mode && std::string(debug_mode) == "VERBOSE";
+        return LogConfig::instance().debug_mode() == DebugModeKind::VERBOSE;
     }
     
     static bool is_performance() {
-        const char* debug_mode = std::getenv("DEBUG_MODE");
-        return debug_mode && std::string(debug_mode) == "PERFORMANCE";
+        return LogConfig::instance().debug_mode() == DebugModeKind::PERFORMANCE;
     }
     
     static bool is_protocol() {
-        const char* debug_mode = std::getenv("DEBUG_MODE");
-        return debug_mode && std::string(debug_mode) == "PROTOCOL";
+        return LogConfig::instance().debug_mode() == DebugModeKind::PROTOCOL;
     }
     
     static bool is_errors_only() {
-        const char* debug_mode = std::getenv("DEBUG_MODE");
-        return debug_mode && std::string(debug_mode) == "ERRORS_ONLY";
+        return LogConfig::instance().debug_mode() == DebugModeKind::ERRORS_ONLY;
     }
     
     static std::string get_current_mode() {
-        const char* debug_mode = std::getenv("DEBUG_MODE");
-        return debug_mode ? std::string(debug_mode) : "NORMAL";
+        return LogConfig::debug_mode_name(LogConfig::instance().debug_mode());
     }
 };
 
+/**
+ * Asynchronous log backend, enabled with LOG_ASYNC=1.
+ *
+ * Logging threads format a complete line and push it into a bounded
+ * multi-producer/single-consumer ring of fixed-size slots (per-slot sequence
+ * numbers, no locks on the push path). A background thread drains whatever is
+ * queued into one buffer and hands it to the kernel with a single write(), so
+ * request threads never block on stdout and there is one syscall per batch
+ * instead of a flush per line.
+ *
+ * Configuration (read once, on first use):
+ *   LOG_ASYNC_POLICY    block (default) waits for space when the ring is full;
+ *                       drop discards the line and reports the count later
+ *   LOG_ASYNC_CAPACITY  ring slots, rounded up to a power of two (default 8192)
+ *   LOG_FILE            append to this file instead of stdout
+ *
+ * Lines longer than a slot flush the ring and are written directly. Queued
+ * lines are drained when the process exits normally; ERROR lines are never
+ * dropped and are flushed before log() returns.
+ */
+class AsyncLogSink {
+public:
+    enum class OverflowPolicy {
+        BLOCK,
+        DROP
+    };
+
+    // Bytes per slot, including the trailing newline
+    static constexpr size_t kRecordSize = 512;
+
+    // The process-wide sink, or nullptr when LOG_ASYNC is not enabled
+    static AsyncLogSink* instance() {
+        static std::unique_ptr<AsyncLogSink> sink = create_from_env();
+        return sink.get();
+    }
+
+    AsyncLogSink(size_t capacity, OverflowPolicy policy, int fd, bool owns_fd)
+        : policy_(policy), fd_(fd), owns_fd_(owns_fd) {
+        size_t slots = 2;
+        while (slots < capacity) slots <<= 1;
+        mask_ = slots - 1;
+        slots_.reset(new Slot[slots]);
+        for (size_t i = 0; i < slots; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        batch_.reserve(64 * 1024);
+        // The sink starts during static init, before main() blocks the
+        // server's control signals; the writer must never be the thread that
+        // takes them, so it starts (and stays) with every signal blocked
+        sigset_t all;
+        sigset_t previous;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &previous);
+        writer_ = std::thread([this]() { run(); });
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+
+    ~AsyncLogSink() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stopping_ = true;
+        }
+        wake_cv_.notify_one();
+        writer_.join();
+        if (owns_fd_) {
+            ::close(fd_);
+        }
+    }
+
+    AsyncLogSink(const AsyncLogSink&) = delete;
+    AsyncLogSink& operator=(const AsyncLogSink&) = delete;
+
+    // Queue one line (which must end in '\n'). Returns false if it was dropped;
+    // never_drop makes this call block on a full ring even under DROP.
+    bool push(const char* data, size_t size, bool never_drop = false) {
+        if (size > kRecordSize) {
+            // Too big for a slot: keep ordering by draining what is queued
+            flush();
+            write_all(data, size);
+            return true;
+        }
+
+        Slot* slot;
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            slot = &slots_[pos & mask_];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full: the consumer has not released this slot yet
+                if (policy_ == OverflowPolicy::DROP && !never_drop) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                wake_writer();
+                std::this_thread::yield();
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        std::memcpy(slot->data, data, size);
+        slot->size = static_cast<uint32_t>(size);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+
+        if (writer_waiting_.load(std::memory_order_seq_cst)) {
+            wake_writer();
+        }
+        return true;
+    }
+
+    // Block until every line pushed before this call has been written
+    void flush() {
+        size_t target = enqueue_pos_.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(mu_);
+        flush_waiters_++;
+        wake_cv_.notify_one();
+        flushed_cv_.wait(lock, [this, target]() {
+            return written_pos_ >= target || stopped_;
+        });
+        flush_waiters_--;
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        uint32_t size;
+        char data[kRecordSize];
+    };
+
+    static std::unique_ptr<AsyncLogSink> create_from_env() {
+        const char* async_env = std::getenv("LOG_ASYNC");
+        if (!async_env || !(std::string(async_env) == "1" || std::string(async_env) == "true")) {
+            return nullptr;
+        }
+
+        OverflowPolicy policy = OverflowPolicy::BLOCK;
+        const char* policy_env = std::getenv("LOG_ASYNC_POLICY");
+        if (policy_env && std::string(policy_env) == "drop") {
+            policy = OverflowPolicy::DROP;
+        }
+
+        size_t capacity = 8192;
+        const char* capacity_env = std::getenv("LOG_ASYNC_CAPACITY");
+        if (capacity_env && std::strtoul(capacity_env, nullptr, 10) > 0) {
+            capacity = std::strtoul(capacity_env, nullptr, 10);
+        }
+
+        int fd = STDOUT_FILENO;
+        bool owns_fd = false;
+        const char* file_env = std::getenv("LOG_FILE");
+        if (file_env && *file_env) {
+            int file_fd = ::open(file_env, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (file_fd >= 0) {
+                fd = file_fd;
+                owns_fd = true;
+            } else {
+                std::cerr << "Cannot open LOG_FILE " << file_env << ": "
+                          << std::strerror(errno) << ", logging to stdout" << std::endl;
+            }
+        }
+        // Anything already buffered in std::cout must not appear after our lines
+        std::cout.flush();
+        return std::unique_ptr<AsyncLogSink>(new AsyncLogSink(capacity, policy, fd, owns_fd));
+    }
+
+    void wake_writer() {
+        std::lock_guard<std::mutex> lock(mu_);
+        wake_cv_.notify_one();
+    }
+
+    void write_all(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(fd_, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    // Move every published record into batch_; returns how many were taken
+    size_t drain() {
+        size_t taken = 0;
+        for (;;) {
+            Slot& slot = slots_[dequeue_pos_ & mask_];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence != dequeue_pos_ + 1) {
+                return taken;
+            }
+            batch_.insert(batch_.end(), slot.data, slot.data + slot.size);
+            // Release the slot for the producer one lap ahead
+            slot.sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+            dequeue_pos_++;
+            taken++;
+            if (batch_.size() >= batch_.capacity() - kRecordSize) {
+                return taken;
+            }
+        }
+    }
+
+    void run() {
+        uint64_t reported_drops = 0;
+        for (;;) {
+            batch_.clear();
+            uint64_t drops = dropped_.load(std::memory_order_relaxed);
+            if (drops != reported_drops) {
+                std::string note = "[WARN] [LOGGING] dropped " + std::to_string(drops - reported_drops) +
+                                   " log lines (ring full)\n";
+                batch_.insert(batch_.end(), note.begin(), note.end());
+                reported_drops = drops;
+            }
+            size_t taken = drain();
+            if (!batch_.empty()) {
+                write_all(batch_.data(), batch_.size());
+            }
+            if (taken > 0) {
+                std::lock_guard<std::mutex> lock(mu_);
+                written_pos_ = dequeue_pos_;
+                if (flush_waiters_ > 0) {
+                    flushed_cv_.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mu_);
+            written_pos_ = dequeue_pos_;
+            if (flush_waiters_ > 0) {
+                flushed_cv_.notify_all();
+            }
+            if (stopping_) {
+                stopped_ = true;
+                flushed_cv_.notify_all();
+                return;
+            }
+            // Producers only take the mutex to wake us when this flag is set;
+            // re-check the ring after publishing it so a push is never missed
+            writer_waiting_.store(true, std::memory_order_seq_cst);
+            Slot& next = slots_[dequeue_pos_ & mask_];
+            if (next.sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+                wake_cv_.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            writer_waiting_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    OverflowPolicy policy_;
+    int fd_;
+    bool owns_fd_;
+    size_t mask_ = 0;
+    std::unique_ptr<Slot[]> slots_;
+
+    alignas(64) std::atomic<size_t> enqueue_pos_{0};
+    alignas(64) size_t dequeue_pos_ = 0;
+    std::vector<char> batch_;
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> writer_waiting_{false};
+
+    std::mutex mu_;
+    std::condition_variable wake_cv_;
+    std::condition_variable flushed_cv_;
+    size_t written_pos_ = 0;
+    int flush_waiters_ = 0;
+    bool stopping_ = false;
+    bool stopped_ = false;
+    std::thread writer_;
+};
+
 class Logger {
 private:
     std::string component_;
-    Level min_level_;
     
-    std::string get_timestamp() const {
+    // Appends "YYYY-MM-DDTHH:MM:SS.mmmZ". The date part is formatted with
+    // gmtime_r only when the second changes and is cached per thread.
+    static void append_timestamp(std::string& out) {
         auto now = std::chrono::system_clock::now();
-        auto time_t = std::chrono::system_clock::to_time_t(now);
-        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            now.time_since_epoch()) % 1000;
-        
-        std::ostringstream oss;
-        oss << std::put_time(std::gmtime(&time_t), "%Y-%m-%dT%H:%M:%S");
-        oss << '.' << std::setfill('0') << std::setw(3) << ms.count() << 'Z';
-        return oss.str();
-    }
-    
-    std::string level_to_string(Level level) const {
-        switch (level) {
-            case Level::DEBUG: return "DEBUG";
-            case Level::INFO: return "INFO";
-            case Level::WARN: return "WARN";
-            case Level::ERROR: return "ERROR";
-            default: return "UNKNOWN";
+        auto ms_since_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+            now.time_since_epoch()).count();
+        std::time_t seconds = static_cast<std::time_t>(ms_since_epoch / 1000);
+        int ms = static_cast<int>(ms_since_epoch % 1000);
+
+        thread_local std::time_t cached_seconds = -1;
+        thread_local char cached_prefix[32];
+        if (seconds != cached_seconds) {
+            std::tm tm_utc;
+            gmtime_r(&seconds, &tm_utc);
+            std::strftime(cached_prefix, sizeof(cached_prefix), "%Y-%m-%dT%H:%M:%S", &tm_utc);
+            cached_seconds = seconds;
         }
+        out += cached_prefix;
+        char millis[6] = {'.', char('0' + ms / 100), char('0' + ms / 10 % 10),
+                          char('0' + ms % 10), 'Z', '\0'};
+        out += millis;
     }
     
-    std::string get_thread_id() const {
-        std::ostringstream oss;
-        oss << std::this_thread::get_id();
-        return oss.str();
-    }
-
 public:
     Logger(const std::string& component) : component_(component) {
-        // Set log level from environment variable or default to INFO
-        const char* log_level_env = std::getenv("LOG_LEVEL");
-        std::string log_level = log_level_env ? log_level_env : "INFO";
-        
-        if (log_level == "DEBUG") min_level_ = Level::DEBUG;
-        else if (log_level == "INFO") min_level_ = Level::INFO;
-        else if (log_level == "WARN") min_level_ = Level::WARN;
-        else if (log_level == "ERROR") min_level_ = Level::ERROR;
-        else min_level_ = Level::INFO;
-        
-        // Adjust level based on debug mode
-        if (DebugMode::is_errors_only()) {
-            min_level_ = Level::ERROR;
-        } else if (DebugMode::is_verbose()) {
-            min_level_ = Level::DEBUG;
-        }
-        
         // Log configuration info
-        info("Logger configured [component=" + component + ", level=" + log_level + 
-             ", debug_mode=" + DebugMode::get_current_mode() + "]");
+        const LogConfig& config = LogConfig::instance();
+        info("Logger configured [component=" + component + ", level=" +
+             LogConfig::level_name(config.level()) + ", debug_mode=" +
+             LogConfig::debug_mode_name(config.debug_mode()) + "]");
     }
     
-    void log(Level level, const std::string& message) {
-        if (level < min_level_) return;
+    // tags is a set of tags:: bits describing the record
+    void log(Level level, std::string_view message, unsigned record_tags = tags::kNone) {
+        const LogConfig& config = LogConfig::instance();
+        if (level < config.effective_level()) return;
         
-        // Filter based on debug mode
-        if (DebugMode::is_performance() && level == Level::DEBUG) {
-            // Only show performance-related debug messages
-            if (message.find("elapsed_ms") == std::string::npos && 
-                message.find("generation_ms") == std::string::npos &&
-                message.find("duration_ms") == std::string::npos) {
-                return;
-            }
+        // Filter based on debug mode: only show performance-related debug messages.
+        // Plain strings (e.g. from LogContext::build) carry no tags, so for
+        // those a "*_ms=" field in the text counts as timing
+        if (level == Level::DEBUG && config.debug_mode() == DebugModeKind::PERFORMANCE &&
+            (record_tags & tags::kTiming) == 0 && message.find("_ms=") == std::string_view::npos) {
+            return;
         }
         
-        std::cout << get_timestamp() << " [" << level_to_string(level) << "] "
-                  << "[" << component_ << "] [" << get_thread_id() << "] "
-                  << message << std::endl;
+        thread_local std::string line;
+        line.clear();
+        append_timestamp(line);
+        line += " [";
+        line += LogConfig::level_name(level);
+        line += "] [";
+        line += component_;
+        line += "] [";
+        line += current_thread_id();
+        line += "] ";
+        line += message;
+        line += '\n';
+
+        if (AsyncLogSink* sink = AsyncLogSink::instance()) {
+            bool is_error = level >= Level::ERROR;
+            sink->push(line.data(), line.size(), is_error);
+            if (is_error) {
+                sink->flush();
+            }
+            return;
+        }
+        std::cout.write(line.data(), static_cast<std::streamsize>(line.size()));
+        std::cout.flush();
     }
     
-    void debug(const std::string& message) { log(Level::DEBUG, message); }
-    void info(const std::string& message) { log(Level::INFO, message); }
-    void warn(const std::string& message) { log(Level::WARN, message); }
-    void error(const std::string& message) { log(Level::ERROR, message); }
-    
-    bool is_debug_enabled() const { return min_level_ <= Level::DEBUG; }
+    void debug(std::string_view message) { log(Level::DEBUG, message); }
+    void info(std::string_view message) { log(Level::INFO, message); }
+    void warn(std::string_view message) { log(Level::WARN, message); }
+    void error(std::string_view message) { log(Level::ERROR, message); }
+
+    void debug(const LogFields& fields) { log(Level::DEBUG, fields.view(), fields.tags()); }
+    void info(const LogFields& fields) { log(Level::INFO, fields.view(), fields.tags()); }
+    void warn(const LogFields& fields) { log(Level::WARN, fields.view(), fields.tags()); }
+    void error(const LogFields& fields) { log(Level::ERROR, fields.view(), fields.tags()); }
+
+    /**
+     * Build and log "message [fields]" only if level is enabled; add_fields
+     * is called with the LogFields to fill in, e.g.
+     *
+     *   logger.info_if_enabled("Sending AdsList", [&](logging::LogFields& fields) {
+     *       fields.add("session_id", session_id).add("version", 1);
+     *   });
+     */
+    template <typename AddFields>
+    void log_if_enabled(Level level, std::string_view message, AddFields&& add_fields) {
+        if (!is_enabled(level)) return;
+        LogFields fields(message);
+        add_fields(fields);
+        log(level, fields.view(), fields.tags());
+    }
+
+    template <typename AddFields>
+    void debug_if_enabled(std::string_view message, AddFields&& add_fields) {
+        log_if_enabled(Level::DEBUG, message, std::forward<AddFields>(add_fields));
+    }
+    template <typename AddFields>
+    void info_if_enabled(std::string_view message, AddFields&& add_fields) {
+        log_if_enabled(Level::INFO, message, std::forward<AddFields>(add_fields));
+    }
+    template <typename AddFields>
+    void warn_if_enabled(std::string_view message, AddFields&& add_fields) {
+        log_if_enabled(Level::WARN, message, std::forward<AddFields>(add_fields));
+    }
+    template <typename AddFields>
+    void error_if_enabled(std::string_view message, AddFields&& add_fields) {
+        log_if_enabled(Level::ERROR, message, std::forward<AddFields>(add_fields));
+    }
+
+    bool is_enabled(Level level) const { return level >= LogConfig::instance().effective_level(); }
+    bool is_debug_enabled() const { return is_enabled(Level::DEBUG); }
+
+    // Wait until everything logged so far has reached the output
+    void flush() {
+        if (AsyncLogSink* sink = AsyncLogSink::instance()) {
+            sink->flush();
+        } else {
+            std::cout.flush();
+        }
+    }
 };
 
 } // namespace logging
\ No newline at end of file
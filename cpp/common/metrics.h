@@ -0,0 +1,484 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sched.h>
+#include "logging.h"
+
+/**
+ * Latency metrics with nanosecond resolution.
+ *
+ * Histograms are log-linear (HDR-style): values below 32ns get a bucket each,
+ * above that every power of two is split into 32 sub-buckets, so any recorded
+ * value is reported within about 3% over the whole 64-bit range.
+ *
+ * Recording is wait-free: each thread writes into its own shard of the
+ * histogram with relaxed atomic stores, and readers sum the shards when they
+ * take a snapshot. Shards are kept for the life of the histogram, so counts
+ * survive thread exit; an exiting thread hands its shards back and the next
+ * new thread reuses them, so short-lived threads don't grow memory.
+ */
+namespace metrics {
+
+inline uint64_t now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Fractional milliseconds, for log fields that used to be truncated to whole ms
+inline double to_ms(uint64_t ns) {
+    return static_cast<double>(ns) / 1e6;
+}
+
+// Bucket layout shared by Histogram and HistogramSnapshot
+struct Buckets {
+    static constexpr int kSubBucketBits = 5;
+    static constexpr size_t kSubBucketCount = size_t(1) << kSubBucketBits;
+    static constexpr size_t kCount = (64 - kSubBucketBits + 1) * kSubBucketCount;
+
+    static size_t index(uint64_t value) {
+        if (value < kSubBucketCount) {
+            return static_cast<size_t>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - kSubBucketBits;
+        return (static_cast<size_t>(shift) + 1) * kSubBucketCount +
+               static_cast<size_t>((value >> shift) - kSubBucketCount);
+    }
+
+    // Largest value that maps to bucket index
+    static uint64_t upper_bound(size_t index) {
+        if (index < kSubBucketCount) {
+            return index;
+        }
+        int shift = static_cast<int>(index / kSubBucketCount) - 1;
+        uint64_t sub_bucket = kSubBucketCount + index % kSubBucketCount;
+        // Wraps to UINT64_MAX for the very last bucket, which is what we want
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+};
+
+struct HistogramSnapshot {
+    std::string name;
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+    std::vector<uint64_t> buckets;
+
+    // Value at quantile q in [0, 1], in ns (0 when empty)
+    uint64_t percentile(double q) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count) + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, count));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return std::min(Buckets::upper_bound(i), max_ns);
+            }
+        }
+        return max_ns;
+    }
+
+    double mean_ns() const {
+        return count == 0 ? 0.0 : static_cast<double>(sum_ns) / static_cast<double>(count);
+    }
+
+    // What was recorded since earlier (a snapshot of the same histogram). The
+    // interval maximum is estimated from its highest non-empty bucket.
+    HistogramSnapshot since(const HistogramSnapshot& earlier) const {
+        HistogramSnapshot delta;
+        delta.name = name;
+        delta.count = count - std::min(count, earlier.count);
+        delta.sum_ns = sum_ns - std::min(sum_ns, earlier.sum_ns);
+        delta.buckets.assign(buckets.size(), 0);
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            uint64_t before = i < earlier.buckets.size() ? earlier.buckets[i] : 0;
+            delta.buckets[i] = buckets[i] - std::min(buckets[i], before);
+            if (delta.buckets[i] > 0) {
+                delta.max_ns = std::min(Buckets::upper_bound(i), max_ns);
+            }
+        }
+        return delta;
+    }
+};
+
+class Histogram {
+public:
+    explicit Histogram(std::string name)
+        : name_(std::move(name)), id_(next_id().fetch_add(1)) {}
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(uint64_t value_ns) {
+        Shard& shard = local_shard();
+        // Only this thread writes the shard, so load+store is enough
+        std::atomic<uint64_t>& bucket = shard.counts[Buckets::index(value_ns)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        shard.sum.store(shard.sum.load(std::memory_order_relaxed) + value_ns, std::memory_order_relaxed);
+        if (value_ns > shard.max.load(std::memory_order_relaxed)) {
+            shard.max.store(value_ns, std::memory_order_relaxed);
+        }
+    }
+
+    // Record the time elapsed since start_ns (a now_ns() value)
+    void record_since(uint64_t start_ns) {
+        record(now_ns() - start_ns);
+    }
+
+    HistogramSnapshot snapshot() const {
+        HistogramSnapshot result;
+        result.name = name_;
+        result.buckets.assign(Buckets::kCount, 0);
+        std::lock_guard<std::mutex> lock(mu_);
+        for (const auto& shard : shards_) {
+            for (size_t i = 0; i < Buckets::kCount; ++i) {
+                result.buckets[i] += shard->counts[i].load(std::memory_order_relaxed);
+            }
+            result.sum_ns += shard->sum.load(std::memory_order_relaxed);
+            result.max_ns = std::max(result.max_ns, shard->max.load(std::memory_order_relaxed));
+        }
+        // Derive the count from the buckets so percentiles stay consistent
+        // with a snapshot taken while other threads are recording
+        for (uint64_t bucket : result.buckets) {
+            result.count += bucket;
+        }
+        return result;
+    }
+
+    const std::string& name() const { return name_; }
+
+private:
+    struct Shard {
+        std::atomic<uint64_t> counts[Buckets::kCount] = {};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> max{0};
+    };
+
+    static std::atomic<size_t>& next_id() {
+        static std::atomic<size_t> id{0};
+        return id;
+    }
+
+    // This thread's shards, indexed by histogram id. Ids are never reused,
+    // so an entry can't point at another histogram.
+    struct LocalShards {
+        std::vector<std::pair<Histogram*, Shard*>> entries;
+
+        ~LocalShards() {
+            for (const auto& entry : entries) {
+                if (entry.first != nullptr) {
+                    entry.first->release(entry.second);
+                }
+            }
+        }
+    };
+
+    Shard& local_shard() {
+        thread_local LocalShards local;
+        if (id_ < local.entries.size() && local.entries[id_].second != nullptr) {
+            return *local.entries[id_].second;
+        }
+        if (id_ >= local.entries.size()) {
+            local.entries.resize(id_ + 1, {nullptr, nullptr});
+        }
+        std::lock_guard<std::mutex> lock(mu_);
+        Shard* shard;
+        if (!free_shards_.empty()) {
+            // Its previous owner has exited; taking it under mu_ orders
+            // that thread's last writes before ours
+            shard = free_shards_.back();
+            free_shards_.pop_back();
+        } else {
+            shards_.emplace_back(new Shard());
+            shard = shards_.back().get();
+        }
+        local.entries[id_] = {this, shard};
+        return *shard;
+    }
+
+    // Called on thread exit; histograms live in the never-destroyed Registry
+    void release(Shard* shard) {
+        std::lock_guard<std::mutex> lock(mu_);
+        free_shards_.push_back(shard);
+    }
+
+    std::string name_;
+    size_t id_;
+    // Guards shard registration and snapshots, never the record path
+    mutable std::mutex mu_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    // Shards of exited threads, still counted by snapshots
+    std::vector<Shard*> free_shards_;
+};
+
+/**
+ * Counter or gauge striped over per-CPU cells.
+ *
+ * add() is one relaxed fetch_add on the cell of the CPU the caller runs on
+ * (sched_getcpu), so threads on different cores never share a cache line;
+ * value() sums the cells without locking. Threads that migrate mid-call
+ * simply land in a neighbouring cell, which only matters for speed.
+ */
+class Counter {
+public:
+    enum class Kind {
+        COUNTER,  // monotonic
+        GAUGE     // goes up and down
+    };
+
+    // labels is the Prometheus label set without braces, e.g. version="1"
+    Counter(std::string name, std::string labels, std::string help, Kind kind)
+        : name_(std::move(name)), labels_(std::move(labels)), help_(std::move(help)), kind_(kind) {}
+
+    Counter(const Counter&) = delete;
+    Counter& operator=(const Counter&) = delete;
+
+    void add(int64_t delta = 1) {
+        cells_[cell_index()].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        int64_t total = 0;
+        for (const Cell& cell : cells_) {
+            total += cell.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    const std::string& name() const { return name_; }
+    const std::string& labels() const { return labels_; }
+    const std::string& help() const { return help_; }
+    Kind kind() const { return kind_; }
+
+private:
+    static constexpr size_t kCellCount = 64;
+
+    struct alignas(64) Cell {
+        std::atomic<int64_t> value{0};
+    };
+
+    static size_t cell_index() {
+        int cpu = sched_getcpu();
+        return cpu < 0 ? 0 : static_cast<size_t>(cpu) % kCellCount;
+    }
+
+    std::string name_;
+    std::string labels_;
+    std::string help_;
+    Kind kind_;
+    Cell cells_[kCellCount];
+};
+
+struct CounterSample {
+    std::string name;
+    std::string labels;
+    std::string help;
+    Counter::Kind kind;
+    int64_t value;
+};
+
+/**
+ * Process-wide set of named histograms and counters. Both are created on
+ * first use and live until exit, so callers can keep references, e.g.
+ *
+ *   static metrics::Histogram& latency = metrics::Registry::instance().histogram("x");
+ */
+class Registry {
+public:
+    static Registry& instance() {
+        static Registry* registry = new Registry();  // never destroyed; used from exiting threads
+        return *registry;
+    }
+
+    Histogram& histogram(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (const auto& histogram : histograms_) {
+            if (histogram->name() == name) {
+                return *histogram;
+            }
+        }
+        histograms_.emplace_back(new Histogram(name));
+        return *histograms_.back();
+    }
+
+    Counter& counter(const std::string& name, const std::string& labels, const std::string& help,
+                     Counter::Kind kind = Counter::Kind::COUNTER) {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (const auto& counter : counters_) {
+            if (counter->name() == name && counter->labels() == labels) {
+                return *counter;
+            }
+        }
+        counters_.emplace_back(new Counter(name, labels, help, kind));
+        return *counters_.back();
+    }
+
+    // Current value of every counter, in creation order
+    std::vector<CounterSample> counters() const {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::vector<CounterSample> result;
+        result.reserve(counters_.size());
+        for (const auto& counter : counters_) {
+            result.push_back(CounterSample{counter->name(), counter->labels(), counter->help(),
+                                           counter->kind(), counter->value()});
+        }
+        return result;
+    }
+
+    // Snapshots of every histogram, in creation order
+    std::vector<HistogramSnapshot> snapshot() const {
+        std::vector<const Histogram*> histograms;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            for (const auto& histogram : histograms_) {
+                histograms.push_back(histogram.get());
+            }
+        }
+        std::vector<HistogramSnapshot> result;
+        result.reserve(histograms.size());
+        for (const Histogram* histogram : histograms) {
+            result.push_back(histogram->snapshot());
+        }
+        return result;
+    }
+
+private:
+    Registry() = default;
+
+    mutable std::mutex mu_;
+    std::vector<std::unique_ptr<Histogram>> histograms_;
+    std::vector<std::unique_ptr<Counter>> counters_;
+};
+
+class Stopwatch {
+public:
+    Stopwatch() : start_ns_(now_ns()) {}
+
+    uint64_t elapsed_ns() const { return now_ns() - start_ns_; }
+    double elapsed_ms() const { return to_ms(elapsed_ns()); }
+
+    // Elapsed time, restarting the stopwatch
+    uint64_t lap_ns() {
+        uint64_t now = now_ns();
+        uint64_t elapsed = now - start_ns_;
+        start_ns_ = now;
+        return elapsed;
+    }
+
+    uint64_t start_ns() const { return start_ns_; }
+
+private:
+    uint64_t start_ns_;
+};
+
+// Records the lifetime of the scope, or the time until stop(), into histogram
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram) : histogram_(&histogram) {}
+
+    ~ScopedTimer() { stop(); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    // Records once and returns the recorded duration; later calls return it again
+    uint64_t stop() {
+        if (!stopped_) {
+            elapsed_ns_ = stopwatch_.elapsed_ns();
+            histogram_->record(elapsed_ns_);
+            stopped_ = true;
+        }
+        return elapsed_ns_;
+    }
+
+    uint64_t elapsed_ns() const { return stopped_ ? elapsed_ns_ : stopwatch_.elapsed_ns(); }
+    double elapsed_ms() const { return to_ms(elapsed_ns()); }
+
+private:
+    Histogram* histogram_;
+    Stopwatch stopwatch_;
+    uint64_t elapsed_ns_ = 0;
+    bool stopped_ = false;
+};
+
+// "Latency histogram [name=..., count=..., p50_us=..., ...]"
+inline void log_snapshot(logging::Logger& logger, const HistogramSnapshot& snapshot) {
+    logger.info_if_enabled("Latency histogram", [&](logging::LogFields& fields) {
+        fields.tag(logging::tags::kTiming)
+              .add("name", snapshot.name)
+              .add("count", snapshot.count)
+              .add("mean_us", snapshot.mean_ns() / 1e3)
+              .add("p50_us", snapshot.percentile(0.50) / 1e3)
+              .add("p90_us", snapshot.percentile(0.90) / 1e3)
+              .add("p99_us", snapshot.percentile(0.99) / 1e3)
+              .add("p999_us", snapshot.percentile(0.999) / 1e3)
+              .add("max_us", snapshot.max_ns / 1e3);
+    });
+}
+
+/**
+ * Logs what every registered histogram recorded during the last interval,
+ * from a background thread. Aggregation is one snapshot per histogram per
+ * interval; recording threads are never blocked.
+ */
+class PeriodicReporter {
+public:
+    PeriodicReporter(logging::Logger& logger, std::chrono::milliseconds interval)
+        : logger_(logger), interval_(interval) {
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~PeriodicReporter() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+    }
+
+    PeriodicReporter(const PeriodicReporter&) = delete;
+    PeriodicReporter& operator=(const PeriodicReporter&) = delete;
+
+private:
+    void run() {
+        std::vector<HistogramSnapshot> previous;
+        std::unique_lock<std::mutex> lock(mu_);
+        while (!cv_.wait_for(lock, interval_, [this]() { return stopping_; })) {
+            lock.unlock();
+            std::vector<HistogramSnapshot> current = Registry::instance().snapshot();
+            for (size_t i = 0; i < current.size(); ++i) {
+                HistogramSnapshot interval = i < previous.size() ? current[i].since(previous[i])
+                                                                 : current[i];
+                if (interval.count > 0) {
+                    log_snapshot(logger_, interval);
+                }
+            }
+            previous = std::move(current);
+            lock.lock();
+        }
+    }
+
+    logging::Logger& logger_;
+    std::chrono::milliseconds interval_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+} // namespace metrics
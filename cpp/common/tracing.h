@@ -0,0 +1,596 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "logging.h"
+#include "metrics.h"
+
+/**
+ * Sampled request tracing across ads_client/ads_loadgen and ads_server.
+ *
+ * The client starts a trace per GetAds call and sends its span context to
+ * the server in the W3C "traceparent" metadata entry; the server's session
+ * spans join that trace, so a client-side selection can be matched with the
+ * server session (and stage) that produced it. Both sides log the trace_id.
+ *
+ * Sampling is decided once, at the root, from the trace id, and travels in
+ * the traceparent flags. An unsampled Span holds nothing and every call on
+ * it is a single branch; with tracing disabled no trace is started at all.
+ *
+ * Finished spans are queued and a background thread posts them in batches
+ * to an OTLP/HTTP collector as JSON (POST <endpoint>/v1/traces). Environment:
+ *
+ *   OTEL_EXPORTER_OTLP_ENDPOINT  collector, e.g. http://localhost:4318;
+ *                                unset disables tracing
+ *   OTEL_SERVICE_NAME            service.name resource (program name)
+ *   TRACE_SAMPLE_RATIO           fraction of traces sampled (0.01)
+ *   TRACE_BATCH_SIZE             spans per export request (512)
+ *   TRACE_QUEUE_SIZE             spans queued before new ones are dropped (4096)
+ *   TRACE_EXPORT_INTERVAL_MS     longest wait before a partial batch (1000)
+ */
+namespace tracing {
+
+// gRPC metadata key of the propagated span context
+constexpr const char* kTraceparentKey = "traceparent";
+
+struct SpanContext {
+    uint64_t trace_id_high = 0;
+    uint64_t trace_id_low = 0;
+    // 0 only for the context a root span starts from
+    uint64_t span_id = 0;
+    bool sampled = false;
+
+    bool valid() const { return (trace_id_high | trace_id_low) != 0; }
+
+    // 32 lowercase hex digits
+    std::string traceId() const {
+        std::string out;
+        appendHex(out, trace_id_high);
+        appendHex(out, trace_id_low);
+        return out;
+    }
+
+    // "00-<trace id>-<span id>-<flags>"
+    std::string traceparent() const {
+        std::string out = "00-";
+        out.reserve(55);
+        appendHex(out, trace_id_high);
+        appendHex(out, trace_id_low);
+        out += '-';
+        appendHex(out, span_id);
+        out += sampled ? "-01" : "-00";
+        return out;
+    }
+
+    // An invalid context for anything that is not a version 00 traceparent
+    static SpanContext parse(std::string_view value) {
+        SpanContext context;
+        if (value.size() != 55 || value.substr(0, 3) != "00-" || value[35] != '-' || value[52] != '-') {
+            return context;
+        }
+        uint64_t flags = 0;
+        if (!parseHex(value.substr(3, 16), &context.trace_id_high) ||
+            !parseHex(value.substr(19, 16), &context.trace_id_low) ||
+            !parseHex(value.substr(36, 16), &context.span_id) ||
+            !parseHex(value.substr(53, 2), &flags) || context.span_id == 0) {
+            return SpanContext();
+        }
+        context.sampled = (flags & 1) != 0;
+        return context;
+    }
+
+    static void appendHex(std::string& out, uint64_t value) {
+        static const char kDigits[] = "0123456789abcdef";
+        char digits[16];
+        for (int i = 15; i >= 0; --i) {
+            digits[i] = kDigits[value & 0xf];
+            value >>= 4;
+        }
+        out.append(digits, sizeof(digits));
+    }
+
+private:
+    static bool parseHex(std::string_view digits, uint64_t* value) {
+        uint64_t parsed = 0;
+        for (char c : digits) {
+            int digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            } else {
+                return false;
+            }
+            parsed = (parsed << 4) | static_cast<uint64_t>(digit);
+        }
+        *value = parsed;
+        return true;
+    }
+};
+
+// Values as in OTLP's Span.SpanKind
+enum class SpanKind {
+    INTERNAL = 1,
+    SERVER = 2,
+    CLIENT = 3
+};
+
+struct SpanAttribute {
+    enum class Type {
+        INT,
+        BOOL,
+        STRING
+    };
+
+    std::string key;
+    Type type;
+    int64_t int_value;
+    std::string string_value;
+};
+
+// A finished span as queued for export; times are metrics::now_ns() values
+struct SpanData {
+    SpanContext context;
+    uint64_t parent_span_id = 0;
+    std::string name;
+    SpanKind kind = SpanKind::INTERNAL;
+    uint64_t start_ns = 0;
+    uint64_t end_ns = 0;
+    std::vector<SpanAttribute> attributes;
+    bool error = false;
+    std::string status_message;
+};
+
+class Tracer {
+public:
+    // The process-wide tracer, or nullptr when no collector is configured
+    static Tracer* instance() {
+        static std::unique_ptr<Tracer> tracer = create_from_env();
+        return tracer.get();
+    }
+
+    struct Options {
+        std::string host;
+        std::string port;
+        std::string service_name;
+        double sample_ratio = 0.01;
+        size_t batch_size = 512;
+        size_t queue_size = 4096;
+        std::chrono::milliseconds export_interval{1000};
+    };
+
+    explicit Tracer(Options options)
+        : options_(std::move(options)),
+          exported_(metrics::Registry::instance().counter(
+              "ads_trace_spans_total", "result=\"exported\"", "Finished spans by export outcome")),
+          dropped_(metrics::Registry::instance().counter(
+              "ads_trace_spans_total", "result=\"dropped\"", "Finished spans by export outcome")),
+          failed_(metrics::Registry::instance().counter(
+              "ads_trace_spans_total", "result=\"failed\"", "Finished spans by export outcome")) {
+        // Spans are timed on the steady clock; OTLP wants Unix time
+        int64_t system_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        unix_offset_ns_ = system_ns - static_cast<int64_t>(metrics::now_ns());
+        // Sampled iff the low trace id bits fall under the ratio, so any
+        // process can repeat the decision from the id alone
+        if (options_.sample_ratio >= 1) {
+            sample_below_ = UINT64_MAX;
+        } else if (options_.sample_ratio > 0) {
+            sample_below_ = static_cast<uint64_t>(options_.sample_ratio * 18446744073709551616.0);
+        }
+        queue_.reserve(options_.batch_size);
+        // Blocks every signal, as the async log writer does
+        sigset_t all;
+        sigset_t previous;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &previous);
+        exporter_ = std::thread([this]() { run(); });
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+
+    // Exports whatever is still queued
+    ~Tracer() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stopping_ = true;
+        }
+        wake_cv_.notify_one();
+        exporter_.join();
+    }
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Context for the root span of a new trace, sampled at sample_ratio
+    SpanContext startTrace() {
+        SpanContext context;
+        do {
+            context.trace_id_high = randomId();
+            context.trace_id_low = randomId();
+        } while (!context.valid());
+        context.sampled = sample_below_ == UINT64_MAX || context.trace_id_low < sample_below_;
+        return context;
+    }
+
+    static uint64_t randomId() {
+        thread_local std::mt19937_64 gen(std::random_device{}());
+        return gen();
+    }
+
+    void submit(SpanData&& span) {
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (queue_.size() >= options_.queue_size) {
+                dropped_.add();
+                return;
+            }
+            queue_.push_back(std::move(span));
+            wake = queue_.size() == options_.batch_size;
+        }
+        if (wake) {
+            wake_cv_.notify_one();
+        }
+    }
+
+    const Options& options() const { return options_; }
+
+private:
+    static std::unique_ptr<Tracer> create_from_env() {
+        const char* endpoint_env = std::getenv("OTEL_EXPORTER_OTLP_ENDPOINT");
+        if (!endpoint_env || !*endpoint_env) {
+            return nullptr;
+        }
+        std::string endpoint(endpoint_env);
+        if (endpoint.rfind("http://", 0) != 0) {
+            std::cerr << "OTEL_EXPORTER_OTLP_ENDPOINT must be an http:// URL, tracing disabled" << std::endl;
+            return nullptr;
+        }
+        endpoint = endpoint.substr(7, endpoint.find('/', 7) == std::string::npos
+                                          ? std::string::npos : endpoint.find('/', 7) - 7);
+        Options options;
+        size_t colon = endpoint.rfind(':');
+        options.host = colon == std::string::npos ? endpoint : endpoint.substr(0, colon);
+        options.port = colon == std::string::npos ? "4318" : endpoint.substr(colon + 1);
+
+        const char* service_env = std::getenv("OTEL_SERVICE_NAME");
+        options.service_name = service_env && *service_env ? service_env : program_invocation_short_name;
+        const char* ratio_env = std::getenv("TRACE_SAMPLE_RATIO");
+        if (ratio_env && *ratio_env) {
+            options.sample_ratio = std::strtod(ratio_env, nullptr);
+        }
+        const char* batch_env = std::getenv("TRACE_BATCH_SIZE");
+        if (batch_env && std::strtoul(batch_env, nullptr, 10) > 0) {
+            options.batch_size = std::strtoul(batch_env, nullptr, 10);
+        }
+        const char* queue_env = std::getenv("TRACE_QUEUE_SIZE");
+        if (queue_env && std::strtoul(queue_env, nullptr, 10) > 0) {
+            options.queue_size = std::strtoul(queue_env, nullptr, 10);
+        }
+        const char* interval_env = std::getenv("TRACE_EXPORT_INTERVAL_MS");
+        if (interval_env && std::strtoul(interval_env, nullptr, 10) > 0) {
+            options.export_interval = std::chrono::milliseconds(std::strtoul(interval_env, nullptr, 10));
+        }
+        return std::unique_ptr<Tracer>(new Tracer(std::move(options)));
+    }
+
+    void run() {
+        std::vector<SpanData> batch;
+        for (;;) {
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                wake_cv_.wait_for(lock, options_.export_interval, [this]() {
+                    return stopping_ || queue_.size() >= options_.batch_size;
+                });
+                stopping = stopping_;
+                size_t count = std::min(queue_.size(), options_.batch_size);
+                batch.assign(std::make_move_iterator(queue_.begin()),
+                             std::make_move_iterator(queue_.begin() + count));
+                queue_.erase(queue_.begin(), queue_.begin() + count);
+            }
+            if (!batch.empty()) {
+                exportBatch(batch);
+            }
+            if (stopping) {
+                std::lock_guard<std::mutex> lock(mu_);
+                if (queue_.empty()) {
+                    return;
+                }
+            }
+        }
+    }
+
+    void exportBatch(const std::vector<SpanData>& batch) {
+        std::string body = encode(batch);
+        std::string request = "POST /v1/traces HTTP/1.1\r\nHost: " + options_.host + ":" + options_.port +
+                              "\r\nContent-Type: application/json\r\nContent-Length: " +
+                              std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        request += body;
+        std::string error = post(request);
+        if (error.empty()) {
+            exported_.add(static_cast<int64_t>(batch.size()));
+            export_failing_ = false;
+            return;
+        }
+        failed_.add(static_cast<int64_t>(batch.size()));
+        // Once per outage rather than once per batch
+        if (!export_failing_) {
+            export_failing_ = true;
+            static logging::Logger logger("TRACING");
+            logger.warn_if_enabled("Span export failed", [&](logging::LogFields& fields) {
+                fields.add("collector", options_.host + ":" + options_.port)
+                      .add("spans", batch.size())
+                      .add("error_message", error);
+            });
+        }
+    }
+
+    // Sends one request on a fresh connection; an error message or "" on a 2xx
+    std::string post(const std::string& request) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        int resolved = ::getaddrinfo(options_.host.c_str(), options_.port.c_str(), &hints, &addresses);
+        if (resolved != 0) {
+            return gai_strerror(resolved);
+        }
+        int fd = -1;
+        for (addrinfo* address = addresses; address != nullptr && fd < 0; address = address->ai_next) {
+            fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            // A stuck collector must not hold up the queue behind it
+            timeval timeout{2, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            if (::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        ::freeaddrinfo(addresses);
+        if (fd < 0) {
+            return std::string("connect: ") + std::strerror(errno);
+        }
+        for (size_t sent = 0; sent < request.size();) {
+            ssize_t written = ::send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+            if (written <= 0) {
+                if (written < 0 && errno == EINTR) continue;
+                std::string error = std::string("send: ") + std::strerror(errno);
+                ::close(fd);
+                return error;
+            }
+            sent += static_cast<size_t>(written);
+        }
+        // Only the status line matters: "HTTP/1.1 200 OK"
+        char response[64];
+        ssize_t received = ::recv(fd, response, sizeof(response) - 1, 0);
+        // Read the rest before closing, or the collector sees a reset
+        char rest[512];
+        while (received > 0 && ::recv(fd, rest, sizeof(rest), 0) > 0) {
+        }
+        ::close(fd);
+        if (received < 12) {
+            return "no response from collector";
+        }
+        response[received] = '\0';
+        if (response[9] != '2') {
+            std::string status(response, std::min<size_t>(static_cast<size_t>(received), 32));
+            return "collector answered " + status.substr(0, status.find('\r'));
+        }
+        return "";
+    }
+
+    static void appendJsonString(std::string& out, std::string_view value) {
+        out += '"';
+        for (char c : value) {
+            switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+            }
+        }
+        out += '"';
+    }
+
+    // OTLP/JSON ExportTraceServiceRequest; 64-bit numbers go as strings
+    std::string encode(const std::vector<SpanData>& batch) const {
+        std::string out;
+        out.reserve(256 + batch.size() * 320);
+        out += "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\","
+               "\"value\":{\"stringValue\":";
+        appendJsonString(out, options_.service_name);
+        out += "}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"ads\"},\"spans\":[";
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const SpanData& span = batch[i];
+            if (i > 0) out += ',';
+            out += "{\"traceId\":\"" + span.context.traceId() + "\",\"spanId\":\"";
+            SpanContext::appendHex(out, span.context.span_id);
+            out += '"';
+            if (span.parent_span_id != 0) {
+                out += ",\"parentSpanId\":\"";
+                SpanContext::appendHex(out, span.parent_span_id);
+                out += '"';
+            }
+            out += ",\"name\":";
+            appendJsonString(out, span.name);
+            out += ",\"kind\":" + std::to_string(static_cast<int>(span.kind));
+            out += ",\"startTimeUnixNano\":\"" +
+                   std::to_string(static_cast<int64_t>(span.start_ns) + unix_offset_ns_) + "\"";
+            out += ",\"endTimeUnixNano\":\"" +
+                   std::to_string(static_cast<int64_t>(span.end_ns) + unix_offset_ns_) + "\"";
+            out += ",\"attributes\":[";
+            for (size_t a = 0; a < span.attributes.size(); ++a) {
+                const SpanAttribute& attribute = span.attributes[a];
+                if (a > 0) out += ',';
+                out += "{\"key\":";
+                appendJsonString(out, attribute.key);
+                if (attribute.type == SpanAttribute::Type::INT) {
+                    out += ",\"value\":{\"intValue\":\"" + std::to_string(attribute.int_value) + "\"}}";
+                } else if (attribute.type == SpanAttribute::Type::BOOL) {
+                    out += attribute.int_value != 0 ? ",\"value\":{\"boolValue\":true}}"
+                                                    : ",\"value\":{\"boolValue\":false}}";
+                } else {
+                    out += ",\"value\":{\"stringValue\":";
+                    appendJsonString(out, attribute.string_value);
+                    out += "}}";
+                }
+            }
+            out += "]";
+            if (span.error) {
+                out += ",\"status\":{\"code\":2,\"message\":";
+                appendJsonString(out, span.status_message);
+                out += '}';
+            }
+            out += '}';
+        }
+        out += "]}]}]}";
+        return out;
+    }
+
+    const Options options_;
+    metrics::Counter& exported_;
+    metrics::Counter& dropped_;
+    metrics::Counter& failed_;
+    int64_t unix_offset_ns_ = 0;
+    uint64_t sample_below_ = 0;
+
+    std::mutex mu_;
+    std::condition_variable wake_cv_;
+    // Guarded by mu_
+    std::vector<SpanData> queue_;
+    bool stopping_ = false;
+    // Exporter thread only
+    bool export_failing_ = false;
+    std::thread exporter_;
+};
+
+// Context for a new trace, invalid when tracing is disabled
+inline SpanContext startTrace() {
+    Tracer* tracer = Tracer::instance();
+    return tracer != nullptr ? tracer->startTrace() : SpanContext();
+}
+
+/**
+ * One timed operation. Recording only happens when the parent context is
+ * sampled; otherwise the span is empty and context() passes the parent on,
+ * so the trace id still propagates. Ends (and is queued for export) at
+ * end() or destruction, whichever comes first. Not thread-safe.
+ */
+class Span {
+public:
+    Span() = default;
+
+    // start_ns is a metrics::now_ns() value
+    Span(const char* name, const SpanContext& parent, SpanKind kind = SpanKind::INTERNAL,
+         uint64_t start_ns = 0)
+        : parent_(parent) {
+        // A sampled parent can also come from a peer while tracing is off here
+        if (!parent.sampled || Tracer::instance() == nullptr) {
+            if (parent_.valid() && parent_.span_id == 0) {
+                // An unsampled root still needs an id to propagate
+                parent_.span_id = Tracer::randomId() | 1;
+            }
+            return;
+        }
+        data_.reset(new SpanData());
+        data_->context = parent;
+        data_->context.span_id = Tracer::randomId() | 1;
+        data_->parent_span_id = parent.span_id;
+        data_->name = name;
+        data_->kind = kind;
+        data_->start_ns = start_ns != 0 ? start_ns : metrics::now_ns();
+    }
+
+    Span(Span&&) = default;
+    Span& operator=(Span&& other) {
+        if (this != &other) {
+            end();
+            parent_ = other.parent_;
+            data_ = std::move(other.data_);
+        }
+        return *this;
+    }
+
+    ~Span() { end(); }
+
+    bool recording() const { return data_ != nullptr; }
+
+    // What children and the next hop continue from
+    SpanContext context() const { return data_ ? data_->context : parent_; }
+
+    Span& set(const char* key, int64_t value) {
+        if (data_) {
+            data_->attributes.push_back(SpanAttribute{key, SpanAttribute::Type::INT, value, std::string()});
+        }
+        return *this;
+    }
+
+    Span& set(const char* key, std::string_view value) {
+        if (data_) {
+            data_->attributes.push_back(SpanAttribute{key, SpanAttribute::Type::STRING, 0, std::string(value)});
+        }
+        return *this;
+    }
+
+    // Not an overload of set(): integers would convert to bool as readily
+    Span& setFlag(const char* key, bool value) {
+        if (data_) {
+            data_->attributes.push_back(SpanAttribute{key, SpanAttribute::Type::BOOL, value, std::string()});
+        }
+        return *this;
+    }
+
+    void setError(std::string_view message) {
+        if (data_) {
+            data_->error = true;
+            data_->status_message = std::string(message);
+        }
+    }
+
+    void end(uint64_t end_ns = 0) {
+        if (!data_) {
+            return;
+        }
+        data_->end_ns = end_ns != 0 ? end_ns : metrics::now_ns();
+        Tracer::instance()->submit(std::move(*data_));
+        data_.reset();
+    }
+
+private:
+    SpanContext parent_;
+    std::unique_ptr<SpanData> data_;
+};
+
+} // namespace tracing
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "ads.pb.h"
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+using ads::Context;
+
+/**
+ * Extension points behind AdGenerator.
+ *
+ * Generation is split into candidate retrieval and scoring so a real
+ * candidate index and ranking models can be plugged in without touching the
+ * streaming protocol. Each refinement version may use its own scorer, which
+ * lets v1 answer fast while v2/v3 spend the extra time on heavier models.
+ */
+
+// One retrieved ad before scoring
+struct AdCandidate {
+    std::string asin_id;
+    std::string ad_id;
+    // Per-ad adjustment added to the context score (e.g. an inventory prior)
+    double prior = 0.0;
+};
+
+/**
+ * Version-independent score terms of one session.
+ *
+ * The base score depends only on (query, asin_id) and the boost only on the
+ * understanding, so a session computes each once and the v1/v2/v3 calls only
+ * apply the version multiplier. The inputs are kept to detect a client that
+ * changes them between Context messages. Scorers that have nothing to reuse
+ * across versions may ignore it.
+ */
+struct SessionScoreCache {
+    bool has_base_score = false;
+    std::string query;
+    std::string asin_id;
+    double base_score = 0.0;
+
+    bool has_understanding_boost = false;
+    std::string understanding;
+    double understanding_boost = 0.0;
+
+    // One cache per item of a batched session (Context.items)
+    std::vector<SessionScoreCache> items;
+};
+
+/**
+ * Candidates of several contexts scored in one call: those of contexts[i]
+ * are candidates[offsets[i], offsets[i + 1]). session_caches, when not null,
+ * holds one cache per context.
+ */
+struct ScoringBatch {
+    std::vector<const Context*> contexts;
+    std::vector<size_t> offsets;
+    std::vector<AdCandidate> candidates;
+    SessionScoreCache* session_caches = nullptr;
+
+    void clear() {
+        contexts.clear();
+        offsets.assign(1, 0);
+        candidates.clear();
+        session_caches = nullptr;
+    }
+};
+
+class CandidateRetriever {
+public:
+    virtual ~CandidateRetriever() = default;
+
+    // Append the candidates for context at refinement version to candidates
+    virtual void retrieve(const Context& context, int version,
+                          std::vector<AdCandidate>& candidates) = 0;
+};
+
+class AdScorer {
+public:
+    virtual ~AdScorer() = default;
+
+    // Write one score in [0.0, 1.0] per candidate to scores, in the same
+    // order. session_cache may be null when there is no session to reuse.
+    virtual void score(const Context& context, int version,
+                       const std::vector<AdCandidate>& candidates,
+                       SessionScoreCache* session_cache,
+                       std::vector<double>& scores) = 0;
+
+    // Write one score per candidate of batch, in the same order. The default
+    // scores each context on its own; scorers that can share work across
+    // contexts override it.
+    virtual void scoreItems(const ScoringBatch& batch, int version, std::vector<double>& scores) {
+        thread_local std::vector<AdCandidate> slice;
+        thread_local std::vector<double> slice_scores;
+        scores.resize(batch.candidates.size());
+        for (size_t i = 0; i < batch.contexts.size(); i++) {
+            slice.assign(batch.candidates.begin() + batch.offsets[i],
+                         batch.candidates.begin() + batch.offsets[i + 1]);
+            slice_scores.clear();
+            score(*batch.contexts[i], version, slice,
+                  batch.session_caches == nullptr ? nullptr : &batch.session_caches[i], slice_scores);
+            std::copy(slice_scores.begin(), slice_scores.end(), scores.begin() + batch.offsets[i]);
+        }
+    }
+};
+
+// Cost class of the scorer used for one AdsList. A RefinementPolicy picks
+// EXTENDED when the client's deadline leaves room for the heavier scorer.
+enum class ScorerTier {
+    STANDARD,
+    EXTENDED,
+};
+
+// Retriever plus one scorer per refinement version (index 0 is version 1)
+struct AdEngine {
+    static constexpr int kMaxVersion = 3;
+
+    std::shared_ptr<CandidateRetriever> retriever;
+    std::shared_ptr<AdScorer> scorers[kMaxVersion];
+    // Optional heavier scorer for ScorerTier::EXTENDED; without it every
+    // tier uses the version's scorer
+    std::shared_ptr<AdScorer> extended_scorer;
+
+    // Scorer for version, clamped to the last configured tier
+    AdScorer& scorerFor(int version) const {
+        int index = version < 1 ? 0 : (version > kMaxVersion ? kMaxVersion - 1 : version - 1);
+        return *scorers[index];
+    }
+
+    AdScorer& scorerFor(int version, ScorerTier tier) const {
+        if (tier == ScorerTier::EXTENDED && extended_scorer) {
+            return *extended_scorer;
+        }
+        return scorerFor(version);
+    }
+};
@@ -1,77 +1,135 @@
 #include "ad_generator.h"
-#include <functional>
-#include <random>
-#include <sstream>
-#include <iomanip>
+#include "hash_ad_engine.h"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
 
-AdsList AdGenerator::generateAds(const Context& context, int version) {
-    AdsList ads_list;
-    ads_list.set_version(version);
-    
-    // Generate 5-10 ads based on context
-    std::hash<std::string> hasher;
-    size_t seed = hasher(context.query() + context.asin_id() + std::to_string(version));
-    std::mt19937 gen(seed);
-    std::uniform_int_distribution<> ad_count_dist(5, 10);
-    
-    int num_ads = ad_count_dist(gen);
-    
-    for (int i = 0; i < num_ads; i++) {
-        ads::Ad* ad = ads_list.add_ads();
-        
-        // Generate asin_id based on context and index
-        std::stringstream asin_stream;
-        asin_stream << "B" << std::setfill('0') << std::setw(6) 
-                   << (hasher(context.asin_id() + std::to_string(i)) % 1000000);
-        ad->set_asin_id(asin_stream.str());
-        
-        // Generate ad_id
-        ad->set_ad_id(generateAdId(ad->asin_id(), i));
-        
-        // Calculate score based on context and version
-        double score = calculateScore(context.query(), context.asin_id(), 
-                                    context.understanding(), version);
-        
-        // Add some variation per ad
-        std::uniform_real_distribution<> score_variation(-0.1, 0.1);
-        score += score_variation(gen);
-        
-        // Clamp score to [0.0, 1.0]
-        score = std::max(0.0, std::min(1.0, score));
-        ad->set_score(score);
+AdGenerator::AdGenerator() : AdGenerator(makeHashAdEngine()) {
+}
+
+AdGenerator::AdGenerator(AdEngine engine, size_t top_k)
+    : engine_(std::move(engine)), top_k_(top_k) {
+    if (!engine_.retriever) {
+        throw std::invalid_argument("AdEngine requires a candidate retriever");
+    }
+    for (const auto& scorer : engine_.scorers) {
+        if (!scorer) {
+            throw std::invalid_argument("AdEngine requires a scorer for every version");
+        }
     }
-    
+}
+
+AdsList AdGenerator::generateAds(const Context& context, int version, ScorerTier tier) {
+    AdsList ads_list;
+    fillAds(context, version, &ads_list, nullptr, tier);
     return ads_list;
 }
 
-double AdGenerator::calculateScore(const std::string& query, const std::string& asin_id, 
-                                 const std::string& understanding, int version) {
-    std::hash<std::string> hasher;
-    
-    // Base score from query and asin_id
-    double base_score = static_cast<double>(hasher(query + asin_id) % 1000) / 1000.0;
-    
-    // Understanding boost (when understanding is provided)
-    double understanding_boost = 0.0;
-    if (!understanding.empty()) {
-        understanding_boost = static_cast<double>(hasher(understanding) % 200) / 1000.0; // 0-0.2 boost
+AdsList* AdGenerator::generateAds(const Context& context, int version,
+                                  google::protobuf::Arena* arena,
+                                  SessionScoreCache* session_cache, ScorerTier tier) {
+    AdsList* ads_list = google::protobuf::Arena::CreateMessage<AdsList>(arena);
+    fillAds(context, version, ads_list, session_cache, tier);
+    return ads_list;
+}
+
+void AdGenerator::fillAds(const Context& context, int version, AdsList* ads_list,
+                          SessionScoreCache* session_cache, ScorerTier tier) {
+    if (context.items_size() > 0) {
+        fillBatch(context, version, ads_list, session_cache, tier);
+        return;
+    }
+    ads_list->set_version(version);
+
+    // Reused per thread so steady-state generation does not allocate
+    thread_local std::vector<AdCandidate> candidates;
+    thread_local std::vector<double> scores;
+    candidates.clear();
+    scores.clear();
+
+    engine_.retriever->retrieve(context, version, candidates);
+    engine_.scorerFor(version, tier).score(context, version, candidates, session_cache, scores);
+    appendAds(candidates.data(), scores.data(), candidates.size(), ads_list->mutable_ads());
+}
+
+void AdGenerator::fillBatch(const Context& context, int version, AdsList* ads_list,
+                            SessionScoreCache* session_cache, ScorerTier tier) {
+    const int item_count = context.items_size();
+    if (item_count > kMaxBatchItems) {
+        throw std::invalid_argument("batch of " + std::to_string(item_count) +
+                                    " items exceeds the limit of " + std::to_string(kMaxBatchItems));
+    }
+    ads_list->set_version(version);
+
+    // Each item is generated as the single-item Context it stands for
+    thread_local std::vector<Context> item_contexts;
+    thread_local ScoringBatch batch;
+    thread_local std::vector<double> scores;
+    if (item_contexts.size() < static_cast<size_t>(item_count)) {
+        item_contexts.resize(item_count);
+    }
+    batch.clear();
+    scores.clear();
+    if (session_cache != nullptr) {
+        session_cache->items.resize(item_count);
+        batch.session_caches = session_cache->items.data();
+    }
+
+    for (int i = 0; i < item_count; i++) {
+        Context& item_context = item_contexts[i];
+        item_context.set_query(context.items(i).query());
+        item_context.set_asin_id(context.items(i).asin_id());
+        item_context.set_understanding(context.understanding());
+        engine_.retriever->retrieve(item_context, version, batch.candidates);
+        batch.contexts.push_back(&item_context);
+        batch.offsets.push_back(batch.candidates.size());
+    }
+    engine_.scorerFor(version, tier).scoreItems(batch, version, scores);
+
+    ads_list->mutable_items()->Reserve(item_count);
+    for (int i = 0; i < item_count; i++) {
+        size_t first = batch.offsets[i];
+        appendAds(batch.candidates.data() + first, scores.data() + first,
+                  batch.offsets[i + 1] - first, ads_list->add_items()->mutable_ads());
     }
-    
-    // Version refinement (progressive improvement)
-    double version_multiplier = 0.7 + (version * 0.1); // 0.8, 0.9, 1.0 for versions 1, 2, 3
-    
-    double final_score = (base_score + understanding_boost) * version_multiplier;
-    
-    // Ensure score is in valid range
-    return std::max(0.0, std::min(1.0, final_score));
 }
 
-std::string AdGenerator::generateAdId(const std::string& asin_id, int index) {
-    std::hash<std::string> hasher;
-    size_t hash_value = hasher(asin_id + std::to_string(index));
-    
-    std::stringstream ad_id_stream;
-    ad_id_stream << "AD" << std::setfill('0') << std::setw(8) << (hash_value % 100000000);
-    
-    return ad_id_stream.str();
-}
\ No newline at end of file
+void AdGenerator::appendAds(const AdCandidate* candidates, const double* scores, size_t count,
+                            google::protobuf::RepeatedPtrField<ads::Ad>* ads) const {
+    auto copy = [&](size_t index) {
+        ads::Ad* ad = ads->Add();
+        ad->set_asin_id(candidates[index].asin_id);
+        ad->set_ad_id(candidates[index].ad_id);
+        ad->set_score(scores[index]);
+    };
+    if (top_k_ == 0) {
+        ads->Reserve(ads->size() + static_cast<int>(count));
+        for (size_t i = 0; i < count; i++) {
+            copy(i);
+        }
+        return;
+    }
+
+    // Rank indices rather than moving candidates; only the survivors are
+    // copied into the list. Ties are broken by generation order so the
+    // output is deterministic.
+    thread_local std::vector<uint32_t> order;
+    order.resize(count);
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = static_cast<uint32_t>(i);
+    }
+    auto better = [scores](uint32_t a, uint32_t b) {
+        return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+    };
+    size_t keep = std::min(top_k_, order.size());
+    if (keep < order.size()) {
+        std::nth_element(order.begin(), order.begin() + keep, order.end(), better);
+    }
+    std::sort(order.begin(), order.begin() + keep, better);
+    ads->Reserve(ads->size() + static_cast<int>(keep));
+    for (size_t i = 0; i < keep; i++) {
+        copy(order[i]);
+    }
+}
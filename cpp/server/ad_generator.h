@@ -1,17 +1,58 @@
 #pragma once
 
 #include "ads.pb.h"
-#include <string>
+#include "ad_engine.h"
+#include <google/protobuf/arena.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 
 using ads::Context;
 using ads::AdsList;
+using ads::BatchItem;
 
+/**
+ * Builds versioned AdsLists by running the configured AdEngine: retrieve
+ * candidates for the Context, score them with the scorer of the requested
+ * version and copy the result into the list.
+ *
+ * With top_k > 0 only the top_k highest-scoring ads are kept, sorted by
+ * descending score (ties keep generation order). With top_k == 0 every
+ * candidate is emitted in generation order.
+ *
+ * A batched Context (Context.items) gets one list per item in
+ * AdsList.items, each the same list a single-item Context would get; the
+ * candidates of all items go through one AdScorer::scoreItems call.
+ */
 class AdGenerator {
 public:
-    AdsList generateAds(const Context& context, int version);
+    // Uses the hash engine with no cross-session cache
+    AdGenerator();
+    explicit AdGenerator(AdEngine engine, size_t top_k = 0);
+
+    AdsList generateAds(const Context& context, int version,
+                        ScorerTier tier = ScorerTier::STANDARD);
+
+    // Same as above, but the list, its ads and their strings are allocated on
+    // arena and released together with it. Passing the session's score cache
+    // lets later versions reuse the terms computed for earlier ones.
+    AdsList* generateAds(const Context& context, int version, google::protobuf::Arena* arena,
+                         SessionScoreCache* session_cache = nullptr,
+                         ScorerTier tier = ScorerTier::STANDARD);
+
+    // Upper bound on Context.items; larger batches are rejected
+    static constexpr int kMaxBatchItems = 256;
 
 private:
-    double calculateScore(const std::string& query, const std::string& asin_id, 
-                         const std::string& understanding, int version);
-    std::string generateAdId(const std::string& asin_id, int index);
-};
\ No newline at end of file
+    void fillAds(const Context& context, int version, AdsList* ads_list,
+                 SessionScoreCache* session_cache, ScorerTier tier);
+    // Batch mode of fillAds; session_cache keeps one cache per item in items
+    void fillBatch(const Context& context, int version, AdsList* ads_list,
+                   SessionScoreCache* session_cache, ScorerTier tier);
+    // Append the ads kept out of count scored candidates to ads, honouring top_k
+    void appendAds(const AdCandidate* candidates, const double* scores, size_t count,
+                   google::protobuf::RepeatedPtrField<ads::Ad>* ads) const;
+
+    AdEngine engine_;
+    size_t top_k_;
+};
@@ -0,0 +1,141 @@
+#include "admission_controller.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+AdmissionController::Ticket& AdmissionController::Ticket::operator=(Ticket&& other) noexcept {
+    if (this != &other) {
+        if (controller_ != nullptr) {
+            controller_->release();
+        }
+        controller_ = other.controller_;
+        other.controller_ = nullptr;
+    }
+    return *this;
+}
+
+AdmissionController::Ticket::~Ticket() {
+    if (controller_ != nullptr) {
+        controller_->release();
+    }
+}
+
+AdmissionController::AdmissionController(Options options)
+    : options_(options),
+      limit_(options.initial_limit),
+      estimated_limit_(static_cast<double>(options.initial_limit)),
+      admitted_(metrics::Registry::instance().counter(
+          "ads_server_admission_total", "result=\"admitted\"",
+          "GetAds streams by admission decision")),
+      rejected_(metrics::Registry::instance().counter(
+          "ads_server_admission_total", "result=\"rejected\"",
+          "GetAds streams by admission decision")),
+      limit_gauge_(metrics::Registry::instance().counter(
+          "ads_server_admission_limit", "",
+          "Current limit on concurrent GetAds streams", metrics::Counter::Kind::GAUGE)),
+      shed_{&metrics::Registry::instance().counter(
+                "ads_server_shed_adslists_total", "version=\"2\"",
+                "Refinements not generated because the server was under pressure"),
+            &metrics::Registry::instance().counter(
+                "ads_server_shed_adslists_total", "version=\"3\"",
+                "Refinements not generated because the server was under pressure")} {
+    if (options_.min_limit == 0 || options_.min_limit > options_.max_limit ||
+        options_.initial_limit < options_.min_limit || options_.initial_limit > options_.max_limit) {
+        throw std::invalid_argument("admission limits must satisfy 0 < min <= initial <= max");
+    }
+    if (options_.skip_version3_at > options_.skip_version2_at) {
+        throw std::invalid_argument("version 3 must be shed no later than version 2");
+    }
+    limit_gauge_.add(static_cast<int64_t>(options_.initial_limit));
+}
+
+AdmissionController::Ticket AdmissionController::tryAdmit() {
+    size_t current = in_flight_.load(std::memory_order_relaxed);
+    do {
+        if (current >= limit_.load(std::memory_order_relaxed)) {
+            rejected_.add();
+            return Ticket();
+        }
+    } while (!in_flight_.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+    admitted_.add();
+    return Ticket(this);
+}
+
+void AdmissionController::release() {
+    in_flight_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool AdmissionController::shed(int version) {
+    double threshold = version >= 3 ? options_.skip_version3_at : options_.skip_version2_at;
+    double load = static_cast<double>(in_flight_.load(std::memory_order_relaxed)) /
+                  static_cast<double>(limit_.load(std::memory_order_relaxed));
+    if (load < threshold) {
+        return false;
+    }
+    shed_[version >= 3 ? 1 : 0]->add();
+    return true;
+}
+
+void AdmissionController::recordLatency(uint64_t latency_ns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    double sample = static_cast<double>(std::max<uint64_t>(latency_ns, 1));
+    double next = options_.algorithm == Algorithm::AIMD ? aimdLimit(sample) : gradientLimit(sample);
+    estimated_limit_ = std::max(static_cast<double>(options_.min_limit),
+                                std::min(static_cast<double>(options_.max_limit), next));
+    size_t limit = static_cast<size_t>(estimated_limit_);
+    size_t previous = limit_.exchange(limit, std::memory_order_relaxed);
+    limit_gauge_.add(static_cast<int64_t>(limit) - static_cast<int64_t>(previous));
+}
+
+double AdmissionController::aimdLimit(double latency_ns) {
+    double target_ns = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(options_.latency_target).count());
+    if (latency_ns > target_ns) {
+        return estimated_limit_ * options_.backoff;
+    }
+    // Only grow while the limit is actually being used
+    if (static_cast<double>(in_flight_.load(std::memory_order_relaxed)) * 2 >= estimated_limit_) {
+        return estimated_limit_ + 1;
+    }
+    return estimated_limit_;
+}
+
+double AdmissionController::gradientLimit(double latency_ns) {
+    if (long_latency_ns_ == 0) {
+        long_latency_ns_ = latency_ns;
+    } else {
+        double alpha = 2.0 / (static_cast<double>(options_.long_window) + 1.0);
+        long_latency_ns_ += alpha * (latency_ns - long_latency_ns_);
+    }
+    // After a burst the long-term average would otherwise stay inflated and
+    // hide the next overload
+    if (long_latency_ns_ > 2 * latency_ns) {
+        long_latency_ns_ = (long_latency_ns_ + latency_ns) / 2;
+    }
+
+    double gradient = std::max(0.5, std::min(1.0, options_.tolerance * long_latency_ns_ / latency_ns));
+    double headroom = std::sqrt(estimated_limit_);
+    double next = estimated_limit_ * gradient + headroom;
+    if (next > estimated_limit_ &&
+        static_cast<double>(in_flight_.load(std::memory_order_relaxed)) * 2 < estimated_limit_) {
+        // Demand, not the server, bounds concurrency; latency says nothing
+        // about a higher limit
+        return estimated_limit_;
+    }
+    return estimated_limit_ * (1 - options_.smoothing) + next * options_.smoothing;
+}
+
+const char* AdmissionController::algorithmName() const {
+    return options_.algorithm == Algorithm::AIMD ? "aimd" : "gradient";
+}
+
+AdmissionController::Algorithm AdmissionController::parseAlgorithm(const std::string& name) {
+    if (name == "aimd") {
+        return Algorithm::AIMD;
+    }
+    if (name == "gradient") {
+        return Algorithm::GRADIENT;
+    }
+    throw std::invalid_argument("unknown admission algorithm '" + name +
+                                "' (expected aimd or gradient)");
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "../common/metrics.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * Concurrency limit in front of GetAds.
+ *
+ * A session has to be admitted before any work is done for it; once the
+ * sessions in flight reach the limit, new ones are rejected right away
+ * (the handlers answer RESOURCE_EXHAUSTED) instead of queueing behind work
+ * whose results would arrive after the client's deadline.
+ *
+ * The limit follows the time to first AdsList of admitted sessions:
+ *
+ *   AIMD      a sample slower than latency_target multiplies the limit by
+ *             backoff; otherwise, while at least half the limit is in use,
+ *             it grows by one
+ *   gradient  the limit is scaled by tolerance * long-term latency /
+ *             short-term latency (clamped to [0.5, 1]) plus a sqrt(limit)
+ *             headroom, smoothed; the long-term average is an EWMA over
+ *             long_window samples, so sustained queueing shrinks the limit
+ *             without a fixed target
+ *
+ * Before rejecting anyone, sessions shed refinements: at skip_version3_at
+ * of the limit in flight no version 3 is generated, at skip_version2_at
+ * neither version 2 nor 3, so clients still get version 1.
+ */
+class AdmissionController {
+public:
+    enum class Algorithm {
+        AIMD,
+        GRADIENT
+    };
+
+    struct Options {
+        Algorithm algorithm = Algorithm::GRADIENT;
+        size_t initial_limit = 64;
+        size_t min_limit = 8;
+        size_t max_limit = 1024;
+        // AIMD
+        std::chrono::milliseconds latency_target{10};
+        double backoff = 0.9;
+        // Gradient
+        double tolerance = 1.5;
+        double smoothing = 0.2;
+        size_t long_window = 600;
+        // Fractions of the limit in flight at which refinements are shed
+        double skip_version3_at = 0.8;
+        double skip_version2_at = 0.95;
+    };
+
+    /**
+     * Admission of one session; holds its slot until destroyed. A
+     * default-constructed or rejected ticket holds nothing.
+     */
+    class Ticket {
+    public:
+        Ticket() = default;
+        Ticket(Ticket&& other) noexcept : controller_(other.controller_) { other.controller_ = nullptr; }
+        Ticket& operator=(Ticket&& other) noexcept;
+        ~Ticket();
+
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+
+        explicit operator bool() const { return controller_ != nullptr; }
+
+    private:
+        friend class AdmissionController;
+        explicit Ticket(AdmissionController* controller) : controller_(controller) {}
+
+        AdmissionController* controller_ = nullptr;
+    };
+
+    explicit AdmissionController(Options options);
+
+    AdmissionController(const AdmissionController&) = delete;
+    AdmissionController& operator=(const AdmissionController&) = delete;
+
+    // A ticket that converts to false when the limit is reached
+    Ticket tryAdmit();
+
+    // The control signal: time to first AdsList of an admitted session
+    void recordLatency(uint64_t latency_ns);
+
+    // Whether an admitted session should skip generating version (2 or 3)
+    // at the current load; counts the shed AdsList when it should
+    bool shed(int version);
+
+    size_t limit() const { return limit_.load(std::memory_order_relaxed); }
+    size_t inFlight() const { return in_flight_.load(std::memory_order_relaxed); }
+    const char* algorithmName() const;
+
+    // "aimd" or "gradient"; throws std::invalid_argument for anything else
+    static Algorithm parseAlgorithm(const std::string& name);
+
+private:
+    void release();
+    // Requires mutex_; returns the new limit before clamping
+    double aimdLimit(double latency_ns);
+    double gradientLimit(double latency_ns);
+
+    const Options options_;
+    std::atomic<size_t> in_flight_{0};
+    std::atomic<size_t> limit_;
+
+    std::mutex mutex_;
+    // Guarded by mutex_
+    double estimated_limit_;
+    double long_latency_ns_ = 0;
+
+    metrics::Counter& admitted_;
+    metrics::Counter& rejected_;
+    metrics::Counter& limit_gauge_;
+    metrics::Counter* shed_[2];
+};
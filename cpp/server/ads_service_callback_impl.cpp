@@ -0,0 +1,490 @@
+#include "ads_service_callback_impl.h"
+#include "../common/ads_delta.h"
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+static logging::Logger logger("SERVER");
+static std::atomic<long> session_counter(0);
+
+static void logAdDetails(long session_id, int version, const AdsList& ads_list) {
+    if (!logger.is_debug_enabled()) {
+        return;
+    }
+    for (int i = 0; i < ads_list.ads_size(); i++) {
+        const auto& ad = ads_list.ads(i);
+        logger.debug_if_enabled("Generated ad details", [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id)
+                  .add("version", version)
+                  .add("ad_index", i)
+                  .add("asin_id", ad.asin_id())
+                  .add("ad_id", ad.ad_id())
+                  .add("score", ad.score());
+        });
+    }
+}
+
+static google::protobuf::ArenaOptions sessionArenaOptions(char* block, size_t size) {
+    google::protobuf::ArenaOptions options;
+    options.initial_block = block;
+    options.initial_block_size = size;
+    return options;
+}
+
+namespace {
+
+// Ends a stream that was not admitted without reading from it
+template <class Request, class Response>
+class RejectedReactor final : public ServerBidiReactor<Request, Response> {
+public:
+    RejectedReactor() {
+        this->Finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Server overloaded"));
+    }
+
+    void OnDone() override { delete this; }
+};
+
+// Admits the session, or returns false when admission is enabled and full
+bool admit(AdmissionController* admission, AdmissionController::Ticket* ticket) {
+    if (admission == nullptr) {
+        return true;
+    }
+    *ticket = admission->tryAdmit();
+    return static_cast<bool>(*ticket);
+}
+
+} // namespace
+
+ServerBidiReactor<Context, AdsList>* AdsServiceCallbackImpl::GetAds(CallbackServerContext* context) {
+    AdmissionController::Ticket ticket;
+    if (!admit(admission_, &ticket)) {
+        return new RejectedReactor<Context, AdsList>();
+    }
+    long session_id = session_counter.fetch_add(1) + 1;
+    return new GetAdsReactor(ad_generator_, scheduler_, refinement_policy_, coalescer_, admission_,
+                             std::move(ticket), session_id, SessionDeadline(context->deadline()),
+                             SessionTrace(*context));
+}
+
+ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>* AdsServiceRawImpl::GetAds(CallbackServerContext* context) {
+    AdmissionController::Ticket ticket;
+    if (!admit(admission_, &ticket)) {
+        return new RejectedReactor<grpc::ByteBuffer, grpc::ByteBuffer>();
+    }
+    long session_id = session_counter.fetch_add(1) + 1;
+    return new RawGetAdsReactor(ad_generator_, scheduler_, refinement_policy_, coalescer_, admission_,
+                                std::move(ticket), session_id, SessionDeadline(context->deadline()),
+                                SessionTrace(*context));
+}
+
+bool RawWire::parse(Request& request, Context* context) {
+    return grpc::SerializationTraits<Context>::Deserialize(&request, context).ok();
+}
+
+grpc::ByteBuffer RawWire::outgoing(const AdsList& ads_list, const CoalescedAdsListPtr& shared) {
+    if (shared) {
+        // Takes a reference on the shared bytes; nothing is copied
+        return grpc::ByteBuffer(&shared->serialized, 1);
+    }
+    grpc::ByteBuffer buffer;
+    bool own_buffer = false;
+    grpc::SerializationTraits<AdsList>::Serialize(ads_list, &buffer, &own_buffer);
+    return buffer;
+}
+
+template <class Wire>
+BasicGetAdsReactor<Wire>::BasicGetAdsReactor(AdGenerator& ad_generator, TimerScheduler& scheduler,
+                                             const RefinementPolicy& refinement_policy,
+                                             GenerationCoalescer* coalescer,
+                                             AdmissionController* admission,
+                                             AdmissionController::Ticket admission_ticket,
+                                             long session_id, const SessionDeadline& deadline,
+                                             const tracing::SpanContext& trace)
+    : ad_generator_(ad_generator),
+      scheduler_(scheduler),
+      refinement_policy_(refinement_policy),
+      coalescer_(coalescer),
+      admission_(admission),
+      admission_ticket_(std::move(admission_ticket)),
+      session_id_(session_id),
+      session_timer_("session_" + std::to_string(session_id)),
+      stages_(ServerStageMetrics::get()),
+      counters_(ServerCounters::get()),
+      session_start_ns_(metrics::now_ns()),
+      deadline_(deadline),
+      session_span_("ads.AdsService/GetAds", trace, tracing::SpanKind::SERVER, session_start_ns_),
+      arena_(sessionArenaOptions(arena_block_, sizeof(arena_block_))) {
+    logger.info_if_enabled("New bidirectional stream opened", [&](logging::LogFields& fields) {
+        fields.add("session_id", session_id_)
+              .add("thread", std::this_thread::get_id())
+              .add("api", "callback");
+        if (trace.valid()) {
+            fields.add("trace_id", trace.traceId());
+        }
+    });
+    session_span_.set("session_id", session_id_).set("api", "callback");
+
+    counters_.active_streams.add(1);
+    counters_.sessions_started.add();
+
+    read_start_ns_ = metrics::now_ns();
+    this->StartRead(&request_);
+}
+
+template <class Wire>
+void BasicGetAdsReactor<Wire>::OnReadDone(bool ok) {
+    Status status;
+    bool finish = false;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        if (!ok) {
+            // Client half-closed (or the call was cancelled) before a second Context
+            reads_done_ = true;
+            logger.info_if_enabled("Client half-closed stream", [&](logging::LogFields& fields) {
+                fields.add("session_id", session_id_)
+                      .add("contexts_received", context_count_)
+                      .add("session_elapsed_ms", session_timer_.elapsed_ms());
+            });
+        } else {
+            stages_.context_read.record_since(read_start_ns_);
+            context_count_++;
+            tracing::Span("read Context", session_span_.context(), tracing::SpanKind::INTERNAL, read_start_ns_)
+                .set("context_number", context_count_)
+                .end();
+            if (!Wire::parse(request_, &last_context_)) {
+                logger.error_if_enabled("Malformed Context message", [&](logging::LogFields& fields) {
+                    fields.add("session_id", session_id_)
+                          .add("context_number", context_count_);
+                });
+                status_ = Status(grpc::StatusCode::INVALID_ARGUMENT, "Malformed Context message");
+            } else if (last_context_.items_size() > AdGenerator::kMaxBatchItems) {
+                logger.error_if_enabled("Batch too large", [&](logging::LogFields& fields) {
+                    fields.add("session_id", session_id_)
+                          .add("batch_items", last_context_.items_size())
+                          .add("max_batch_items", AdGenerator::kMaxBatchItems);
+                });
+                status_ = Status(grpc::StatusCode::INVALID_ARGUMENT, "Too many batch items");
+            } else {
+                handleContext();
+            }
+
+            if (context_count_ < 2 && status_.ok()) {
+                read_start_ns_ = metrics::now_ns();
+                this->StartRead(&request_);
+            } else {
+                // Client should half-close after second context
+                reads_done_ = true;
+            }
+        }
+        finish = readyToFinish(&status);
+    }
+    if (finish) {
+        this->Finish(status);
+    }
+}
+
+template <class Wire>
+void BasicGetAdsReactor<Wire>::handleContext() {
+    metrics::Stopwatch context_processing_timer;
+
+    logger.info_if_enabled("Received Context message", [&](logging::LogFields& fields) {
+        fields.add("session_id", session_id_)
+              .add("context_number", context_count_)
+              .add("query", last_context_.query())
+              .add("asin_id", last_context_.asin_id())
+              .add("batch_items", last_context_.items_size())
+              .add("understanding_length", static_cast<int>(last_context_.understanding().length()))
+              .add("understanding_empty", last_context_.understanding().empty())
+              .add("session_elapsed_ms", session_timer_.elapsed_ms());
+    });
+
+    int version = context_count_ == 1 ? 1 : 2;
+    if (version == 1) {
+        accept_delta_ = last_context_.accept_delta();
+    } else if (admission_ != nullptr && admission_->shed(2)) {
+        // Version 1 has to do; counted as a skipped version 3 too
+        counters_.recordPlan(RefinementPlan{false});
+        logger.info_if_enabled("Skipping versions 2 and 3, server under pressure", [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id_)
+                  .add("in_flight", admission_->inFlight())
+                  .add("limit", admission_->limit());
+        });
+        return;
+    }
+    try {
+        metrics::ScopedTimer ad_gen_timer(stages_.generationFor(version));
+        tracing::Span generate_span("generate AdsList", session_span_.context());
+        // A reactor callback must not block on another session's generation
+        const AdsList& ads_list = generateSessionAds(ad_generator_, coalescer_, last_context_, version,
+                                                     &arena_, &score_cache_, ScorerTier::STANDARD,
+                                                     shared_lists_[version - 1], InFlightPolicy::GENERATE);
+        ad_gen_timer.stop();
+        generate_span.set("version", version).set("ads_count", ads_list.ads_size()).end();
+
+        logger.info_if_enabled("Sending AdsList", [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id_)
+                  .add("version", version)
+                  .add("ads_count", ads_list.ads_size())
+                  .add("generation_ms", ad_gen_timer.elapsed_ms())
+                  .add("context_processing_ms", context_processing_timer.elapsed_ms());
+        });
+
+        logAdDetails(session_id_, version, ads_list);
+        enqueueWrite(ads_list, shared_lists_[version - 1]);
+    } catch (const std::exception& e) {
+        logger.error_if_enabled("Error processing Context message", [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id_)
+                  .add("context_number", context_count_)
+                  .add("error_type", "std::exception")
+                  .add("error_message", e.what())
+                  .add("processing_ms", context_processing_timer.elapsed_ms());
+        });
+        status_ = Status(grpc::StatusCode::INTERNAL, "Error processing context");
+        reads_done_ = true;
+        return;
+    }
+
+    if (version == 2) {
+        // When and how to refine is up to the policy; a version 3 written
+        // after the client's deadline is never read
+        refinement_plan_ = refinement_policy_.plan(deadline_);
+        const bool shed_version3 =
+            refinement_plan_.send_version3 && admission_ != nullptr && admission_->shed(3);
+        if (shed_version3) {
+            refinement_plan_.send_version3 = false;
+        }
+        counters_.recordPlan(refinement_plan_);
+        if (!refinement_plan_.send_version3) {
+            logger.info_if_enabled(shed_version3 ? "Skipping version 3, server under pressure"
+                                                 : "Skipping version 3, client deadline too close",
+                                   [&](logging::LogFields& fields) {
+                fields.add("session_id", session_id_)
+                      .add("deadline_remaining_ms", deadline_.remainingMs())
+                      .add("policy", refinement_policy_.name());
+            });
+            return;
+        }
+        stages_.refinement_delay.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(refinement_plan_.delay).count());
+
+        // Schedule version 3 after the planned delay (50ms by default)
+        logger.info_if_enabled("Scheduling delayed version 3 AdsList", [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id_)
+                  .add("delay_ms", refinement_plan_.delay.count())
+                  .add("deadline_remaining_ms", deadline_.remainingMs())
+                  .add("extended_scorer", refinement_plan_.tier == ScorerTier::EXTENDED);
+        });
+
+        timer_pending_ = true;
+        version3_timer_ = scheduler_.schedule(refinement_plan_.delay,
+                                              [this]() { onVersion3Timer(); });
+    }
+}
+
+template <class Wire>
+void BasicGetAdsReactor<Wire>::onVersion3Timer() {
+    // Runs on a TimerScheduler worker that every session shares: don't hold
+    // it for the generation, which goes to a gRPC thread instead. The
+    // reactor outlives the alarm since timer_pending_ stays set until
+    // generateVersion3() has run.
+    version3_alarm_.Set(gpr_now(GPR_CLOCK_MONOTONIC), [this](bool /*ok*/) { generateVersion3(); });
+}
+
+template <class Wire>
+void BasicGetAdsReactor<Wire>::generateVersion3() {
+    Status status;
+    bool finish = false;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        timer_pending_ = false;
+
+        if (cancelled_) {
+            counters_.version3_misses.add();
+        } else {
+            try {
+                metrics::ScopedTimer final_ad_gen_timer(stages_.generationFor(3));
+                tracing::Span generate_span("generate AdsList", session_span_.context());
+                const AdsList& ads_v3 = generateSessionAds(ad_generator_, coalescer_, last_context_, 3,
+                                                           &arena_, &score_cache_, refinement_plan_.tier,
+                                                           shared_lists_[2], InFlightPolicy::GENERATE);
+                final_ad_gen_timer.stop();
+                generate_span.set("version", 3)
+                             .set("ads_count", ads_v3.ads_size())
+                             .setFlag("extended_scorer", refinement_plan_.tier == ScorerTier::EXTENDED)
+                             .end();
+
+                logger.info_if_enabled("Sending delayed AdsList", [&](logging::LogFields& fields) {
+                    fields.add("session_id", session_id_)
+                          .add("version", 3)
+                          .add("ads_count", ads_v3.ads_size())
+                          .add("generation_ms", final_ad_gen_timer.elapsed_ms())
+                          .add("session_elapsed_ms", session_timer_.elapsed_ms());
+                });
+
+                logAdDetails(session_id_, 3, ads_v3);
+                enqueueWrite(ads_v3, shared_lists_[2]);
+            } catch (const std::exception& e) {
+                logger.error_if_enabled("Error sending version 3", [&](logging::LogFields& fields) {
+                    fields.add("session_id", session_id_)
+                          .add("error_type", "std::exception")
+                          .add("error_message", e.what())
+                          .add("session_elapsed_ms", session_timer_.elapsed_ms());
+                });
+            }
+        }
+
+        finish = readyToFinish(&status);
+    }
+    if (finish) {
+        this->Finish(status);
+    }
+}
+
+template <class Wire>
+void BasicGetAdsReactor<Wire>::OnWriteDone(bool ok) {
+    Status status;
+    bool finish = false;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        write_in_flight_ = false;
+        counters_.recordWrite(pending_writes_.front().version, ok);
+        tracing::Span write_span("write AdsList", session_span_.context(), tracing::SpanKind::INTERNAL,
+                                 write_start_ns_);
+        write_span.set("version", pending_writes_.front().version);
+        if (!ok) {
+            write_span.setError("write failed");
+        }
+        write_span.end();
+        pending_writes_.pop_front();
+        if (ok) {
+            stages_.write.record_since(write_start_ns_);
+            if (!first_write_done_) {
+                first_write_done_ = true;
+                uint64_t first_adslist_ns = metrics::now_ns() - session_start_ns_;
+                stages_.time_to_first_adslist.record(first_adslist_ns);
+                if (admission_ != nullptr) {
+                    admission_->recordLatency(first_adslist_ns);
+                }
+            }
+        }
+
+        if (!ok) {
+            // The stream is broken; drop whatever is still queued
+            logger.error_if_enabled("Failed to write AdsList", [&](logging::LogFields& fields) {
+                fields.add("session_id", session_id_)
+                      .add("pending_writes", static_cast<int>(pending_writes_.size()))
+                      .add("session_elapsed_ms", session_timer_.elapsed_ms());
+            });
+            pending_writes_.clear();
+        } else if (!pending_writes_.empty()) {
+            write_in_flight_ = true;
+            write_start_ns_ = metrics::now_ns();
+            this->StartWrite(Wire::message(pending_writes_.front().message));
+        }
+        finish = readyToFinish(&status);
+    }
+    if (finish) {
+        this->Finish(status);
+    }
+}
+
+template <class Wire>
+void BasicGetAdsReactor<Wire>::OnCancel() {
+    Status status;
+    bool finish = false;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        cancelled_ = true;
+
+        logger.info_if_enabled("Stream cancelled by client", [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id_)
+                  .add("contexts_received", context_count_)
+                  .add("session_elapsed_ms", session_timer_.elapsed_ms());
+        });
+
+        // Once the timer has fired, generateVersion3() is on its way and will
+        // see cancelled_; only a timer that never started can be dropped here.
+        if (timer_pending_ && scheduler_.tryCancel(version3_timer_)) {
+            timer_pending_ = false;
+            counters_.version3_misses.add();
+        }
+        finish = readyToFinish(&status);
+    }
+    if (finish) {
+        this->Finish(status);
+    }
+}
+
+template <class Wire>
+void BasicGetAdsReactor<Wire>::OnDone() {
+    stages_.session_duration.record_since(session_start_ns_);
+    counters_.active_streams.add(-1);
+    if (cancelled_) {
+        counters_.sessions_cancelled.add();
+    } else if (status_.ok()) {
+        counters_.sessions_completed.add();
+    } else {
+        counters_.sessions_failed.add();
+        session_span_.setError(status_.error_message());
+    }
+    session_span_.set("contexts_received", context_count_).setFlag("cancelled", cancelled_);
+    if (!cancelled_ && !status_.ok()) {
+        logger.error_if_enabled("Stream failed", [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id_)
+                  .add("error_code", static_cast<int>(status_.error_code()))
+                  .add("error_message", status_.error_message())
+                  .add("total_contexts", context_count_)
+                  .add("total_duration_ms", session_timer_.elapsed_ms());
+        });
+    } else {
+        logger.info_if_enabled(cancelled_ ? "Stream closed after cancellation" : "Stream completed successfully",
+                               [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id_)
+                  .add("total_contexts", context_count_)
+                  .add("total_duration_ms", session_timer_.elapsed_ms());
+        });
+    }
+
+    delete this;
+}
+
+template <class Wire>
+void BasicGetAdsReactor<Wire>::enqueueWrite(const AdsList& ads_list, const CoalescedAdsListPtr& shared) {
+    if (cancelled_ || finished_) {
+        return;
+    }
+    // A refinement goes out as a delta against the previous version when the
+    // client accepts it and it is smaller; deltas are never shared
+    const AdsList& wire_list = ads_delta::wireForm(previous_list_, ads_list, &arena_);
+    if (accept_delta_) {
+        previous_list_ = &ads_list;
+    }
+    bool is_delta = &wire_list != &ads_list;
+    if (is_delta) {
+        counters_.delta_writes.add();
+    }
+    pending_writes_.push_back(PendingWrite{static_cast<int>(ads_list.version()),
+                                           Wire::outgoing(wire_list, is_delta ? CoalescedAdsListPtr() : shared)});
+    if (!write_in_flight_) {
+        write_in_flight_ = true;
+        write_start_ns_ = metrics::now_ns();
+        this->StartWrite(Wire::message(pending_writes_.front().message));
+    }
+}
+
+template <class Wire>
+bool BasicGetAdsReactor<Wire>::readyToFinish(Status* status) {
+    if (finished_ || timer_pending_ || write_in_flight_) {
+        return false;
+    }
+    if (!reads_done_ && !cancelled_) {
+        return false;
+    }
+    finished_ = true;
+    *status = cancelled_ ? Status::CANCELLED : status_;
+    return true;
+}
+
+template class BasicGetAdsReactor<TypedWire>;
+template class BasicGetAdsReactor<RawWire>;
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/support/byte_buffer.h>
+#include "ads.grpc.pb.h"
+#include "ad_generator.h"
+#include "timer_scheduler.h"
+#include "refinement_policy.h"
+#include "generation_coalescer.h"
+#include "admission_controller.h"
+#include "server_metrics.h"
+#include "session_deadline.h"
+#include "session_trace.h"
+#include "../common/logging.h"
+
+using grpc::CallbackServerContext;
+using grpc::ServerBidiReactor;
+using grpc::Status;
+using ads::Context;
+using ads::AdsList;
+using ads::AdsService;
+
+/**
+ * How a GetAds reactor exchanges messages with its stream.
+ *
+ * TypedWire reads Contexts and writes AdsLists, which gRPC serializes on
+ * every write. RawWire reads and writes grpc::ByteBuffers: a coalesced
+ * AdsList goes out as a reference to its pre-serialized slice, so one
+ * payload is sent to any number of streams without copying or re-encoding.
+ * Lists generated for a single session are serialized once into a buffer.
+ */
+struct TypedWire {
+    using Request = Context;
+    using Response = AdsList;
+    // Stays valid until the reactor is deleted (session arena or shared list)
+    using Outgoing = const AdsList*;
+
+    static bool parse(Request& request, Context* context) {
+        *context = request;
+        return true;
+    }
+    static Outgoing outgoing(const AdsList& ads_list, const CoalescedAdsListPtr& /*shared*/) {
+        return &ads_list;
+    }
+    static const Response* message(const Outgoing& outgoing) { return outgoing; }
+};
+
+struct RawWire {
+    using Request = grpc::ByteBuffer;
+    using Response = grpc::ByteBuffer;
+    using Outgoing = grpc::ByteBuffer;
+
+    static bool parse(Request& request, Context* context);
+    static Outgoing outgoing(const AdsList& ads_list, const CoalescedAdsListPtr& shared);
+    static const Response* message(const Outgoing& outgoing) { return &outgoing; }
+};
+
+/**
+ * Callback-API implementation of AdsService.
+ *
+ * Each GetAds stream is driven by a GetAdsReactor object instead of a blocked
+ * sync-server thread, so a small number of gRPC event-engine threads can serve
+ * all in-flight sessions. The message protocol is identical to AdsServiceImpl.
+ */
+class AdsServiceCallbackImpl final : public AdsService::CallbackService {
+public:
+    AdsServiceCallbackImpl(AdGenerator& ad_generator, TimerScheduler& scheduler,
+                           const RefinementPolicy& refinement_policy,
+                           GenerationCoalescer* coalescer = nullptr,
+                           AdmissionController* admission = nullptr)
+        : ad_generator_(ad_generator), scheduler_(scheduler),
+          refinement_policy_(refinement_policy), coalescer_(coalescer), admission_(admission) {}
+
+    ServerBidiReactor<Context, AdsList>* GetAds(CallbackServerContext* context) override;
+
+private:
+    AdGenerator& ad_generator_;
+    TimerScheduler& scheduler_;
+    const RefinementPolicy& refinement_policy_;
+    // Shares generation between identical sessions when set
+    GenerationCoalescer* coalescer_;
+    // Rejects streams over its limit and sheds refinements when set
+    AdmissionController* admission_;
+};
+
+/**
+ * Byte-level variant of AdsServiceCallbackImpl registered through the
+ * generated raw callback method: GetAds streams carry grpc::ByteBuffers and
+ * are driven by RawGetAdsReactor. Clients see the same protocol; combined
+ * with a GenerationCoalescer, cached AdsLists are written without
+ * re-serialization.
+ */
+class AdsServiceRawImpl final : public AdsService::WithRawCallbackMethod_GetAds<AdsService::Service> {
+public:
+    AdsServiceRawImpl(AdGenerator& ad_generator, TimerScheduler& scheduler,
+                      const RefinementPolicy& refinement_policy,
+                      GenerationCoalescer* coalescer = nullptr,
+                      AdmissionController* admission = nullptr)
+        : ad_generator_(ad_generator), scheduler_(scheduler),
+          refinement_policy_(refinement_policy), coalescer_(coalescer), admission_(admission) {}
+
+    ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>* GetAds(CallbackServerContext* context) override;
+
+private:
+    AdGenerator& ad_generator_;
+    TimerScheduler& scheduler_;
+    const RefinementPolicy& refinement_policy_;
+    GenerationCoalescer* coalescer_;
+    AdmissionController* admission_;
+};
+
+/**
+ * Per-session state machine for one GetAds stream.
+ *
+ * Reads up to two Context messages, writes AdsList versions 1 and 2 as they
+ * arrive and version 3 once the delay the RefinementPolicy plans after the
+ * second Context has passed (50ms by default), queueing writes so only one
+ * is outstanding. The delay runs on the shared TimerScheduler, whose task
+ * only sets an immediate grpc::Alarm; version 3 is generated in the alarm
+ * callback on a gRPC thread. The reactor finishes once reads are done,
+ * version 3 has been written or cancelled and the write queue is drained,
+ * and deletes itself in OnDone.
+ * Finish is always called after mu_ is released, since OnDone may run
+ * immediately on another thread.
+ *
+ * Wire selects the message representation (TypedWire or RawWire); both
+ * instantiations are compiled in ads_service_callback_impl.cpp.
+ */
+template <class Wire>
+class BasicGetAdsReactor final
+    : public ServerBidiReactor<typename Wire::Request, typename Wire::Response> {
+public:
+    BasicGetAdsReactor(AdGenerator& ad_generator, TimerScheduler& scheduler,
+                       const RefinementPolicy& refinement_policy,
+                       GenerationCoalescer* coalescer, AdmissionController* admission,
+                       AdmissionController::Ticket admission_ticket, long session_id,
+                       const SessionDeadline& deadline, const tracing::SpanContext& trace);
+
+    void OnReadDone(bool ok) override;
+    void OnWriteDone(bool ok) override;
+    void OnCancel() override;
+    void OnDone() override;
+
+private:
+    struct PendingWrite {
+        int version;
+        typename Wire::Outgoing message;
+    };
+
+    void handleContext();
+    void onVersion3Timer();
+    void generateVersion3();
+
+    // The following require mu_ to be held
+    void enqueueWrite(const AdsList& ads_list, const CoalescedAdsListPtr& shared);
+    bool readyToFinish(Status* status);
+
+    AdGenerator& ad_generator_;
+    TimerScheduler& scheduler_;
+    const RefinementPolicy& refinement_policy_;
+    GenerationCoalescer* coalescer_;
+    AdmissionController* admission_;
+    // Holds the session's admission slot until the reactor is deleted
+    AdmissionController::Ticket admission_ticket_;
+    const long session_id_;
+    logging::Timer session_timer_;
+    ServerStageMetrics& stages_;
+    ServerCounters& counters_;
+    const uint64_t session_start_ns_;
+    const SessionDeadline deadline_;
+    // Parent of the per-stage spans; ends with the reactor
+    tracing::Span session_span_;
+
+    // Session arena for every AdsList this stream writes; the inline block
+    // lives inside the reactor so a typical session allocates nothing more
+    alignas(8) char arena_block_[8192];
+    google::protobuf::Arena arena_;
+
+    std::mutex mu_;
+    typename Wire::Request request_;
+    Context last_context_;
+    SessionScoreCache score_cache_;
+    int context_count_ = 0;
+    bool reads_done_ = false;
+    bool write_in_flight_ = false;
+    bool timer_pending_ = false;
+    bool cancelled_ = false;
+    bool finished_ = false;
+    Status status_;
+    // AdsLists live on arena_, or in shared_lists_ when coalesced, until the
+    // reactor is deleted
+    std::deque<PendingWrite> pending_writes_;
+    CoalescedAdsListPtr shared_lists_[3];
+    // Set from the first Context; previous_list_ is the delta base for the
+    // next refinement and stays null for clients that want full lists
+    bool accept_delta_ = false;
+    const AdsList* previous_list_ = nullptr;
+    TimerScheduler::TimerId version3_timer_ = 0;
+    // Moves version 3 off the scheduler worker once the timer fires
+    grpc::Alarm version3_alarm_;
+    RefinementPlan refinement_plan_;
+    // now_ns() when the outstanding read/write was started
+    uint64_t read_start_ns_ = 0;
+    uint64_t write_start_ns_ = 0;
+    bool first_write_done_ = false;
+};
+
+using GetAdsReactor = BasicGetAdsReactor<TypedWire>;
+using RawGetAdsReactor = BasicGetAdsReactor<RawWire>;
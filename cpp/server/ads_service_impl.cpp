@@ -1,191 +1,401 @@
 #include "ads_service_impl.h"
+#include "server_metrics.h"
+#include "session_deadline.h"
+#include "session_trace.h"
+#include "../common/ads_delta.h"
 #include "../common/logging.h"
 #include <iostream>
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 static logging::Logger logger("SERVER");
 static std::atomic<long> session_counter(0);
 
+// How often a session waiting for its version 3 write checks for cancellation
+static constexpr std::chrono::milliseconds kCancellationPollInterval(5);
+
+
+// Holds ads_server_active_streams up while a handler runs
+class ActiveStreamScope {
+public:
+    explicit ActiveStreamScope(ServerCounters& counters) : counters_(counters) {
+        counters_.active_streams.add(1);
+        counters_.sessions_started.add();
+    }
+    ~ActiveStreamScope() { counters_.active_streams.add(-1); }
+
+private:
+    ServerCounters& counters_;
+};
+
+// Inline arena block per session, enough for three AdsLists of up to 10 ads
+static constexpr size_t kSessionArenaBlockSize = 8192;
+
 Status AdsServiceImpl::GetAds(ServerContext* context,
                               ServerReaderWriter<AdsList, Context>* stream) {
+    // Rejected before any work so the client can retry elsewhere in time
+    AdmissionController::Ticket admission_ticket;
+    if (admission_ != nullptr) {
+        admission_ticket = admission_->tryAdmit();
+        if (!admission_ticket) {
+            return Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Server overloaded");
+        }
+    }
     long session_id = session_counter.fetch_add(1) + 1;
     logging::Timer session_timer("session_" + std::to_string(session_id));
+    ServerStageMetrics& stages = ServerStageMetrics::get();
+    // Recorded on every return path
+    metrics::ScopedTimer session_duration(stages.session_duration);
+    ServerCounters& counters = ServerCounters::get();
+    ActiveStreamScope active_stream(counters);
+    const uint64_t session_start_ns = metrics::now_ns();
+    const SessionDeadline deadline(context->deadline());
+    const tracing::SpanContext trace = SessionTrace(*context);
+    tracing::Span session_span("ads.AdsService/GetAds", trace, tracing::SpanKind::SERVER, session_start_ns);
+    session_span.set("session_id", session_id).set("api", "sync");
+    
+    logger.info_if_enabled("New bidirectional stream opened", [&](logging::LogFields& fields) {
+        fields.add("session_id", session_id)
+              .add("thread", std::this_thread::get_id());
+        if (trace.valid()) {
+            fields.add("trace_id", trace.traceId());
+        }
+    });
+    
+    // Every AdsList of this session is allocated on one arena that is freed in
+    // one shot when the handler returns; the inline block covers a typical
+    // session without touching malloc.
+    alignas(8) char arena_block[kSessionArenaBlockSize];
+    google::protobuf::ArenaOptions arena_options;
+    arena_options.initial_block = arena_block;
+    arena_options.initial_block_size = sizeof(arena_block);
+    google::protobuf::Arena session_arena(arena_options);
     
-    std::string session_start_message = logging::LogContext()
-        .add("session_id", session_id)
-        .add("thread", std::this_thread::get_id())
-        .build("New bidirectional stream opened");
-    logger.info(session_start_message);
+    // Score terms shared by the three versions of this session
+    SessionScoreCache score_cache;
     
     Context client_context;
     int context_count = 0;
+    // Refinements go out as deltas against the previous version when the
+    // client asked for them (Context.accept_delta) and they are smaller
+    bool accept_delta = false;
+    // Coalesced lists written by this session, kept alive as delta bases
+    CoalescedAdsListPtr shared_lists[3];
+    const AdsList* previous_list = nullptr;
+    TimerScheduler::TimerId version3_timer = 0;
+    
+    // Signalled by the version 3 task once its write has completed
+    std::mutex version3_mu;
+    std::condition_variable version3_cv;
+    bool version3_done = false;
     
     // Read Context messages from client
+    metrics::Stopwatch read_watch;
     while (stream->Read(&client_context)) {
+        const uint64_t read_start_ns = read_watch.start_ns();
+        stages.context_read.record(read_watch.lap_ns());
         context_count++;
-        logging::Timer context_processing_timer("context_processing");
+        tracing::Span("read Context", session_span.context(), tracing::SpanKind::INTERNAL, read_start_ns)
+            .set("context_number", context_count)
+            .end(read_watch.start_ns());
+        metrics::Stopwatch context_processing_timer;
         
-        std::string context_message = logging::LogContext()
-            .add("session_id", session_id)
-            .add("context_number", context_count)
-            .add("query", client_context.query())
-            .add("asin_id", client_context.asin_id())
-            .add("understanding_length", static_cast<int>(client_context.understanding().length()))
-            .add("understanding_empty", client_context.understanding().empty())
-            .add("session_elapsed_ms", session_timer.elapsed_ms())
-            .build("Received Context message");
-        logger.info(context_message);
+        logger.info_if_enabled("Received Context message", [&](logging::LogFields& fields) {
+            fields.add("session_id", session_id)
+                  .add("context_number", context_count)
+                  .add("query", client_context.query())
+                  .add("asin_id", client_context.asin_id())
+                  .add("batch_items", client_context.items_size())
+                  .add("understanding_length", static_cast<int>(client_context.understanding().length()))
+                  .add("understanding_empty", client_context.understanding().empty())
+                  .add("session_elapsed_ms", session_timer.elapsed_ms());
+        });
+        
+        if (client_context.items_size() > AdGenerator::kMaxBatchItems) {
+            logger.error_if_enabled("Batch too large", [&](logging::LogFields& fields) {
+                fields.add("session_id", session_id)
+                      .add("batch_items", client_context.items_size())
+                      .add("max_batch_items", AdGenerator::kMaxBatchItems);
+            });
+            counters.sessions_failed.add();
+            session_span.setError("Too many batch items");
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "Too many batch items");
+        }
         
         try {
             if (context_count == 1) {
+                accept_delta = client_context.accept_delta();
                 // Send AdsList version 1 immediately
-                logging::Timer ad_gen_timer("ad_generation_v1");
-                AdsList ads_v1 = ad_generator_.generateAds(client_context, 1);
+                metrics::ScopedTimer ad_gen_timer(stages.generationFor(1));
+                tracing::Span generate_span("generate AdsList", session_span.context());
+                const AdsList& ads_v1 = generateSessionAds(ad_generator_, coalescer_, client_context, 1,
+                                                          &session_arena, &score_cache,
+                                                          ScorerTier::STANDARD, shared_lists[0]);
+                ad_gen_timer.stop();
+                generate_span.set("version", 1).set("ads_count", ads_v1.ads_size()).end();
                 
-                std::string send_message = logging::LogContext()
-                    .add("session_id", session_id)
-                    .add("version", 1)
-                    .add("ads_count", ads_v1.ads_size())
-                    .add("generation_ms", ad_gen_timer.elapsed_ms())
-                    .add("context_processing_ms", context_processing_timer.elapsed_ms())
-                    .build("Sending AdsList");
-                logger.info(send_message);
+                logger.info_if_enabled("Sending AdsList", [&](logging::LogFields& fields) {
+                    fields.add("session_id", session_id)
+                          .add("version", 1)
+                          .add("ads_count", ads_v1.ads_size())
+                          .add("generation_ms", ad_gen_timer.elapsed_ms())
+                          .add("context_processing_ms", context_processing_timer.elapsed_ms());
+                });
                 
-                stream->Write(ads_v1);
+                {
+                    metrics::ScopedTimer write_timer(stages.write);
+                    tracing::Span write_span("write AdsList", session_span.context());
+                    write_span.set("version", 1);
+                    counters.recordWrite(1, stream->Write(ads_v1));
+                }
+                previous_list = &ads_v1;
+                stages.time_to_first_adslist.record_since(session_start_ns);
+                if (admission_ != nullptr) {
+                    admission_->recordLatency(metrics::now_ns() - session_start_ns);
+                }
                 
                 // Log debug details about the ads if debug level is enabled
                 if (logger.is_debug_enabled()) {
                     for (int i = 0; i < ads_v1.ads_size(); i++) {
                         const auto& ad = ads_v1.ads(i);
-                        std::string ad_message = logging::LogContext()
-                            .add("session_id", session_id)
-                            .add("version", 1)
-                            .add("ad_index", i)
-                            .add("asin_id", ad.asin_id())
-                            .add("ad_id", ad.ad_id())
-                            .add("score", ad.score())
-                            .build("Generated ad details");
-                        logger.debug(ad_message);
+                        logger.debug_if_enabled("Generated ad details", [&](logging::LogFields& fields) {
+                            fields.add("session_id", session_id)
+                                  .add("version", 1)
+                                  .add("ad_index", i)
+                                  .add("asin_id", ad.asin_id())
+                                  .add("ad_id", ad.ad_id())
+                                  .add("score", ad.score());
+                        });
                     }
                 }
                 
             } else if (context_count == 2) {
+                if (admission_ != nullptr && admission_->shed(2)) {
+                    // Version 1 has to do; counted as a skipped version 3 too
+                    counters.recordPlan(RefinementPlan{false});
+                    logger.info_if_enabled("Skipping versions 2 and 3, server under pressure", [&](logging::LogFields& fields) {
+                        fields.add("session_id", session_id)
+                              .add("in_flight", admission_->inFlight())
+                              .add("limit", admission_->limit());
+                    });
+                    break;
+                }
+                
                 // Send AdsList version 2 immediately
-                logging::Timer ad_gen_timer("ad_generation_v2");
-                AdsList ads_v2 = ad_generator_.generateAds(client_context, 2);
+                metrics::ScopedTimer ad_gen_timer(stages.generationFor(2));
+                tracing::Span generate_span("generate AdsList", session_span.context());
+                const AdsList& ads_v2 = generateSessionAds(ad_generator_, coalescer_, client_context, 2,
+                                                          &session_arena, &score_cache,
+                                                          ScorerTier::STANDARD, shared_lists[1]);
+                ad_gen_timer.stop();
+                generate_span.set("version", 2).set("ads_count", ads_v2.ads_size()).end();
+                const AdsList& wire_v2 =
+                    ads_delta::wireForm(accept_delta ? previous_list : nullptr, ads_v2, &session_arena);
                 
-                std::string send_message = logging::LogContext()
-                    .add("session_id", session_id)
-                    .add("version", 2)
-                    .add("ads_count", ads_v2.ads_size())
-                    .add("generation_ms", ad_gen_timer.elapsed_ms())
-                    .add("context_processing_ms", context_processing_timer.elapsed_ms())
-                    .build("Sending AdsList");
-                logger.info(send_message);
+                logger.info_if_enabled("Sending AdsList", [&](logging::LogFields& fields) {
+                    fields.add("session_id", session_id)
+                          .add("version", 2)
+                          .add("ads_count", ads_v2.ads_size())
+                          .add("delta", &wire_v2 != &ads_v2)
+                          .add("generation_ms", ad_gen_timer.elapsed_ms())
+                          .add("context_processing_ms", context_processing_timer.elapsed_ms());
+                });
                 
-                stream->Write(ads_v2);
+                {
+                    metrics::ScopedTimer write_timer(stages.write);
+                    tracing::Span write_span("write AdsList", session_span.context());
+                    write_span.set("version", 2).setFlag("delta", &wire_v2 != &ads_v2);
+                    counters.recordWrite(2, stream->Write(wire_v2));
+                }
+                if (&wire_v2 != &ads_v2) {
+                    counters.delta_writes.add();
+                }
+                previous_list = &ads_v2;
                 
                 // Log debug details about the ads if debug level is enabled
                 if (logger.is_debug_enabled()) {
                     for (int i = 0; i < ads_v2.ads_size(); i++) {
                         const auto& ad = ads_v2.ads(i);
-                        std::string ad_message = logging::LogContext()
-                            .add("session_id", session_id)
-                            .add("version", 2)
-                            .add("ad_index", i)
-                            .add("asin_id", ad.asin_id())
-                            .add("ad_id", ad.ad_id())
-                            .add("score", ad.score())
-                            .build("Generated ad details");
-                        logger.debug(ad_message);
+                        logger.debug_if_enabled("Generated ad details", [&](logging::LogFields& fields) {
+                            fields.add("session_id", session_id)
+                                  .add("version", 2)
+                                  .add("ad_index", i)
+                                  .add("asin_id", ad.asin_id())
+                                  .add("ad_id", ad.ad_id())
+                                  .add("score", ad.score());
+                        });
                     }
                 }
                 
-                // Schedule version 3 after 50ms delay
-                std::string schedule_message = logging::LogContext()
-                    .add("session_id", session_id)
-                    .add("delay_ms", 50)
-                    .build("Scheduling delayed version 3 AdsList");
-                logger.info(schedule_message);
+                // When and how to refine is up to the policy; a version 3
+                // written after the client's deadline is never read
+                RefinementPlan plan = refinement_policy_.plan(deadline);
+                const bool shed_version3 = plan.send_version3 && admission_ != nullptr && admission_->shed(3);
+                if (shed_version3) {
+                    plan.send_version3 = false;
+                }
+                counters.recordPlan(plan);
+                if (!plan.send_version3) {
+                    logger.info_if_enabled(shed_version3 ? "Skipping version 3, server under pressure"
+                                                         : "Skipping version 3, client deadline too close",
+                                           [&](logging::LogFields& fields) {
+                        fields.add("session_id", session_id)
+                              .add("deadline_remaining_ms", deadline.remainingMs())
+                              .add("policy", refinement_policy_.name());
+                    });
+                    break;
+                }
+                stages.refinement_delay.record(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(plan.delay).count());
                 
-                std::thread([this, stream, client_context, session_id, &session_timer, context_count]() {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
-                    
-                    try {
-                        logging::Timer final_ad_gen_timer("ad_generation_v3");
-                        AdsList ads_v3 = ad_generator_.generateAds(client_context, 3);
+                // Schedule version 3 after the planned delay (50ms by default)
+                logger.info_if_enabled("Scheduling delayed version 3 AdsList", [&](logging::LogFields& fields) {
+                    fields.add("session_id", session_id)
+                          .add("delay_ms", plan.delay.count())
+                          .add("deadline_remaining_ms", deadline.remainingMs())
+                          .add("extended_scorer", plan.tier == ScorerTier::EXTENDED);
+                });
+                
+                // The task captures the stream, session timer, arena, score
+                // cache, shared lists and completion state by reference; this
+                // is safe because the handler cancels (and waits for) the
+                // timer before it returns.
+                version3_timer = scheduler_.schedule(plan.delay,
+                    [this, context, stream, client_context, session_id, &session_timer, context_count, plan,
+                     span_parent = session_span.context(),
+                     &session_arena, &score_cache, &shared_lists, accept_delta, previous_list,
+                     &version3_mu, &version3_cv, &version3_done]() {
+                    ServerCounters& counters = ServerCounters::get();
+                    if (context->IsCancelled()) {
+                        counters.version3_misses.add();
+                        logger.info_if_enabled("Client cancelled before version 3", [&](logging::LogFields& fields) {
+                            fields.add("session_id", session_id)
+                                  .add("session_elapsed_ms", session_timer.elapsed_ms());
+                        });
+                    } else {
+                        try {
+                            ServerStageMetrics& stages = ServerStageMetrics::get();
+                            metrics::ScopedTimer final_ad_gen_timer(stages.generationFor(3));
+                            tracing::Span generate_span("generate AdsList", span_parent);
+                            const AdsList& ads_v3 = generateSessionAds(ad_generator_, coalescer_, client_context, 3,
+                                                                       &session_arena, &score_cache,
+                                                                       plan.tier, shared_lists[2]);
+                            final_ad_gen_timer.stop();
+                            generate_span.set("version", 3)
+                                         .set("ads_count", ads_v3.ads_size())
+                                         .setFlag("extended_scorer", plan.tier == ScorerTier::EXTENDED)
+                                         .end();
+                            const AdsList& wire_v3 =
+                                ads_delta::wireForm(accept_delta ? previous_list : nullptr, ads_v3, &session_arena);
                         
-                        std::string final_send_message = logging::LogContext()
-                            .add("session_id", session_id)
-                            .add("version", 3)
-                            .add("ads_count", ads_v3.ads_size())
-                            .add("generation_ms", final_ad_gen_timer.elapsed_ms())
-                            .add("session_elapsed_ms", session_timer.elapsed_ms())
-                            .build("Sending delayed AdsList");
-                        logger.info(final_send_message);
+                            logger.info_if_enabled("Sending delayed AdsList", [&](logging::LogFields& fields) {
+                                fields.add("session_id", session_id)
+                                      .add("version", 3)
+                                      .add("ads_count", ads_v3.ads_size())
+                                      .add("delta", &wire_v3 != &ads_v3)
+                                      .add("generation_ms", final_ad_gen_timer.elapsed_ms())
+                                      .add("session_elapsed_ms", session_timer.elapsed_ms());
+                            });
                         
-                        stream->Write(ads_v3);
+                            {
+                                metrics::ScopedTimer write_timer(stages.write);
+                                tracing::Span write_span("write AdsList", span_parent);
+                                write_span.set("version", 3).setFlag("delta", &wire_v3 != &ads_v3);
+                                counters.recordWrite(3, stream->Write(wire_v3));
+                            }
+                            if (&wire_v3 != &ads_v3) {
+                                counters.delta_writes.add();
+                            }
                         
-                        // Log debug details about the ads if debug level is enabled
-                        if (logger.is_debug_enabled()) {
-                            for (int i = 0; i < ads_v3.ads_size(); i++) {
-                                const auto& ad = ads_v3.ads(i);
-                                std::string ad_message = logging::LogContext()
-                                    .add("session_id", session_id)
-                                    .add("version", 3)
-                                    .add("ad_index", i)
-                                    .add("asin_id", ad.asin_id())
-                                    .add("ad_id", ad.ad_id())
-                                    .add("score", ad.score())
-                                    .build("Generated ad details");
-                                logger.debug(ad_message);
+                            // Log debug details about the ads if debug level is enabled
+                            if (logger.is_debug_enabled()) {
+                                for (int i = 0; i < ads_v3.ads_size(); i++) {
+                                    const auto& ad = ads_v3.ads(i);
+                                    logger.debug_if_enabled("Generated ad details", [&](logging::LogFields& fields) {
+                                        fields.add("session_id", session_id)
+                                              .add("version", 3)
+                                              .add("ad_index", i)
+                                              .add("asin_id", ad.asin_id())
+                                              .add("ad_id", ad.ad_id())
+                                              .add("score", ad.score());
+                                    });
+                                }
                             }
-                        }
                         
-                        std::string completion_message = logging::LogContext()
-                            .add("session_id", session_id)
-                            .add("total_contexts", context_count)
-                            .add("total_duration_ms", session_timer.elapsed_ms())
-                            .build("Stream completed successfully");
-                        logger.info(completion_message);
+                            logger.info_if_enabled("Stream completed successfully", [&](logging::LogFields& fields) {
+                                fields.add("session_id", session_id)
+                                      .add("total_contexts", context_count)
+                                      .add("total_duration_ms", session_timer.elapsed_ms());
+                            });
                         
-                    } catch (const std::exception& e) {
-                        std::string error_message = logging::LogContext()
-                            .add("session_id", session_id)
-                            .add("error_type", "std::exception")
-                            .add("error_message", e.what())
-                            .add("session_elapsed_ms", session_timer.elapsed_ms())
-                            .build("Error sending version 3");
-                        logger.error(error_message);
+                        } catch (const std::exception& e) {
+                            logger.error_if_enabled("Error sending version 3", [&](logging::LogFields& fields) {
+                                fields.add("session_id", session_id)
+                                      .add("error_type", "std::exception")
+                                      .add("error_message", e.what())
+                                      .add("session_elapsed_ms", session_timer.elapsed_ms());
+                            });
+                        }
+                    }
+                    
+                    {
+                        std::lock_guard<std::mutex> lock(version3_mu);
+                        version3_done = true;
                     }
-                }).detach();
+                    version3_cv.notify_all();
+                });
                 
                 break; // Client should half-close after second context
             }
         } catch (const std::exception& e) {
-            std::string processing_error_message = logging::LogContext()
-                .add("session_id", session_id)
-                .add("context_number", context_count)
-                .add("error_type", "std::exception")
-                .add("error_message", e.what())
-                .add("processing_ms", context_processing_timer.elapsed_ms())
-                .build("Error processing Context message");
-            logger.error(processing_error_message);
+            logger.error_if_enabled("Error processing Context message", [&](logging::LogFields& fields) {
+                fields.add("session_id", session_id)
+                      .add("context_number", context_count)
+                      .add("error_type", "std::exception")
+                      .add("error_message", e.what())
+                      .add("processing_ms", context_processing_timer.elapsed_ms());
+            });
+            if (version3_timer != 0) {
+                scheduler_.cancel(version3_timer);
+            }
+            counters.sessions_failed.add();
+            session_span.setError(e.what());
             return Status(grpc::StatusCode::INTERNAL, "Error processing context");
         }
     }
     
-    // Wait a bit for the delayed version 3 to be sent
-    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    // Finish as soon as the version 3 write has completed or the client has
+    // cancelled. The sync API has no cancellation callback, so IsCancelled()
+    // is polled at a short interval while write completion wakes us directly.
+    if (version3_timer != 0) {
+        {
+            std::unique_lock<std::mutex> lock(version3_mu);
+            while (!version3_done && !context->IsCancelled()) {
+                version3_cv.wait_for(lock, kCancellationPollInterval);
+            }
+        }
+        // Make sure the version 3 task is not touching the stream after we
+        // return. If it never started, the client cancelled before it was due.
+        if (scheduler_.cancel(version3_timer)) {
+            counters.version3_misses.add();
+        }
+    }
     
-    std::string client_disconnect_message = logging::LogContext()
-        .add("session_id", session_id)
-        .add("contexts_received", context_count)
-        .add("session_elapsed_ms", session_timer.elapsed_ms())
-        .build("Client half-closed stream");
-    logger.info(client_disconnect_message);
+    logger.info_if_enabled("Client half-closed stream", [&](logging::LogFields& fields) {
+        fields.add("session_id", session_id)
+              .add("contexts_received", context_count)
+              .add("cancelled", context->IsCancelled())
+              .add("session_elapsed_ms", session_timer.elapsed_ms());
+    });
     
+    session_span.set("contexts_received", context_count).setFlag("cancelled", context->IsCancelled());
+    if (context->IsCancelled()) {
+        counters.sessions_cancelled.add();
+    } else {
+        counters.sessions_completed.add();
+    }
     return Status::OK;
 }
\ No newline at end of file
@@ -3,6 +3,10 @@
 #include <grpcpp/grpcpp.h>
 #include "ads.grpc.pb.h"
 #include "ad_generator.h"
+#include "timer_scheduler.h"
+#include "refinement_policy.h"
+#include "generation_coalescer.h"
+#include "admission_controller.h"
 
 using grpc::ServerContext;
 using grpc::ServerReaderWriter;
@@ -13,9 +17,22 @@ using ads::AdsService;
 
 class AdsServiceImpl final : public AdsService::Service {
 public:
+    AdsServiceImpl(AdGenerator& ad_generator, TimerScheduler& scheduler,
+                   const RefinementPolicy& refinement_policy,
+                   GenerationCoalescer* coalescer = nullptr,
+                   AdmissionController* admission = nullptr)
+        : ad_generator_(ad_generator), scheduler_(scheduler),
+          refinement_policy_(refinement_policy), coalescer_(coalescer), admission_(admission) {}
+
     Status GetAds(ServerContext* context,
                   ServerReaderWriter<AdsList, Context>* stream) override;
 
 private:
-    AdGenerator ad_generator_;
+    AdGenerator& ad_generator_;
+    TimerScheduler& scheduler_;
+    const RefinementPolicy& refinement_policy_;
+    // Shares generation between identical sessions when set
+    GenerationCoalescer* coalescer_;
+    // Rejects streams over its limit and sheds refinements when set
+    AdmissionController* admission_;
 };
\ No newline at end of file
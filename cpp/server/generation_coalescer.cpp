@@ -0,0 +1,152 @@
+#include "generation_coalescer.h"
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+static const char* kGenerationsHelp =
+    "AdsList generation requests, by whether they ran, joined one in flight, hit the cache "
+    "or generated locally rather than wait";
+
+GenerationCoalescer::GenerationCoalescer(AdGenerator& generator, Options options)
+    : generator_(generator),
+      ttl_ns_(static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(options.ttl).count())),
+      shard_capacity_(options.shard_count == 0 ? 0
+                      : (options.capacity + options.shard_count - 1) / options.shard_count),
+      shard_count_(options.shard_count),
+      shards_(new Shard[options.shard_count]),
+      generated_(metrics::Registry::instance().counter(
+          "ads_server_coalesced_generations_total", "result=\"generated\"", kGenerationsHelp)),
+      joined_(metrics::Registry::instance().counter(
+          "ads_server_coalesced_generations_total", "result=\"joined\"", kGenerationsHelp)),
+      cached_(metrics::Registry::instance().counter(
+          "ads_server_coalesced_generations_total", "result=\"cached\"", kGenerationsHelp)),
+      bypassed_(metrics::Registry::instance().counter(
+          "ads_server_coalesced_generations_total", "result=\"bypassed\"", kGenerationsHelp)) {
+    if (shard_count_ == 0) {
+        throw std::invalid_argument("GenerationCoalescer requires at least one shard");
+    }
+}
+
+// Length-prefixed so no combination of field values can collide
+std::string GenerationCoalescer::makeKey(const Context& context, int version, ScorerTier tier) {
+    std::string key;
+    key.reserve(context.query().size() + context.asin_id().size() +
+                context.understanding().size() + 32);
+    key += std::to_string(version);
+    key += tier == ScorerTier::EXTENDED ? 'x' : 's';
+    for (const std::string* field : {&context.query(), &context.asin_id(), &context.understanding()}) {
+        key += std::to_string(field->size());
+        key += ':';
+        key += *field;
+    }
+    // A batch is one key; items are length-prefixed like the fields above
+    for (const BatchItem& item : context.items()) {
+        for (const std::string* field : {&item.query(), &item.asin_id()}) {
+            key += std::to_string(field->size());
+            key += ':';
+            key += *field;
+        }
+    }
+    return key;
+}
+
+void GenerationCoalescer::evict(Shard& shard, uint64_t now_ns) {
+    while (!shard.expiry.empty()) {
+        const Completed& oldest = shard.expiry.front();
+        if (now_ns - oldest.completed_ns < ttl_ns_ && shard.expiry.size() <= shard_capacity_) {
+            break;
+        }
+        auto it = shard.entries.find(oldest.key);
+        // The key may have been generated again since; keep the newer entry
+        if (it != shard.entries.end() && it->second.completed_ns == oldest.completed_ns) {
+            shard.entries.erase(it);
+        }
+        shard.expiry.pop_front();
+    }
+}
+
+CoalescedAdsListPtr GenerationCoalescer::generateAds(const Context& context, int version,
+                                                     ScorerTier tier) {
+    return generate(context, version, tier, true);
+}
+
+CoalescedAdsListPtr GenerationCoalescer::tryGenerateAds(const Context& context, int version,
+                                                        ScorerTier tier) {
+    return generate(context, version, tier, false);
+}
+
+CoalescedAdsListPtr GenerationCoalescer::generate(const Context& context, int version,
+                                                  ScorerTier tier, bool join_in_flight) {
+    std::string key = makeKey(context, version, tier);
+    Shard& shard = shards_[std::hash<std::string>()(key) % shard_count_];
+
+    std::promise<CoalescedAdsListPtr> promise;
+    std::unique_lock<std::mutex> lock(shard.mu);
+    evict(shard, metrics::now_ns());
+    auto found = shard.entries.find(key);
+    if (found != shard.entries.end()) {
+        if (found->second.completed_ns == 0 && !join_in_flight) {
+            bypassed_.add();
+            return nullptr;
+        }
+        std::shared_future<CoalescedAdsListPtr> result = found->second.result;
+        (found->second.completed_ns == 0 ? joined_ : cached_).add();
+        // An in-flight result is waited for outside the lock so other keys
+        // of the shard are not held up
+        lock.unlock();
+        return result.get();
+    }
+    shard.entries.emplace(key, Entry{promise.get_future().share(), 0});
+    lock.unlock();
+    generated_.add();
+
+    CoalescedAdsListPtr ads;
+    try {
+        auto generated = std::make_shared<CoalescedAdsList>();
+        generated->ads_list = generator_.generateAds(context, version, tier);
+        std::unique_ptr<std::string> bytes(new std::string());
+        generated->ads_list.SerializeToString(bytes.get());
+        void* data = &(*bytes)[0];
+        size_t size = bytes->size();
+        generated->serialized = grpc::Slice(data, size, [](void* owner) {
+            delete static_cast<std::string*>(owner);
+        }, bytes.release());
+        ads = std::move(generated);
+    } catch (...) {
+        lock.lock();
+        shard.entries.erase(key);
+        lock.unlock();
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+    promise.set_value(ads);
+
+    lock.lock();
+    auto it = shard.entries.find(key);
+    if (ttl_ns_ == 0 || shard_capacity_ == 0) {
+        shard.entries.erase(it);
+    } else {
+        // completed_ns must be unique per key for evict(); now_ns() is
+        // nanosecond-resolution and taken under the shard lock
+        it->second.completed_ns = metrics::now_ns();
+        shard.expiry.push_back(Completed{key, it->second.completed_ns});
+        evict(shard, it->second.completed_ns);
+    }
+    return ads;
+}
+
+const AdsList& generateSessionAds(AdGenerator& generator, GenerationCoalescer* coalescer,
+                                  const Context& context, int version,
+                                  google::protobuf::Arena* arena, SessionScoreCache* session_cache,
+                                  ScorerTier tier, CoalescedAdsListPtr& shared,
+                                  InFlightPolicy in_flight) {
+    if (coalescer != nullptr) {
+        shared = in_flight == InFlightPolicy::JOIN ? coalescer->generateAds(context, version, tier)
+                                                   : coalescer->tryGenerateAds(context, version, tier);
+        if (shared) {
+            return shared->ads_list;
+        }
+    }
+    return *generator.generateAds(context, version, arena, session_cache, tier);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "ad_generator.h"
+#include "../common/metrics.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <grpcpp/support/slice.h>
+
+/**
+ * One generated AdsList together with its wire encoding, shared by every
+ * session that asked for the same (Context, version, tier).
+ */
+struct CoalescedAdsList {
+    AdsList ads_list;
+    // ads_list serialized once, for writers that send raw bytes. The slice
+    // owns its bytes by refcount, so it can outlive this object in a write
+    grpc::Slice serialized;
+};
+
+using CoalescedAdsListPtr = std::shared_ptr<const CoalescedAdsList>;
+
+/**
+ * Single-flight layer in front of AdGenerator.
+ *
+ * generateAds is deterministic in (query, asin_id, understanding, batch
+ * items, version, tier), so concurrent sessions asking for the same key share one
+ * computation: the first caller generates and serializes the list, the
+ * others block on its result (or, through tryGenerateAds, generate their own
+ * copy rather than wait). Completed results stay cached for ttl so a
+ * burst of identical requests arriving just after each other is also served
+ * from one computation. With ttl == 0 only in-flight work is shared.
+ *
+ * Entries are spread over independently locked shards; each shard holds at
+ * most capacity / shard_count completed results, oldest evicted first.
+ * A generation that throws is not cached and the exception is rethrown to
+ * every caller that joined it.
+ */
+class GenerationCoalescer {
+public:
+    struct Options {
+        std::chrono::milliseconds ttl{100};
+        size_t capacity = 10000;
+        size_t shard_count = 16;
+    };
+
+    GenerationCoalescer(AdGenerator& generator, Options options);
+
+    CoalescedAdsListPtr generateAds(const Context& context, int version,
+                                    ScorerTier tier = ScorerTier::STANDARD);
+
+    // Never waits for another caller: returns a cached result or generates
+    // one, but nullptr while the key is in flight elsewhere. For threads
+    // that must not block, such as gRPC callback threads.
+    CoalescedAdsListPtr tryGenerateAds(const Context& context, int version,
+                                       ScorerTier tier = ScorerTier::STANDARD);
+
+private:
+    struct Entry {
+        std::shared_future<CoalescedAdsListPtr> result;
+        // now_ns() when the result became available; 0 while in flight
+        uint64_t completed_ns = 0;
+    };
+
+    struct Completed {
+        std::string key;
+        uint64_t completed_ns;
+    };
+
+    struct Shard {
+        std::mutex mu;
+        std::unordered_map<std::string, Entry> entries;
+        // Completed entries in completion order, i.e. expiry order
+        std::list<Completed> expiry;
+    };
+
+    CoalescedAdsListPtr generate(const Context& context, int version, ScorerTier tier,
+                                 bool join_in_flight);
+    static std::string makeKey(const Context& context, int version, ScorerTier tier);
+    // Requires shard.mu; drops entries older than ttl and enforces the capacity
+    void evict(Shard& shard, uint64_t now_ns);
+
+    AdGenerator& generator_;
+    const uint64_t ttl_ns_;
+    const size_t shard_capacity_;
+    const size_t shard_count_;
+    std::unique_ptr<Shard[]> shards_;
+
+    metrics::Counter& generated_;
+    metrics::Counter& joined_;
+    metrics::Counter& cached_;
+    metrics::Counter& bypassed_;
+};
+
+// What generateSessionAds does when another session is generating the same
+// list
+enum class InFlightPolicy {
+    JOIN,     // wait for its result
+    GENERATE  // generate on the session's arena instead of blocking
+};
+
+/**
+ * The AdsList of version for one session: shared through coalescer when it
+ * is set, otherwise generated on the session's arena with its score cache.
+ * shared keeps a coalesced list alive for as long as the reference is used,
+ * and is left null when in_flight is GENERATE and the list was generated
+ * locally.
+ */
+const AdsList& generateSessionAds(AdGenerator& generator, GenerationCoalescer* coalescer,
+                                  const Context& context, int version,
+                                  google::protobuf::Arena* arena, SessionScoreCache* session_cache,
+                                  ScorerTier tier, CoalescedAdsListPtr& shared,
+                                  InFlightPolicy in_flight = InFlightPolicy::JOIN);
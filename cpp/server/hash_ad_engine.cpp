@@ -0,0 +1,256 @@
+#include "hash_ad_engine.h"
+#include "score_kernel.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <random>
+
+namespace {
+
+/**
+ * Builds a hash key from several pieces without heap allocation.
+ *
+ * std::hash is a one-shot hash over the whole key, so the pieces are
+ * concatenated into a stack buffer and hashed once with
+ * std::hash<std::string_view>, which is guaranteed to equal
+ * std::hash<std::string> of the same characters. Keys longer than the
+ * buffer fall back to a std::string.
+ */
+class HashKey {
+public:
+    HashKey& append(std::string_view piece) {
+        if (overflow_.empty() && size_ + piece.size() <= sizeof(buffer_)) {
+            std::memcpy(buffer_ + size_, piece.data(), piece.size());
+            size_ += piece.size();
+        } else {
+            if (overflow_.empty()) {
+                overflow_.assign(buffer_, size_);
+            }
+            overflow_.append(piece.data(), piece.size());
+        }
+        return *this;
+    }
+
+    // Same digits as std::to_string(int)
+    HashKey& append(int value) {
+        char digits[16];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        return append(std::string_view(digits, result.ptr - digits));
+    }
+
+    size_t hash() const {
+        std::string_view key = overflow_.empty() ? std::string_view(buffer_, size_)
+                                                 : std::string_view(overflow_);
+        return std::hash<std::string_view>()(key);
+    }
+
+private:
+    char buffer_[256];
+    size_t size_ = 0;
+    std::string overflow_;
+};
+
+// Writes prefix followed by value zero-padded to width digits (value must have
+// at most width digits), the same text as setfill('0') << setw(width).
+template <size_t N>
+std::string_view formatFixedId(char (&buffer)[N], std::string_view prefix,
+                               size_t value, size_t width) {
+    std::memcpy(buffer, prefix.data(), prefix.size());
+    char* end = buffer + prefix.size() + width;
+    for (char* p = end; p != buffer + prefix.size(); value /= 10) {
+        *--p = static_cast<char>('0' + value % 10);
+    }
+    return std::string_view(buffer, end - buffer);
+}
+
+} // namespace
+
+void HashCandidateRetriever::retrieve(const Context& context, int version,
+                                      std::vector<AdCandidate>& candidates) {
+    // Generate 5-10 ads based on context. The engine is reseeded rather than
+    // constructed per call; ad counts and score variations must keep coming
+    // from mt19937 for generated lists to stay identical.
+    size_t seed = HashKey().append(context.query()).append(context.asin_id())
+                           .append(version).hash();
+    thread_local std::mt19937 gen;
+    gen.seed(static_cast<std::mt19937::result_type>(seed));
+    std::uniform_int_distribution<> ad_count_dist(5, 10);
+    std::uniform_real_distribution<> score_variation(-0.1, 0.1);
+
+    int num_ads = ad_count_dist(gen);
+
+    char asin_buffer[kAsinIdLength];
+    char ad_id_buffer[kAdIdLength];
+    size_t first = candidates.size();
+    candidates.resize(first + num_ads);
+    for (int i = 0; i < num_ads; i++) {
+        AdCandidate& candidate = candidates[first + i];
+
+        // Generate asin_id based on context and index
+        size_t asin_hash = HashKey().append(context.asin_id()).append(i).hash();
+        std::string_view asin_id = formatFixedId(asin_buffer, "B", asin_hash % 1000000, 6);
+        candidate.asin_id.assign(asin_id.data(), asin_id.size());
+
+        // Generate ad_id
+        size_t ad_id_hash = HashKey().append(asin_id).append(i).hash();
+        std::string_view ad_id = formatFixedId(ad_id_buffer, "AD", ad_id_hash % 100000000, 8);
+        candidate.ad_id.assign(ad_id.data(), ad_id.size());
+
+        // Some variation per ad
+        candidate.prior = score_variation(gen);
+    }
+}
+
+HashAdScorer::HashAdScorer(size_t shared_cache_capacity) {
+    if (shared_cache_capacity > 0) {
+        shared_cache_.reset(new ScoreLruCache(shared_cache_capacity));
+    }
+}
+
+void HashAdScorer::score(const Context& context, int version,
+                         const std::vector<AdCandidate>& candidates,
+                         SessionScoreCache* session_cache,
+                         std::vector<double>& scores) {
+    double base_score;
+    double understanding_boost;
+    contextTerms(context, session_cache, &base_score, &understanding_boost);
+
+    // Reused per thread so steady-state scoring does not allocate
+    thread_local ScoreColumns columns;
+    size_t count = candidates.size();
+    columns.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        columns.base_score[i] = base_score;
+        columns.boost[i] = understanding_boost;
+        columns.prior[i] = candidates[i].prior;
+    }
+
+    scores.resize(count);
+    scoreBatch(columns, versionMultiplier(version), scores.data());
+}
+
+void HashAdScorer::scoreItems(const ScoringBatch& batch, int version, std::vector<double>& scores) {
+    thread_local ScoreColumns columns;
+    columns.resize(batch.candidates.size());
+    for (size_t i = 0; i < batch.contexts.size(); i++) {
+        double base_score;
+        double understanding_boost;
+        contextTerms(*batch.contexts[i],
+                     batch.session_caches == nullptr ? nullptr : &batch.session_caches[i],
+                     &base_score, &understanding_boost);
+        for (size_t j = batch.offsets[i]; j < batch.offsets[i + 1]; j++) {
+            columns.base_score[j] = base_score;
+            columns.boost[j] = understanding_boost;
+            columns.prior[j] = batch.candidates[j].prior;
+        }
+    }
+
+    scores.resize(batch.candidates.size());
+    scoreBatch(columns, versionMultiplier(version), scores.data());
+}
+
+double HashAdScorer::versionScore(const Context& context, int version,
+                                  SessionScoreCache* session_cache) {
+    double base_score;
+    double understanding_boost;
+    contextTerms(context, session_cache, &base_score, &understanding_boost);
+
+    // Version refinement (progressive improvement)
+    double final_score = (base_score + understanding_boost) * versionMultiplier(version);
+
+    // Ensure score is in valid range
+    return std::max(0.0, std::min(1.0, final_score));
+}
+
+void HashAdScorer::contextTerms(const Context& context, SessionScoreCache* session_cache,
+                                double* base_score, double* understanding_boost) {
+    if (session_cache == nullptr) {
+        *base_score = baseScore(context.query(), context.asin_id());
+        *understanding_boost = understandingBoost(context.understanding());
+        return;
+    }
+    if (!session_cache->has_base_score ||
+        session_cache->query != context.query() ||
+        session_cache->asin_id != context.asin_id()) {
+        session_cache->query = context.query();
+        session_cache->asin_id = context.asin_id();
+        session_cache->base_score = baseScore(context.query(), context.asin_id());
+        session_cache->has_base_score = true;
+    }
+    if (!session_cache->has_understanding_boost ||
+        session_cache->understanding != context.understanding()) {
+        session_cache->understanding = context.understanding();
+        session_cache->understanding_boost = understandingBoost(context.understanding());
+        session_cache->has_understanding_boost = true;
+    }
+    *base_score = session_cache->base_score;
+    *understanding_boost = session_cache->understanding_boost;
+}
+
+double HashAdScorer::baseScore(std::string_view query, std::string_view asin_id) {
+    double base_score;
+    if (shared_cache_ && shared_cache_->lookup(query, asin_id, &base_score)) {
+        return base_score;
+    }
+
+    // Base score from query and asin_id
+    base_score = static_cast<double>(HashKey().append(query).append(asin_id).hash() % 1000) / 1000.0;
+
+    if (shared_cache_) {
+        shared_cache_->insert(query, asin_id, base_score);
+    }
+    return base_score;
+}
+
+double HashAdScorer::understandingBoost(std::string_view understanding) {
+    // Understanding boost (when understanding is provided)
+    if (understanding.empty()) {
+        return 0.0;
+    }
+    return static_cast<double>(std::hash<std::string_view>()(understanding) % 200) / 1000.0; // 0-0.2 boost
+}
+
+HashRerankScorer::HashRerankScorer(std::shared_ptr<HashAdScorer> base) : base_(std::move(base)) {
+}
+
+void HashRerankScorer::score(const Context& context, int version,
+                             const std::vector<AdCandidate>& candidates,
+                             SessionScoreCache* session_cache,
+                             std::vector<double>& scores) {
+    base_->score(context, version, candidates, session_cache, scores);
+    rerank(context, candidates.data(), candidates.size(), scores.data());
+}
+
+void HashRerankScorer::scoreItems(const ScoringBatch& batch, int version,
+                                  std::vector<double>& scores) {
+    base_->scoreItems(batch, version, scores);
+    for (size_t i = 0; i < batch.contexts.size(); i++) {
+        size_t first = batch.offsets[i];
+        rerank(*batch.contexts[i], batch.candidates.data() + first, batch.offsets[i + 1] - first,
+               scores.data() + first);
+    }
+}
+
+void HashRerankScorer::rerank(const Context& context, const AdCandidate* candidates, size_t count,
+                              double* scores) {
+    if (context.understanding().empty()) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t pair_hash = HashKey().append(context.understanding()).append(candidates[i].ad_id).hash();
+        double relevance = static_cast<double>(pair_hash % 1000) / 10000.0 - 0.05;
+        scores[i] = std::max(0.0, std::min(1.0, scores[i] + relevance));
+    }
+}
+
+AdEngine makeHashAdEngine(size_t shared_cache_capacity) {
+    AdEngine engine;
+    engine.retriever = std::make_shared<HashCandidateRetriever>();
+    auto scorer = std::make_shared<HashAdScorer>(shared_cache_capacity);
+    for (auto& tier : engine.scorers) {
+        tier = scorer;
+    }
+    engine.extended_scorer = std::make_shared<HashRerankScorer>(scorer);
+    return engine;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "ad_engine.h"
+#include "score_cache.h"
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+/**
+ * Default engine: fabricates ads deterministically from std::hash.
+ *
+ * HashCandidateRetriever draws 5-10 candidates and their per-ad variation
+ * from an mt19937 seeded with (query, asin_id, version); HashAdScorer derives
+ * the context score from hashes of the query, asin_id and understanding and
+ * runs the batch kernel (score_kernel.h) to apply the version multiplier and
+ * per-ad priors. Together they produce the same AdsLists as the original
+ * monolithic generator.
+ */
+class HashCandidateRetriever final : public CandidateRetriever {
+public:
+    void retrieve(const Context& context, int version,
+                  std::vector<AdCandidate>& candidates) override;
+
+    // Generated ids are "B" + 6 digits and "AD" + 8 digits
+    static constexpr size_t kAsinIdLength = 7;
+    static constexpr size_t kAdIdLength = 10;
+};
+
+class HashAdScorer final : public AdScorer {
+public:
+    // shared_cache_capacity > 0 enables a cross-session LRU of base scores
+    explicit HashAdScorer(size_t shared_cache_capacity = 0);
+
+    void score(const Context& context, int version,
+               const std::vector<AdCandidate>& candidates,
+               SessionScoreCache* session_cache,
+               std::vector<double>& scores) override;
+    // Fills the kernel columns of every context and runs the kernel once
+    void scoreItems(const ScoringBatch& batch, int version, std::vector<double>& scores) override;
+
+    // Context score for version before the per-ad prior is added
+    double versionScore(const Context& context, int version, SessionScoreCache* session_cache);
+
+private:
+    // Version-independent terms, from session_cache when it is still valid
+    void contextTerms(const Context& context, SessionScoreCache* session_cache,
+                      double* base_score, double* understanding_boost);
+    double baseScore(std::string_view query, std::string_view asin_id);
+    double understandingBoost(std::string_view understanding);
+
+    std::unique_ptr<ScoreLruCache> shared_cache_;
+};
+
+/**
+ * Extended-tier scorer: the HashAdScorer score plus a per-ad relevance term
+ * hashed from (understanding, ad_id), in [-0.05, 0.05]. It stands in for a
+ * model that looks at every (context, ad) pair and costs one extra hash per
+ * candidate. Without an understanding it scores like the base scorer.
+ */
+class HashRerankScorer final : public AdScorer {
+public:
+    explicit HashRerankScorer(std::shared_ptr<HashAdScorer> base);
+
+    void score(const Context& context, int version,
+               const std::vector<AdCandidate>& candidates,
+               SessionScoreCache* session_cache,
+               std::vector<double>& scores) override;
+    void scoreItems(const ScoringBatch& batch, int version, std::vector<double>& scores) override;
+
+private:
+    // Adds the relevance term of the count candidates to scores
+    static void rerank(const Context& context, const AdCandidate* candidates, size_t count,
+                       double* scores);
+
+    std::shared_ptr<HashAdScorer> base_;
+};
+
+// Hash retriever with one HashAdScorer shared by all versions and a
+// HashRerankScorer on top of it as the extended tier
+AdEngine makeHashAdEngine(size_t shared_cache_capacity = 0);
@@ -0,0 +1,280 @@
+#include "inventory_index.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace inventory {
+
+uint64_t keyHash(std::string_view key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+} // namespace inventory
+
+using inventory::InventoryAd;
+using inventory::InventoryHeader;
+using inventory::InventoryKey;
+
+static std::runtime_error inventoryError(const std::string& path, const std::string& what) {
+    return std::runtime_error("inventory " + path + ": " + what);
+}
+
+static bool sectionFits(uint64_t offset, uint64_t count, uint64_t size, uint64_t file_size) {
+    return offset % 8 == 0 && offset <= file_size &&
+           (size == 0 || count <= (file_size - offset) / size);
+}
+
+std::shared_ptr<const InventoryIndex> InventoryIndex::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw inventoryError(path, std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw inventoryError(path, std::strerror(err));
+    }
+    size_t file_size = static_cast<size_t>(st.st_size);
+    if (file_size < sizeof(InventoryHeader)) {
+        ::close(fd);
+        throw inventoryError(path, "file too small");
+    }
+
+    void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    int map_errno = errno;
+    // The mapping keeps the file alive; the descriptor is no longer needed
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw inventoryError(path, std::strerror(map_errno));
+    }
+    // Lookups jump around the key section; don't read ahead
+    madvise(mapping, file_size, MADV_RANDOM);
+
+    std::shared_ptr<InventoryIndex> index(new InventoryIndex());
+    index->path_ = path;
+    index->mapping_ = mapping;
+    index->mapping_size_ = file_size;
+
+    const char* base = static_cast<const char*>(mapping);
+    const auto* header = reinterpret_cast<const InventoryHeader*>(base);
+    if (std::memcmp(header->magic, inventory::kMagic, sizeof(header->magic)) != 0) {
+        throw inventoryError(path, "bad magic");
+    }
+    if (header->format_version != inventory::kFormatVersion) {
+        throw inventoryError(path, "unsupported format version " +
+                             std::to_string(header->format_version));
+    }
+    if (!sectionFits(header->keys_offset, header->key_count, sizeof(InventoryKey), file_size) ||
+        !sectionFits(header->ads_offset, header->ad_count, sizeof(InventoryAd), file_size) ||
+        !sectionFits(header->strings_offset, header->strings_size, 1, file_size)) {
+        throw inventoryError(path, "section out of bounds");
+    }
+
+    index->header_ = header;
+    index->keys_ = reinterpret_cast<const InventoryKey*>(base + header->keys_offset);
+    index->ads_ = reinterpret_cast<const InventoryAd*>(base + header->ads_offset);
+    index->strings_ = base + header->strings_offset;
+
+    // Records are bounds-checked by the lookups that read them, so opening
+    // touches no page past the header
+    return index;
+}
+
+InventoryIndex::~InventoryIndex() {
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_size_);
+    }
+}
+
+bool InventoryIndex::lookup(std::string_view key, const InventoryAd** first, size_t* count) const {
+    uint64_t hash = inventory::keyHash(key);
+    const InventoryKey* begin = keys_;
+    const InventoryKey* end = keys_ + header_->key_count;
+    const InventoryKey* it = std::lower_bound(begin, end, hash,
+        [](const InventoryKey& record, uint64_t value) { return record.key_hash < value; });
+
+    // Walk the (almost always single-entry) run of equal hashes
+    for (; it != end && it->key_hash == hash; ++it) {
+        if (!stringFits(it->key_offset, it->key_length) ||
+            uint64_t(it->first_ad) + it->ad_count > header_->ad_count) {
+            throw inventoryError(path_, "key " + std::to_string(it - begin) + " out of bounds");
+        }
+        if (string(it->key_offset, it->key_length) == key) {
+            *first = ads_ + it->first_ad;
+            *count = it->ad_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+InventoryIndex::AdView InventoryIndex::ad(const InventoryAd& record) const {
+    if (!stringFits(record.asin_offset, record.asin_length) ||
+        !stringFits(record.ad_id_offset, record.ad_id_length)) {
+        throw inventoryError(path_, "ad " + std::to_string(&record - ads_) + " out of bounds");
+    }
+    return AdView{string(record.asin_offset, record.asin_length),
+                  string(record.ad_id_offset, record.ad_id_length),
+                  record.prior};
+}
+
+void InventoryIndexWriter::add(std::string_view key, std::string_view asin_id,
+                               std::string_view ad_id, double prior) {
+    entries_.push_back(Entry{std::string(key), std::string(asin_id), std::string(ad_id), prior});
+}
+
+static uint64_t align8(uint64_t value) {
+    return (value + 7) & ~uint64_t(7);
+}
+
+void InventoryIndexWriter::build(const std::string& path) const {
+    // Ad indexes (InventoryKey::first_ad) and per-key counts are 32-bit;
+    // neither can exceed the total number of ads
+    if (entries_.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("inventory exceeds 2^32-1 ads");
+    }
+
+    // Group ads by key in (hash, key) order; keep insertion order within a key
+    std::vector<size_t> order(entries_.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::vector<uint64_t> hashes(entries_.size());
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        hashes[i] = inventory::keyHash(entries_[i].key);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (hashes[a] != hashes[b]) {
+            return hashes[a] < hashes[b];
+        }
+        return entries_[a].key < entries_[b].key;
+    });
+
+    std::vector<InventoryKey> keys;
+    std::vector<InventoryAd> ads;
+    std::string strings;
+    auto addString = [&](const std::string& value, uint32_t* offset, uint32_t* length) {
+        if (strings.size() + value.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("inventory string section exceeds 4GiB");
+        }
+        *offset = static_cast<uint32_t>(strings.size());
+        *length = static_cast<uint32_t>(value.size());
+        strings += value;
+    };
+
+    ads.reserve(entries_.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        const Entry& entry = entries_[order[i]];
+        if (i == 0 || entries_[order[i - 1]].key != entry.key) {
+            InventoryKey key{};
+            key.key_hash = hashes[order[i]];
+            addString(entry.key, &key.key_offset, &key.key_length);
+            key.first_ad = static_cast<uint32_t>(ads.size());
+            keys.push_back(key);
+        }
+        InventoryAd ad{};
+        addString(entry.asin_id, &ad.asin_offset, &ad.asin_length);
+        addString(entry.ad_id, &ad.ad_id_offset, &ad.ad_id_length);
+        ad.prior = entry.prior;
+        ads.push_back(ad);
+        keys.back().ad_count++;
+    }
+
+    InventoryHeader header{};
+    std::memcpy(header.magic, inventory::kMagic, sizeof(header.magic));
+    header.format_version = inventory::kFormatVersion;
+    header.key_count = keys.size();
+    header.ad_count = ads.size();
+    header.keys_offset = align8(sizeof(InventoryHeader));
+    header.ads_offset = align8(header.keys_offset + keys.size() * sizeof(InventoryKey));
+    header.strings_offset = align8(header.ads_offset + ads.size() * sizeof(InventoryAd));
+    header.strings_size = strings.size();
+
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("cannot create " + tmp_path);
+        }
+        auto padTo = [&out](uint64_t offset) {
+            static const char zeros[8] = {};
+            uint64_t position = static_cast<uint64_t>(out.tellp());
+            out.write(zeros, static_cast<std::streamsize>(offset - position));
+        };
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        padTo(header.keys_offset);
+        out.write(reinterpret_cast<const char*>(keys.data()),
+                  static_cast<std::streamsize>(keys.size() * sizeof(InventoryKey)));
+        padTo(header.ads_offset);
+        out.write(reinterpret_cast<const char*>(ads.data()),
+                  static_cast<std::streamsize>(ads.size() * sizeof(InventoryAd)));
+        padTo(header.strings_offset);
+        out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+        out.flush();
+        if (!out) {
+            throw std::runtime_error("failed writing " + tmp_path);
+        }
+    }
+    // rename() replaces the old file atomically for anyone opening it later
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        int err = errno;
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("cannot rename " + tmp_path + ": " + std::strerror(err));
+    }
+}
+
+InventoryStore::InventoryStore(const std::string& path)
+    : path_(path), index_(InventoryIndex::open(path)) {
+}
+
+std::shared_ptr<const InventoryIndex> InventoryStore::current() const {
+    return std::atomic_load(&index_);
+}
+
+void InventoryStore::reload() {
+    std::shared_ptr<const InventoryIndex> fresh = InventoryIndex::open(path_);
+    std::atomic_store(&index_, fresh);
+}
+
+InventoryCandidateRetriever::InventoryCandidateRetriever(std::shared_ptr<InventoryStore> store,
+                                                         std::shared_ptr<CandidateRetriever> fallback)
+    : store_(std::move(store)), fallback_(std::move(fallback)) {
+}
+
+void InventoryCandidateRetriever::retrieve(const Context& context, int version,
+                                           std::vector<AdCandidate>& candidates) {
+    std::shared_ptr<const InventoryIndex> index = store_->current();
+
+    const InventoryAd* first = nullptr;
+    size_t count = 0;
+    if (!index->lookup(context.asin_id(), &first, &count)) {
+        if (fallback_) {
+            fallback_->retrieve(context, version, candidates);
+        }
+        return;
+    }
+
+    size_t offset = candidates.size();
+    candidates.resize(offset + count);
+    for (size_t i = 0; i < count; ++i) {
+        InventoryIndex::AdView view = index->ad(first[i]);
+        AdCandidate& candidate = candidates[offset + i];
+        candidate.asin_id.assign(view.asin_id.data(), view.asin_id.size());
+        candidate.ad_id.assign(view.ad_id.data(), view.ad_id.size());
+        candidate.prior = view.prior;
+    }
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "ad_engine.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Read-only ad inventory (asin_id -> candidate ads with priors) stored in a
+ * flat binary file that is memory-mapped rather than parsed.
+ *
+ * Several ads_server processes mapping the same file share its pages in the
+ * page cache, and opening an index is O(1) regardless of its size: only the
+ * header is validated up front, each key and ad record when a lookup reads
+ * it. Layout
+ * (little-endian, every section 8-byte aligned):
+ *
+ *   InventoryHeader
+ *   InventoryKey[key_count]    sorted by (key_hash, key bytes)
+ *   InventoryAd[ad_count]      ads of each key are contiguous
+ *   char strings[strings_size] asin and ad id bytes, not NUL-terminated
+ *
+ * key_hash is 64-bit FNV-1a of the asin_id so the file does not depend on
+ * the std::hash of the process that built it.
+ */
+namespace inventory {
+
+constexpr char kMagic[8] = {'A', 'D', 'S', 'I', 'N', 'V', '0', '1'};
+constexpr uint32_t kFormatVersion = 1;
+
+struct InventoryHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t reserved;
+    uint64_t key_count;
+    uint64_t ad_count;
+    uint64_t keys_offset;
+    uint64_t ads_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct InventoryKey {
+    uint64_t key_hash;
+    uint32_t key_offset;
+    uint32_t key_length;
+    uint32_t first_ad;
+    uint32_t ad_count;
+};
+
+struct InventoryAd {
+    uint32_t asin_offset;
+    uint32_t asin_length;
+    uint32_t ad_id_offset;
+    uint32_t ad_id_length;
+    double prior;
+};
+
+static_assert(sizeof(InventoryHeader) == 64, "InventoryHeader layout changed");
+static_assert(sizeof(InventoryKey) == 24, "InventoryKey layout changed");
+static_assert(sizeof(InventoryAd) == 24, "InventoryAd layout changed");
+
+uint64_t keyHash(std::string_view key);
+
+} // namespace inventory
+
+/**
+ * One mapped inventory file. Lookups are a binary search over the key
+ * section and return views into the mapping, valid while the index lives.
+ * A record pointing outside its section makes lookup() or ad() throw
+ * std::runtime_error rather than read past the mapping.
+ */
+class InventoryIndex {
+public:
+    // Throws std::runtime_error if the file cannot be mapped or is malformed
+    static std::shared_ptr<const InventoryIndex> open(const std::string& path);
+    ~InventoryIndex();
+
+    InventoryIndex(const InventoryIndex&) = delete;
+    InventoryIndex& operator=(const InventoryIndex&) = delete;
+
+    struct AdView {
+        std::string_view asin_id;
+        std::string_view ad_id;
+        double prior;
+    };
+
+    // Returns false if key is not in the inventory
+    bool lookup(std::string_view key, const inventory::InventoryAd** first, size_t* count) const;
+    AdView ad(const inventory::InventoryAd& record) const;
+
+    size_t keyCount() const { return header_->key_count; }
+    size_t adCount() const { return header_->ad_count; }
+    const std::string& path() const { return path_; }
+
+private:
+    InventoryIndex() = default;
+
+    bool stringFits(uint32_t offset, uint32_t length) const {
+        return uint64_t(offset) + length <= header_->strings_size;
+    }
+
+    std::string_view string(uint32_t offset, uint32_t length) const {
+        return std::string_view(strings_ + offset, length);
+    }
+
+    std::string path_;
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    const inventory::InventoryHeader* header_ = nullptr;
+    const inventory::InventoryKey* keys_ = nullptr;
+    const inventory::InventoryAd* ads_ = nullptr;
+    const char* strings_ = nullptr;
+};
+
+/**
+ * Writes inventory files. Entries can be added in any order; build() sorts
+ * the keys and writes to a temporary file that is renamed over path, so a
+ * running server never maps a half-written inventory.
+ */
+class InventoryIndexWriter {
+public:
+    void add(std::string_view key, std::string_view asin_id, std::string_view ad_id, double prior);
+    // Throws std::runtime_error on I/O failure
+    void build(const std::string& path) const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::string asin_id;
+        std::string ad_id;
+        double prior;
+    };
+    std::vector<Entry> entries_;
+};
+
+/**
+ * Holder of the live inventory. Readers take a reference-counted snapshot, so
+ * reload() can map a new file and swap it in atomically while in-flight
+ * lookups finish on the old mapping, which is unmapped when released.
+ */
+class InventoryStore {
+public:
+    explicit InventoryStore(const std::string& path);
+
+    std::shared_ptr<const InventoryIndex> current() const;
+
+    // Map the file again (e.g. after it was replaced). On failure the current
+    // inventory stays in place and the exception is rethrown.
+    void reload();
+
+private:
+    std::string path_;
+    std::shared_ptr<const InventoryIndex> index_;
+};
+
+/**
+ * Retrieves the inventory ads stored for the Context's asin_id, deferring to
+ * fallback (if set) for asins the inventory does not know.
+ */
+class InventoryCandidateRetriever final : public CandidateRetriever {
+public:
+    InventoryCandidateRetriever(std::shared_ptr<InventoryStore> store,
+                                std::shared_ptr<CandidateRetriever> fallback);
+
+    void retrieve(const Context& context, int version,
+                  std::vector<AdCandidate>& candidates) override;
+
+private:
+    std::shared_ptr<InventoryStore> store_;
+    std::shared_ptr<CandidateRetriever> fallback_;
+};
@@ -1,33 +1,318 @@
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <grpcpp/grpcpp.h>
 #include "ads_service_impl.h"
+#include "ads_service_callback_impl.h"
+#include "timer_scheduler.h"
+#include "hash_ad_engine.h"
+#include "inventory_index.h"
+#include "score_kernel.h"
+#include "refinement_policy.h"
+#include "metrics_http_server.h"
+#include "server_config.h"
+#include "../common/logging.h"
+#include "../common/metrics.h"
 
 using grpc::Server;
 using grpc::ServerBuilder;
 
-void RunServer() {
-    std::string server_address("0.0.0.0:50051");
-    AdsServiceImpl service;
+// Signals handled by RunSignalThread
+static sigset_t ControlSignals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    return signals;
+}
+
+// Handles the control signals. They are blocked in all threads (see main)
+// and consumed here with sigwait, so the work runs on an ordinary thread
+// instead of inside a signal handler:
+//   SIGHUP   remap the inventory
+//   SIGUSR1  log one step more verbosely
+//   SIGUSR2  restore the LOG_LEVEL/DEBUG_MODE the server started with
+static void RunSignalThread(std::shared_ptr<InventoryStore> inventory) {
+    sigset_t signals = ControlSignals();
+    for (;;) {
+        int signal_number = 0;
+        if (sigwait(&signals, &signal_number) != 0) {
+            continue;
+        }
+        if (signal_number == SIGUSR1 || signal_number == SIGUSR2) {
+            logging::LogConfig& config = logging::LogConfig::instance();
+            if (signal_number == SIGUSR1) {
+                config.increase_verbosity();
+            } else {
+                config.restore_startup();
+            }
+            std::cout << "Logging reconfigured (level="
+                      << logging::LogConfig::level_name(config.level()) << ", debug_mode="
+                      << logging::LogConfig::debug_mode_name(config.debug_mode()) << ")"
+                      << std::endl;
+            continue;
+        }
+        if (!inventory) {
+            continue;
+        }
+        try {
+            inventory->reload();
+            std::shared_ptr<const InventoryIndex> index = inventory->current();
+            std::cout << "Reloaded inventory " << index->path() << " (" << index->keyCount()
+                      << " keys, " << index->adCount() << " ads)" << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Inventory reload failed, keeping the current one: " << e.what()
+                      << std::endl;
+        }
+    }
+}
+
+// Pins the calling process to one CPU, chosen by shard index
+static void PinToCpu(int shard_index) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu = shard_index % static_cast<int>(cpus > 0 ? cpus : 1);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        std::cerr << "Could not pin shard " << shard_index << " to CPU " << cpu << std::endl;
+        return;
+    }
+    std::cout << "Shard " << shard_index << " pinned to CPU " << cpu << std::endl;
+}
+
+void RunServer(const ServerConfig& config) {
+    if (config.shard_index >= 0 && config.pin_cpus) {
+        PinToCpu(config.shard_index);
+    }
+    AdEngine engine = makeHashAdEngine(config.score_cache_size);
+    std::shared_ptr<InventoryStore> inventory;
+    if (!config.inventory_path.empty()) {
+        inventory = std::make_shared<InventoryStore>(config.inventory_path);
+        engine.retriever = std::make_shared<InventoryCandidateRetriever>(inventory, engine.retriever);
+        std::shared_ptr<const InventoryIndex> index = inventory->current();
+        std::cout << "Mapped inventory " << index->path() << " (" << index->keyCount()
+                  << " keys, " << index->adCount() << " ads)" << std::endl;
+    }
+    std::thread(RunSignalThread, inventory).detach();
+    AdGenerator ad_generator(std::move(engine), config.top_k);
+    // Shared by all sessions for the delayed version 3 writes
+    TimerScheduler scheduler(config.timer_threads);
+    std::unique_ptr<RefinementPolicy> refinement_policy = makeRefinementPolicy(config.refinement_policy);
+    std::unique_ptr<GenerationCoalescer> coalescer;
+    if (config.coalesce) {
+        GenerationCoalescer::Options coalescer_options;
+        coalescer_options.ttl = std::chrono::milliseconds(config.result_cache_ttl_ms);
+        coalescer_options.capacity = config.result_cache_size;
+        coalescer.reset(new GenerationCoalescer(ad_generator, coalescer_options));
+    }
+    std::unique_ptr<AdmissionController> admission;
+    if (config.admission != "off") {
+        AdmissionController::Options admission_options;
+        admission_options.algorithm = AdmissionController::parseAlgorithm(config.admission);
+        admission_options.initial_limit = config.admission_initial_limit;
+        admission_options.min_limit = config.admission_min_limit;
+        admission_options.max_limit = config.admission_max_limit;
+        admission_options.latency_target = std::chrono::milliseconds(config.admission_latency_target_ms);
+        admission_options.skip_version3_at = config.shed_v3_at;
+        admission_options.skip_version2_at = config.shed_v2_at;
+        admission.reset(new AdmissionController(admission_options));
+    }
+    AdsServiceImpl sync_service(ad_generator, scheduler, *refinement_policy, coalescer.get(),
+                                admission.get());
+    AdsServiceCallbackImpl callback_service(ad_generator, scheduler, *refinement_policy, coalescer.get(),
+                                            admission.get());
+    AdsServiceRawImpl raw_service(ad_generator, scheduler, *refinement_policy, coalescer.get(),
+                                  admission.get());
 
     ServerBuilder builder;
-    // Listen on the given address without any authentication mechanism.
-    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    // Register "service" as the instance through which we'll communicate with
-    // clients. In this case it corresponds to an *synchronous* service.
-    builder.RegisterService(&service);
-    
+    // Listening port (without any authentication mechanism) and gRPC tuning
+    applyServerConfig(config, builder);
+    // Register the service through which we'll communicate with clients:
+    // the *synchronous*, the *callback* or the byte-level *raw* callback one.
+    if (config.api == "callback") {
+        builder.RegisterService(&callback_service);
+    } else if (config.api == "raw") {
+        builder.RegisterService(&raw_service);
+    } else {
+        builder.RegisterService(&sync_service);
+    }
+
+    // Stage latency summaries for the last interval
+    static logging::Logger metrics_logger("SERVER");
+    std::unique_ptr<metrics::PeriodicReporter> metrics_reporter;
+    if (config.metrics_interval_s > 0) {
+        metrics_reporter.reset(new metrics::PeriodicReporter(
+            metrics_logger, std::chrono::seconds(config.metrics_interval_s)));
+    }
+
+    std::unique_ptr<MetricsHttpServer> metrics_server;
+    if (config.metrics_port > 0) {
+        // Every shard needs a port of its own
+        int metrics_port = config.metrics_port + (config.shard_index > 0 ? config.shard_index : 0);
+        metrics_server.reset(new MetricsHttpServer(metrics_port));
+        std::cout << "Metrics on http://0.0.0.0:" << metrics_port << "/metrics" << std::endl;
+    }
+
     // Finally assemble the server.
     std::unique_ptr<Server> server(builder.BuildAndStart());
-    std::cout << "Server listening on " << server_address << std::endl;
+    if (!server) {
+        throw std::runtime_error("cannot listen on " + config.listen_address);
+    }
+    std::cout << "Server listening on " << config.listen_address
+              << " (api=" << config.api << ", score_kernel=" << scoreKernelName()
+              << ", refinement_policy=" << refinement_policy->name()
+              << ", coalesce=" << (config.coalesce ? "on" : "off")
+              << ", admission=" << config.admission;
+    if (config.shard_index >= 0) {
+        std::cout << ", shard=" << config.shard_index << "/" << config.processes;
+    }
+    std::cout << ")" << std::endl;
 
     // Wait for the server to shutdown. Note that some other thread must be
     // responsible for shutting down the server for this call to ever return.
     server->Wait();
 }
 
+extern char** environ;
+
+// Signals the supervisor waits for: the control signals, which it forwards
+// to every shard, plus termination and child exits
+static sigset_t SupervisorSignals() {
+    sigset_t signals = ControlSignals();
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGCHLD);
+    return signals;
+}
+
+/**
+ * Runs config.processes copies of this binary, all listening on the same
+ * SO_REUSEPORT address, and supervises them until they have all exited.
+ * Shards are started by re-executing this binary with the original
+ * arguments plus --shard-index=i, rather than by fork(), so each one is a
+ * fresh single-threaded process before gRPC starts.
+ */
+static int RunSupervisor(const ServerConfig& config, int argc, char** argv) {
+    sigset_t signals = SupervisorSignals();
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    // The resolved path keeps the shards' process name that of the binary
+    char executable[4096];
+    ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+    if (length <= 0) {
+        std::cerr << "Cannot resolve /proc/self/exe: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    executable[length] = '\0';
+
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t empty;
+    sigemptyset(&empty);
+    posix_spawnattr_setsigmask(&attributes, &empty);
+    // Shells start background jobs with SIGINT ignored; shards must still
+    // stop when the supervisor forwards it
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    posix_spawnattr_setsigdefault(&attributes, &stop_signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    std::vector<pid_t> shards;
+    for (int i = 0; i < config.processes; ++i) {
+        std::vector<std::string> args(argv, argv + argc);
+        args.push_back("--shard-index=" + std::to_string(i));
+        std::vector<char*> shard_argv;
+        for (std::string& arg : args) {
+            shard_argv.push_back(&arg[0]);
+        }
+        shard_argv.push_back(nullptr);
+
+        pid_t pid = 0;
+        int error = posix_spawn(&pid, executable, nullptr, &attributes, shard_argv.data(), environ);
+        if (error != 0) {
+            std::cerr << "Failed to start shard " << i << ": " << strerror(error) << std::endl;
+            continue;
+        }
+        shards.push_back(pid);
+    }
+    posix_spawnattr_destroy(&attributes);
+    std::cout << "Supervising " << shards.size() << " shards on " << config.listen_address << std::endl;
+
+    int exit_code = shards.size() == static_cast<size_t>(config.processes) ? 0 : 1;
+    bool stopping = false;
+    while (!shards.empty()) {
+        int signal_number = 0;
+        if (sigwait(&signals, &signal_number) != 0) {
+            continue;
+        }
+        if (signal_number != SIGCHLD) {
+            stopping = stopping || signal_number == SIGTERM || signal_number == SIGINT;
+            for (pid_t pid : shards) {
+                kill(pid, signal_number);
+            }
+            continue;
+        }
+        int status = 0;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t i = 0; i < shards.size(); ++i) {
+                if (shards[i] == pid) {
+                    shards.erase(shards.begin() + i);
+                    break;
+                }
+            }
+            bool clean = WIFEXITED(status) ? WEXITSTATUS(status) == 0 : stopping;
+            if (!clean) {
+                std::cerr << "Shard process " << pid << " exited abnormally" << std::endl;
+                exit_code = 1;
+            }
+        }
+    }
+    return exit_code;
+}
+
 int main(int argc, char** argv) {
-    RunServer();
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--help") {
+            printServerUsage(std::cout, argv[0]);
+            return 0;
+        }
+    }
+    ServerConfig config;
+    try {
+        config = loadServerConfig(argc, argv);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        printServerUsage(std::cerr, argv[0]);
+        return 1;
+    }
+    if (config.processes > 1 && config.shard_index < 0) {
+        return RunSupervisor(config, argc, argv);
+    }
+    // Block the control signals before the server starts its threads so they
+    // inherit the mask and only the signal thread receives them. Threads that
+    // static init already started (the LOG_ASYNC writer, the trace exporter)
+    // block every signal themselves.
+    sigset_t signals = ControlSignals();
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    try {
+        RunServer(config);
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to start server: " << e.what() << std::endl;
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,164 @@
+#include "metrics_http_server.h"
+#include "../common/metrics.h"
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static void appendNumber(std::string& out, double value) {
+    char digits[64];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr - digits);
+}
+
+static void appendNumber(std::string& out, int64_t value) {
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr - digits);
+}
+
+std::string MetricsHttpServer::render() {
+    metrics::Registry& registry = metrics::Registry::instance();
+    std::string out;
+    out.reserve(8192);
+
+    // Samples sharing a name (e.g. one per version) go under one TYPE line;
+    // the registry returns them in creation order, so they are adjacent
+    std::vector<metrics::CounterSample> counters = registry.counters();
+    for (size_t i = 0; i < counters.size(); ++i) {
+        const metrics::CounterSample& sample = counters[i];
+        if (i == 0 || counters[i - 1].name != sample.name) {
+            out += "# HELP " + sample.name + " " + sample.help + "\n";
+            out += "# TYPE " + sample.name +
+                   (sample.kind == metrics::Counter::Kind::GAUGE ? " gauge\n" : " counter\n");
+        }
+        out += sample.name;
+        if (!sample.labels.empty()) {
+            out += "{" + sample.labels + "}";
+        }
+        out += ' ';
+        appendNumber(out, sample.value);
+        out += '\n';
+    }
+
+    static const double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (const metrics::HistogramSnapshot& snapshot : registry.snapshot()) {
+        std::string name = "ads_" + snapshot.name + "_seconds";
+        out += "# TYPE " + name + " summary\n";
+        for (double quantile : kQuantiles) {
+            out += name + "{quantile=\"";
+            appendNumber(out, quantile);
+            out += "\"} ";
+            appendNumber(out, static_cast<double>(snapshot.percentile(quantile)) / 1e9);
+            out += '\n';
+        }
+        out += name + "_sum ";
+        appendNumber(out, static_cast<double>(snapshot.sum_ns) / 1e9);
+        out += '\n';
+        out += name + "_count ";
+        appendNumber(out, static_cast<int64_t>(snapshot.count));
+        out += '\n';
+    }
+    return out;
+}
+
+MetricsHttpServer::MetricsHttpServer(int port) {
+    listen_fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        throw std::runtime_error(std::string("metrics socket: ") + std::strerror(errno));
+    }
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listen_fd_, 16) != 0) {
+        int err = errno;
+        ::close(listen_fd_);
+        throw std::runtime_error("metrics port " + std::to_string(port) + ": " + std::strerror(err));
+    }
+    thread_ = std::thread([this]() { serve(); });
+}
+
+MetricsHttpServer::~MetricsHttpServer() {
+    stopping_ = true;
+    // Wakes the blocked accept()
+    ::shutdown(listen_fd_, SHUT_RDWR);
+    thread_.join();
+    ::close(listen_fd_);
+}
+
+void MetricsHttpServer::serve() {
+    while (!stopping_) {
+        int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        handleConnection(fd);
+        ::close(fd);
+    }
+}
+
+static void sendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        sent += static_cast<size_t>(n);
+    }
+}
+
+void MetricsHttpServer::handleConnection(int fd) {
+    // A stalled client must not wedge the only serving thread
+    timeval timeout{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters; read until the end of the headers
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        request.append(buffer, static_cast<size_t>(n));
+    }
+
+    std::string status;
+    std::string content_type = "text/plain; charset=utf-8";
+    std::string body;
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET /metrics?", 0) == 0) {
+        status = "200 OK";
+        content_type = "text/plain; version=0.0.4; charset=utf-8";
+        body = render();
+    } else if (request.rfind("GET ", 0) == 0) {
+        status = "404 Not Found";
+        body = "Not found; metrics are served on /metrics\n";
+    } else {
+        status = "405 Method Not Allowed";
+        body = "Only GET is supported\n";
+    }
+
+    std::string response = "HTTP/1.0 " + status + "\r\n"
+                           "Content-Type: " + content_type + "\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "Connection: close\r\n\r\n";
+    response += body;
+    sendAll(fd, response);
+}
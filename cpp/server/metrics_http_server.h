@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+/**
+ * Minimal HTTP/1.0 server exposing metrics::Registry on GET /metrics in the
+ * Prometheus text format (version 0.0.4):
+ *
+ *   counters and gauges   as-is, e.g. ads_server_sessions_started_total
+ *   histograms            as summaries named ads_<histogram>_seconds with
+ *                         0.5/0.9/0.99/0.999 quantiles, _sum and _count
+ *
+ * Requests are served one at a time on a dedicated thread. A scrape only
+ * reads the per-CPU counter cells and per-thread histogram shards, so it
+ * never blocks GetAds request threads.
+ */
+class MetricsHttpServer {
+public:
+    // Binds 0.0.0.0:port and starts serving; throws std::runtime_error if
+    // the port cannot be bound
+    explicit MetricsHttpServer(int port);
+    ~MetricsHttpServer();
+
+    MetricsHttpServer(const MetricsHttpServer&) = delete;
+    MetricsHttpServer& operator=(const MetricsHttpServer&) = delete;
+
+    // Body served on /metrics
+    static std::string render();
+
+private:
+    void serve();
+    void handleConnection(int fd);
+
+    int listen_fd_ = -1;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
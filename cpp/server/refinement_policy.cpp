@@ -0,0 +1,40 @@
+#include "refinement_policy.h"
+#include <algorithm>
+#include <stdexcept>
+
+RefinementPlan FixedDelayPolicy::plan(const SessionDeadline& deadline) const {
+    RefinementPlan plan;
+    plan.delay = delay_;
+    plan.send_version3 = deadline.allows(delay_);
+    return plan;
+}
+
+RefinementPlan DeadlineAwarePolicy::plan(const SessionDeadline& deadline) const {
+    RefinementPlan plan;
+    plan.delay = options_.default_delay;
+    if (!deadline.isSet()) {
+        return plan;
+    }
+
+    // Latest moment the version 3 write may start and still arrive in time
+    std::chrono::milliseconds latest(deadline.remainingMs() - options_.margin.count());
+    if (latest < options_.min_delay) {
+        plan.send_version3 = false;
+        return plan;
+    }
+    plan.delay = std::min(options_.default_delay, latest);
+    if (latest - plan.delay >= options_.extended_slack) {
+        plan.tier = ScorerTier::EXTENDED;
+    }
+    return plan;
+}
+
+std::unique_ptr<RefinementPolicy> makeRefinementPolicy(const std::string& name) {
+    if (name == "fixed") {
+        return std::unique_ptr<RefinementPolicy>(new FixedDelayPolicy());
+    }
+    if (name == "deadline") {
+        return std::unique_ptr<RefinementPolicy>(new DeadlineAwarePolicy());
+    }
+    throw std::invalid_argument("unknown refinement policy '" + name + "'");
+}
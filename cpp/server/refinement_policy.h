@@ -0,0 +1,81 @@
+#pragma once
+
+#include "ad_engine.h"
+#include "session_deadline.h"
+#include <chrono>
+#include <memory>
+#include <string>
+
+// What a session does after writing version 2
+struct RefinementPlan {
+    bool send_version3 = true;
+    // Delay between the second Context and the version 3 write
+    std::chrono::milliseconds delay{50};
+    ScorerTier tier = ScorerTier::STANDARD;
+};
+
+/**
+ * Decides per session whether to produce version 3, when, and with which
+ * scorer tier, from the deadline the client attached to the call. Shared
+ * by all sessions, so implementations must be thread-safe.
+ */
+class RefinementPolicy {
+public:
+    virtual ~RefinementPolicy() = default;
+
+    // Called once the version 2 AdsList has been handed to the stream
+    virtual RefinementPlan plan(const SessionDeadline& deadline) const = 0;
+
+    virtual const char* name() const = 0;
+};
+
+/**
+ * The original protocol: version 3 with the standard scorer 50ms after the
+ * second Context, skipped only if it would land after the deadline.
+ */
+class FixedDelayPolicy final : public RefinementPolicy {
+public:
+    explicit FixedDelayPolicy(std::chrono::milliseconds delay = std::chrono::milliseconds(50))
+        : delay_(delay) {}
+
+    RefinementPlan plan(const SessionDeadline& deadline) const override;
+    const char* name() const override { return "fixed"; }
+
+private:
+    std::chrono::milliseconds delay_;
+};
+
+/**
+ * Fits version 3 into the client's remaining budget:
+ *
+ *   no deadline                          standard scorer after default_delay
+ *   budget < min_delay + margin          no version 3
+ *   budget < default_delay + margin      standard scorer, sent early at
+ *                                        budget - margin
+ *   budget >= default_delay + margin
+ *            + extended_slack            extended scorer after default_delay
+ *   otherwise                            standard scorer after default_delay
+ *
+ * margin covers generation, the write and the trip to the client.
+ */
+class DeadlineAwarePolicy final : public RefinementPolicy {
+public:
+    struct Options {
+        std::chrono::milliseconds default_delay{50};
+        std::chrono::milliseconds min_delay{10};
+        std::chrono::milliseconds margin{5};
+        std::chrono::milliseconds extended_slack{10};
+    };
+
+    DeadlineAwarePolicy() : DeadlineAwarePolicy(Options()) {}
+    explicit DeadlineAwarePolicy(const Options& options) : options_(options) {}
+
+    RefinementPlan plan(const SessionDeadline& deadline) const override;
+    const char* name() const override { return "deadline"; }
+
+private:
+    Options options_;
+};
+
+// "fixed" or "deadline"; throws std::invalid_argument for anything else
+std::unique_ptr<RefinementPolicy> makeRefinementPolicy(const std::string& name);
@@ -0,0 +1,65 @@
+#include "score_cache.h"
+#include <functional>
+
+ScoreLruCache::ScoreLruCache(size_t capacity, size_t shard_count)
+    : capacity_(capacity),
+      shard_count_(shard_count == 0 ? 1 : shard_count),
+      shards_(new Shard[shard_count_]) {
+    for (size_t i = 0; i < shard_count_; ++i) {
+        // Spread capacity evenly, giving any remainder to the first shards
+        shards_[i].capacity = capacity_ / shard_count_ + (i < capacity_ % shard_count_ ? 1 : 0);
+    }
+}
+
+size_t ScoreLruCache::keyHash(std::string_view query, std::string_view asin_id) {
+    std::hash<std::string_view> hasher;
+    size_t h = hasher(query);
+    // boost::hash_combine style mixing of the second key part
+    return h ^ (hasher(asin_id) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+bool ScoreLruCache::lookup(std::string_view query, std::string_view asin_id, double* score) {
+    size_t key_hash = keyHash(query, asin_id);
+    Shard& shard = shardFor(key_hash);
+
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto it = shard.index.find(key_hash);
+    if (it == shard.index.end()) {
+        return false;
+    }
+    const Entry& entry = *it->second;
+    // A hash collision with a different key is reported as a miss
+    if (entry.query != query || entry.asin_id != asin_id) {
+        return false;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    *score = entry.score;
+    return true;
+}
+
+void ScoreLruCache::insert(std::string_view query, std::string_view asin_id, double score) {
+    size_t key_hash = keyHash(query, asin_id);
+    Shard& shard = shardFor(key_hash);
+    if (shard.capacity == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mu);
+    auto it = shard.index.find(key_hash);
+    if (it != shard.index.end()) {
+        // Refresh, or replace a colliding key
+        Entry& entry = *it->second;
+        entry.query.assign(query.data(), query.size());
+        entry.asin_id.assign(asin_id.data(), asin_id.size());
+        entry.score = score;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return;
+    }
+
+    if (shard.lru.size() >= shard.capacity) {
+        shard.index.erase(shard.lru.back().key_hash);
+        shard.lru.pop_back();
+    }
+    shard.lru.push_front(Entry{key_hash, std::string(query), std::string(asin_id), score});
+    shard.index.emplace(key_hash, shard.lru.begin());
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/**
+ * Bounded, thread-safe LRU of base scores keyed on (query, asin_id).
+ *
+ * Shared across sessions so that hot queries reuse the query/asin part of the
+ * score instead of recomputing it. Entries are spread over independently
+ * locked shards to keep contention low with many concurrent sessions.
+ */
+class ScoreLruCache {
+public:
+    explicit ScoreLruCache(size_t capacity, size_t shard_count = 16);
+
+    bool lookup(std::string_view query, std::string_view asin_id, double* score);
+    void insert(std::string_view query, std::string_view asin_id, double score);
+
+    size_t capacity() const { return capacity_; }
+
+private:
+    struct Entry {
+        size_t key_hash;
+        std::string query;
+        std::string asin_id;
+        double score;
+    };
+
+    struct Shard {
+        std::mutex mu;
+        std::list<Entry> lru; // Most recently used first
+        std::unordered_map<size_t, std::list<Entry>::iterator> index;
+        size_t capacity = 0;
+    };
+
+    static size_t keyHash(std::string_view query, std::string_view asin_id);
+    Shard& shardFor(size_t key_hash) { return shards_[key_hash % shard_count_]; }
+
+    size_t capacity_;
+    size_t shard_count_;
+    std::unique_ptr<Shard[]> shards_;
+};
@@ -0,0 +1,123 @@
+#include "score_kernel.h"
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ADS_SCORE_KERNEL_AVX2 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define ADS_SCORE_KERNEL_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// The clamp between the multiply and the prior add also keeps compilers from
+// contracting the math into an FMA, which would change the rounding
+inline double clampUnit(double x) {
+    return std::max(0.0, std::min(1.0, x));
+}
+
+inline double scoreOne(double base_score, double boost, double prior, double multiplier) {
+    return clampUnit(clampUnit((base_score + boost) * multiplier) + prior);
+}
+
+#if defined(ADS_SCORE_KERNEL_AVX2)
+
+__attribute__((target("avx2")))
+void scoreBatchAvx2(const ScoreColumns& columns, double multiplier, double* scores) {
+    const double* base = columns.base_score.data();
+    const double* boost = columns.boost.data();
+    const double* prior = columns.prior.data();
+    const size_t count = columns.size();
+
+    const __m256d mult = _mm256_set1_pd(multiplier);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d context = _mm256_mul_pd(
+            _mm256_add_pd(_mm256_loadu_pd(base + i), _mm256_loadu_pd(boost + i)), mult);
+        // _mm256_min_pd(a, b) returns b when either is NaN, like std::min(1.0, a)
+        context = _mm256_max_pd(_mm256_min_pd(context, one), zero);
+        __m256d score = _mm256_add_pd(context, _mm256_loadu_pd(prior + i));
+        score = _mm256_max_pd(_mm256_min_pd(score, one), zero);
+        _mm256_storeu_pd(scores + i, score);
+    }
+    for (; i < count; ++i) {
+        scores[i] = scoreOne(base[i], boost[i], prior[i], multiplier);
+    }
+}
+
+#elif defined(ADS_SCORE_KERNEL_NEON)
+
+void scoreBatchNeon(const ScoreColumns& columns, double multiplier, double* scores) {
+    const double* base = columns.base_score.data();
+    const double* boost = columns.boost.data();
+    const double* prior = columns.prior.data();
+    const size_t count = columns.size();
+
+    const float64x2_t mult = vdupq_n_f64(multiplier);
+    const float64x2_t zero = vdupq_n_f64(0.0);
+    const float64x2_t one = vdupq_n_f64(1.0);
+
+    // vminq/vmaxq propagate NaN, unlike std::min/max, so clamp with compares
+    // that pick the bound exactly when std::min(1.0, x)/std::max(0.0, x) would
+    auto clamp = [&](float64x2_t x) {
+        x = vbslq_f64(vcltq_f64(x, one), x, one);
+        return vbslq_f64(vcltq_f64(zero, x), x, zero);
+    };
+
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        float64x2_t context = vmulq_f64(vaddq_f64(vld1q_f64(base + i), vld1q_f64(boost + i)), mult);
+        float64x2_t score = clamp(vaddq_f64(clamp(context), vld1q_f64(prior + i)));
+        vst1q_f64(scores + i, score);
+    }
+    for (; i < count; ++i) {
+        scores[i] = scoreOne(base[i], boost[i], prior[i], multiplier);
+    }
+}
+
+#endif
+
+using ScoreBatchFn = void (*)(const ScoreColumns&, double, double*);
+
+struct ScoreKernel {
+    ScoreBatchFn fn;
+    const char* name;
+};
+
+ScoreKernel selectKernel() {
+#if defined(ADS_SCORE_KERNEL_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return {scoreBatchAvx2, "avx2"};
+    }
+#elif defined(ADS_SCORE_KERNEL_NEON)
+    return {scoreBatchNeon, "neon"};
+#endif
+    return {scoreBatchScalar, "scalar"};
+}
+
+const ScoreKernel& kernel() {
+    static const ScoreKernel selected = selectKernel();
+    return selected;
+}
+
+} // namespace
+
+void scoreBatchScalar(const ScoreColumns& columns, double version_multiplier, double* scores) {
+    const size_t count = columns.size();
+    for (size_t i = 0; i < count; ++i) {
+        scores[i] = scoreOne(columns.base_score[i], columns.boost[i], columns.prior[i],
+                             version_multiplier);
+    }
+}
+
+void scoreBatch(const ScoreColumns& columns, double version_multiplier, double* scores) {
+    kernel().fn(columns, version_multiplier, scores);
+}
+
+const char* scoreKernelName() {
+    return kernel().name;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Batch scoring over a structure-of-arrays of candidate features.
+ *
+ * For every candidate i the kernel computes
+ *
+ *   context = clamp((base_score[i] + boost[i]) * version_multiplier)
+ *   score[i] = clamp(context + prior[i])
+ *
+ * with clamp to [0.0, 1.0], which is the per-ad math HashAdScorer used to run
+ * one candidate at a time. Vector kernels (AVX2 on x86-64, NEON on AArch64)
+ * do the same additions, multiplications and min/max in the same order on
+ * doubles and never contract into FMA, so they produce results bit-identical
+ * to the scalar fallback.
+ */
+struct ScoreColumns {
+    std::vector<double> base_score;
+    std::vector<double> boost;
+    std::vector<double> prior;
+
+    size_t size() const { return prior.size(); }
+
+    // Resize all columns to count candidates without releasing capacity
+    void resize(size_t count) {
+        base_score.resize(count);
+        boost.resize(count);
+        prior.resize(count);
+    }
+};
+
+// 0.8, 0.9 and 1.0 for versions 1, 2 and 3
+inline double versionMultiplier(int version) {
+    return 0.7 + (version * 0.1);
+}
+
+// Writes columns.size() scores to scores using the fastest kernel the CPU supports
+void scoreBatch(const ScoreColumns& columns, double version_multiplier, double* scores);
+
+// Portable reference kernel, exposed for verification and benchmarks
+void scoreBatchScalar(const ScoreColumns& columns, double version_multiplier, double* scores);
+
+// "avx2", "neon" or "scalar"; the kernel scoreBatch dispatches to
+const char* scoreKernelName();
@@ -0,0 +1,298 @@
+#include "server_config.h"
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include <grpcpp/resource_quota.h>
+
+namespace {
+
+struct OptionSpec {
+    const char* name;
+    const char* value_hint;
+    const char* help;
+    std::function<void(ServerConfig&, const std::string&)> set;
+};
+
+size_t toSize(const std::string& name, const std::string& value) {
+    size_t used = 0;
+    unsigned long long parsed = 0;
+    try {
+        parsed = std::stoull(value, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used == 0 || used != value.size() || value[0] == '-') {
+        throw std::invalid_argument("invalid value '" + value + "' for " + name);
+    }
+    return static_cast<size_t>(parsed);
+}
+
+int toInt(const std::string& name, const std::string& value) {
+    size_t parsed = toSize(name, value);
+    if (parsed > static_cast<size_t>(std::numeric_limits<int>::max())) {
+        throw std::invalid_argument("value '" + value + "' for " + name + " is too large");
+    }
+    return static_cast<int>(parsed);
+}
+
+// A fraction in [0, 1]
+double toFraction(const std::string& name, const std::string& value) {
+    size_t used = 0;
+    double parsed = -1;
+    try {
+        parsed = std::stod(value, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used == 0 || used != value.size() || !(parsed >= 0 && parsed <= 1)) {
+        throw std::invalid_argument("invalid value '" + value + "' for " + name + " (expected 0 to 1)");
+    }
+    return parsed;
+}
+
+bool toBool(const std::string& name, const std::string& value) {
+    if (value == "1" || value == "true" || value == "yes" || value == "on") {
+        return true;
+    }
+    if (value == "0" || value == "false" || value == "no" || value == "off") {
+        return false;
+    }
+    throw std::invalid_argument("invalid value '" + value + "' for " + name + " (expected true or false)");
+}
+
+const std::vector<OptionSpec>& optionSpecs() {
+    static const std::vector<OptionSpec> specs = {
+        {"listen", "HOST:PORT", "address to serve GetAds on",
+         [](ServerConfig& c, const std::string& v) { c.listen_address = v; }},
+        {"api", "sync|callback|raw", "server API",
+         [](ServerConfig& c, const std::string& v) { c.api = v; }},
+        {"timer-threads", "N", "threads running delayed version 3 writes",
+         [](ServerConfig& c, const std::string& v) { c.timer_threads = toSize("timer-threads", v); }},
+        {"score-cache-size", "N", "entries in the shared base score LRU (0 = off)",
+         [](ServerConfig& c, const std::string& v) { c.score_cache_size = toSize("score-cache-size", v); }},
+        {"inventory", "PATH", "memory-mapped inventory file",
+         [](ServerConfig& c, const std::string& v) { c.inventory_path = v; }},
+        {"top-k", "N", "keep the N best ads per list (0 = all)",
+         [](ServerConfig& c, const std::string& v) { c.top_k = toSize("top-k", v); }},
+        {"metrics-interval", "SECONDS", "latency histogram log interval (0 = off)",
+         [](ServerConfig& c, const std::string& v) { c.metrics_interval_s = toSize("metrics-interval", v); }},
+        {"metrics-port", "PORT", "HTTP /metrics port (0 = off)",
+         [](ServerConfig& c, const std::string& v) { c.metrics_port = toInt("metrics-port", v); }},
+        {"refinement-policy", "deadline|fixed", "version 3 scheduling policy",
+         [](ServerConfig& c, const std::string& v) { c.refinement_policy = v; }},
+        {"coalesce", "BOOL", "share generation between identical concurrent requests",
+         [](ServerConfig& c, const std::string& v) { c.coalesce = toBool("coalesce", v); }},
+        {"result-cache-ttl-ms", "MS", "with --coalesce, how long results are reused (0 = in flight only)",
+         [](ServerConfig& c, const std::string& v) { c.result_cache_ttl_ms = toSize("result-cache-ttl-ms", v); }},
+        {"result-cache-size", "N", "with --coalesce, results kept at most",
+         [](ServerConfig& c, const std::string& v) { c.result_cache_size = toSize("result-cache-size", v); }},
+        {"admission", "off|aimd|gradient", "limit concurrent streams, rejecting the rest",
+         [](ServerConfig& c, const std::string& v) { c.admission = v; }},
+        {"admission-initial-limit", "N", "with --admission, starting stream limit",
+         [](ServerConfig& c, const std::string& v) { c.admission_initial_limit = toSize("admission-initial-limit", v); }},
+        {"admission-min-limit", "N", "with --admission, lowest stream limit",
+         [](ServerConfig& c, const std::string& v) { c.admission_min_limit = toSize("admission-min-limit", v); }},
+        {"admission-max-limit", "N", "with --admission, highest stream limit",
+         [](ServerConfig& c, const std::string& v) { c.admission_max_limit = toSize("admission-max-limit", v); }},
+        {"admission-latency-target-ms", "MS", "with --admission=aimd, first-AdsList latency to back off at",
+         [](ServerConfig& c, const std::string& v) {
+             c.admission_latency_target_ms = toSize("admission-latency-target-ms", v);
+         }},
+        {"shed-v3-at", "FRACTION", "with --admission, load from which version 3 is skipped",
+         [](ServerConfig& c, const std::string& v) { c.shed_v3_at = toFraction("shed-v3-at", v); }},
+        {"shed-v2-at", "FRACTION", "with --admission, load from which versions 2 and 3 are skipped",
+         [](ServerConfig& c, const std::string& v) { c.shed_v2_at = toFraction("shed-v2-at", v); }},
+        {"num-cqs", "N", "sync API completion queues",
+         [](ServerConfig& c, const std::string& v) { c.num_cqs = toInt("num-cqs", v); }},
+        {"min-pollers", "N", "sync API minimum polling threads per completion queue",
+         [](ServerConfig& c, const std::string& v) { c.min_pollers = toInt("min-pollers", v); }},
+        {"max-pollers", "N", "sync API maximum polling threads per completion queue",
+         [](ServerConfig& c, const std::string& v) { c.max_pollers = toInt("max-pollers", v); }},
+        {"max-threads", "N", "resource quota: threads gRPC may create",
+         [](ServerConfig& c, const std::string& v) { c.max_threads = toInt("max-threads", v); }},
+        {"resource-quota-mb", "MIB", "resource quota: memory gRPC may use",
+         [](ServerConfig& c, const std::string& v) { c.resource_quota_mb = toSize("resource-quota-mb", v); }},
+        {"max-concurrent-streams", "N", "HTTP/2 concurrent streams per connection",
+         [](ServerConfig& c, const std::string& v) { c.max_concurrent_streams = toInt("max-concurrent-streams", v); }},
+        {"processes", "N", "server processes sharing the port via SO_REUSEPORT",
+         [](ServerConfig& c, const std::string& v) { c.processes = toInt("processes", v); }},
+        {"reuseport", "BOOL", "set SO_REUSEPORT on the listening socket",
+         [](ServerConfig& c, const std::string& v) { c.reuseport = toBool("reuseport", v); }},
+        {"pin-cpus", "BOOL", "pin process i to CPU i",
+         [](ServerConfig& c, const std::string& v) { c.pin_cpus = toBool("pin-cpus", v); }},
+        {"shard-index", "N", "internal: index of a process started by --processes",
+         [](ServerConfig& c, const std::string& v) { c.shard_index = toInt("shard-index", v); }},
+    };
+    return specs;
+}
+
+void setOption(ServerConfig& config, const std::string& name, const std::string& value,
+               const std::string& source) {
+    for (const OptionSpec& spec : optionSpecs()) {
+        if (name == spec.name) {
+            spec.set(config, value);
+            return;
+        }
+    }
+    throw std::invalid_argument("unknown option '" + name + "' in " + source);
+}
+
+std::string trim(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+void loadConfigFile(ServerConfig& config, const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::invalid_argument("cannot read config file " + path);
+    }
+    std::string line;
+    for (int line_number = 1; std::getline(in, line); ++line_number) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) {
+            continue;
+        }
+        size_t equals = line.find('=');
+        if (equals == std::string::npos) {
+            throw std::invalid_argument(path + ":" + std::to_string(line_number) +
+                                        ": expected name = value");
+        }
+        setOption(config, trim(line.substr(0, equals)), trim(line.substr(equals + 1)),
+                  path + ":" + std::to_string(line_number));
+    }
+}
+
+// "max-concurrent-streams" -> "ADS_SERVER_MAX_CONCURRENT_STREAMS"
+std::string environmentName(const char* option) {
+    std::string name = "ADS_SERVER_";
+    for (const char* c = option; *c != '\0'; ++c) {
+        name += *c == '-' ? '_' : static_cast<char>(std::toupper(static_cast<unsigned char>(*c)));
+    }
+    return name;
+}
+
+void validate(const ServerConfig& config) {
+    if (config.api != "sync" && config.api != "callback" && config.api != "raw") {
+        throw std::invalid_argument("invalid api '" + config.api + "' (expected sync, callback or raw)");
+    }
+    if (config.refinement_policy != "deadline" && config.refinement_policy != "fixed") {
+        throw std::invalid_argument("invalid refinement-policy '" + config.refinement_policy +
+                                    "' (expected deadline or fixed)");
+    }
+    if (config.admission != "off" && config.admission != "aimd" && config.admission != "gradient") {
+        throw std::invalid_argument("invalid admission '" + config.admission +
+                                    "' (expected off, aimd or gradient)");
+    }
+    if (config.admission_min_limit == 0 || config.admission_min_limit > config.admission_initial_limit ||
+        config.admission_initial_limit > config.admission_max_limit) {
+        throw std::invalid_argument("admission limits must satisfy 0 < min <= initial <= max");
+    }
+    if (config.shed_v3_at > config.shed_v2_at) {
+        throw std::invalid_argument("shed-v3-at must not exceed shed-v2-at");
+    }
+    if (config.processes < 1) {
+        throw std::invalid_argument("processes must be at least 1");
+    }
+    if (config.processes > 1 && !config.reuseport) {
+        throw std::invalid_argument("processes > 1 needs reuseport to share the port");
+    }
+    if (config.min_pollers > 0 && config.max_pollers > 0 && config.min_pollers > config.max_pollers) {
+        throw std::invalid_argument("min-pollers must not exceed max-pollers");
+    }
+}
+
+} // namespace
+
+ServerConfig loadServerConfig(int argc, char** argv) {
+    ServerConfig config;
+
+    // The config file is the lowest-precedence source, so find it first
+    std::string config_path;
+    if (const char* env = std::getenv("ADS_SERVER_CONFIG")) {
+        config_path = env;
+    }
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg.rfind("--config=", 0) == 0) {
+            config_path = arg.substr(9);
+        }
+    }
+    if (!config_path.empty()) {
+        loadConfigFile(config, config_path);
+    }
+
+    for (const OptionSpec& spec : optionSpecs()) {
+        std::string name = environmentName(spec.name);
+        if (const char* value = std::getenv(name.c_str())) {
+            spec.set(config, value);
+        }
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        size_t equals = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || equals == std::string::npos) {
+            throw std::invalid_argument("unknown argument '" + arg + "'");
+        }
+        std::string name = arg.substr(2, equals - 2);
+        if (name != "config") {
+            setOption(config, name, arg.substr(equals + 1), "the command line");
+        }
+    }
+
+    validate(config);
+    return config;
+}
+
+void printServerUsage(std::ostream& out, const char* program) {
+    out << "Usage: " << program << " [--config=PATH] [--name=value ...]\n"
+        << "Options (also ADS_SERVER_<NAME> or \"name = value\" in the config file):\n";
+    for (const OptionSpec& spec : optionSpecs()) {
+        std::string left = std::string("  --") + spec.name + "=" + spec.value_hint;
+        out << left;
+        for (size_t pad = left.size(); pad < 42; ++pad) {
+            out << ' ';
+        }
+        out << ' ' << spec.help << '\n';
+    }
+    out.flush();
+}
+
+void applyServerConfig(const ServerConfig& config, grpc::ServerBuilder& builder) {
+    builder.AddListeningPort(config.listen_address, grpc::InsecureServerCredentials());
+
+    if (config.num_cqs > 0) {
+        builder.SetSyncServerOption(grpc::ServerBuilder::SyncServerOption::NUM_CQS, config.num_cqs);
+    }
+    if (config.min_pollers > 0) {
+        builder.SetSyncServerOption(grpc::ServerBuilder::SyncServerOption::MIN_POLLERS, config.min_pollers);
+    }
+    if (config.max_pollers > 0) {
+        builder.SetSyncServerOption(grpc::ServerBuilder::SyncServerOption::MAX_POLLERS, config.max_pollers);
+    }
+
+    if (config.max_threads > 0 || config.resource_quota_mb > 0) {
+        grpc::ResourceQuota quota("ads_server");
+        if (config.max_threads > 0) {
+            quota.SetMaxThreads(config.max_threads);
+        }
+        if (config.resource_quota_mb > 0) {
+            quota.Resize(config.resource_quota_mb << 20);
+        }
+        builder.SetResourceQuota(quota);
+    }
+
+    if (config.max_concurrent_streams > 0) {
+        builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, config.max_concurrent_streams);
+    }
+    builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, config.reuseport ? 1 : 0);
+}
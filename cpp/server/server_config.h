@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <grpcpp/grpcpp.h>
+
+/**
+ * ads_server settings. Every field has an option name (e.g. "timer-threads")
+ * that can be set, in increasing order of precedence, from:
+ *
+ *   a config file       --config=PATH or ADS_SERVER_CONFIG; "name = value"
+ *                       lines, '#' starts a comment
+ *   the environment     ADS_SERVER_<NAME>, e.g. ADS_SERVER_TIMER_THREADS=4
+ *   the command line    --name=value
+ *
+ * Zero for a gRPC tuning knob keeps gRPC's own default.
+ */
+struct ServerConfig {
+    std::string listen_address = "0.0.0.0:50051";
+    // "sync" blocks one gRPC thread per stream; "callback" drives every
+    // stream from a reactor on gRPC's callback threads; "raw" is the callback
+    // API on grpc::ByteBuffers, writing coalesced AdsLists as shared bytes
+    std::string api = "sync";
+    // Worker threads that run delayed refinement writes
+    size_t timer_threads = 2;
+    // Entries in the cross-session base score LRU (0 disables it)
+    size_t score_cache_size = 0;
+    // Memory-mapped inventory file (built by ads_inventory_builder); asins it
+    // does not contain fall back to hash-generated candidates. Empty disables it.
+    std::string inventory_path;
+    // Keep only the K best-scoring ads per list, sorted by score (0 keeps all
+    // ads in generation order)
+    size_t top_k = 0;
+    // Seconds between latency histogram log lines (0 disables them)
+    size_t metrics_interval_s = 60;
+    // Port of the HTTP /metrics endpoint (0 disables it); shard i serves on
+    // metrics_port + i
+    int metrics_port = 0;
+    // How version 3 is fitted to the client's deadline: "deadline" adapts
+    // delay, scorer tier and whether to send it at all; "fixed" always waits
+    // 50ms and only skips versions that would land after the deadline
+    std::string refinement_policy = "deadline";
+    // Share one generation between concurrent identical requests, and keep
+    // the results for result_cache_ttl_ms (0 shares in-flight work only)
+    bool coalesce = false;
+    size_t result_cache_ttl_ms = 100;
+    size_t result_cache_size = 10000;
+    // Concurrency limit on GetAds streams (see AdmissionController): "off",
+    // "aimd" or "gradient". Streams over the limit get RESOURCE_EXHAUSTED.
+    std::string admission = "off";
+    size_t admission_initial_limit = 64;
+    size_t admission_min_limit = 8;
+    size_t admission_max_limit = 1024;
+    // AIMD: time to first AdsList above which the limit backs off
+    size_t admission_latency_target_ms = 10;
+    // Fractions of the limit in flight from which versions 3, and 2 and 3,
+    // are no longer generated
+    double shed_v3_at = 0.8;
+    double shed_v2_at = 0.95;
+
+    // Sync API only: completion queues and polling threads per queue
+    int num_cqs = 0;
+    int min_pollers = 0;
+    int max_pollers = 0;
+    // Resource quota: threads gRPC may create, and memory in MiB
+    int max_threads = 0;
+    size_t resource_quota_mb = 0;
+    // HTTP/2 SETTINGS_MAX_CONCURRENT_STREAMS per connection
+    int max_concurrent_streams = 0;
+
+    // Server processes sharing listen_address through SO_REUSEPORT; the
+    // kernel spreads incoming connections over them
+    int processes = 1;
+    bool reuseport = true;
+    // Pin shard i to CPU i (modulo the online CPUs)
+    bool pin_cpus = false;
+    // Set by the supervisor for the processes it starts; -1 otherwise
+    int shard_index = -1;
+};
+
+// Throws std::invalid_argument naming the offending option or value
+ServerConfig loadServerConfig(int argc, char** argv);
+
+void printServerUsage(std::ostream& out, const char* program);
+
+// Listening port, sync-server CQ options, resource quota and channel args
+void applyServerConfig(const ServerConfig& config, grpc::ServerBuilder& builder);
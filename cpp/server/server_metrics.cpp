@@ -0,0 +1,52 @@
+#include "server_metrics.h"
+
+ServerStageMetrics& ServerStageMetrics::get() {
+    static ServerStageMetrics stages = []() {
+        metrics::Registry& registry = metrics::Registry::instance();
+        return ServerStageMetrics{
+            registry.histogram("server_context_read"),
+            {&registry.histogram("server_generation_v1"),
+             &registry.histogram("server_generation_v2"),
+             &registry.histogram("server_generation_v3")},
+            registry.histogram("server_write"),
+            registry.histogram("server_time_to_first_adslist"),
+            registry.histogram("server_session_duration"),
+            registry.histogram("server_refinement_delay"),
+        };
+    }();
+    return stages;
+}
+
+ServerCounters& ServerCounters::get() {
+    static ServerCounters counters = []() {
+        metrics::Registry& registry = metrics::Registry::instance();
+        auto counter = [&registry](const char* name, const char* help) -> metrics::Counter& {
+            return registry.counter(name, "", help);
+        };
+        auto written = [&registry](const char* labels) {
+            return &registry.counter("ads_server_adslists_written_total", labels,
+                                     "AdsLists written to clients, by version");
+        };
+        return ServerCounters{
+            registry.counter("ads_server_active_streams", "", "GetAds streams currently open",
+                             metrics::Counter::Kind::GAUGE),
+            counter("ads_server_sessions_started_total", "GetAds streams opened"),
+            counter("ads_server_sessions_completed_total", "GetAds streams finished with OK"),
+            counter("ads_server_sessions_cancelled_total", "GetAds streams cancelled by the client"),
+            counter("ads_server_sessions_failed_total", "GetAds streams finished with an error"),
+            {written("version=\"1\""), written("version=\"2\""), written("version=\"3\"")},
+            counter("ads_server_version3_misses_total",
+                    "Version 3 AdsLists not delivered because the client had already cancelled"),
+            counter("ads_server_version3_skipped_total",
+                    "Version 3 AdsLists not generated because they could not beat the client deadline"),
+            {&registry.counter("ads_server_refinement_plans_total", "tier=\"standard\"",
+                               "Version 3 AdsLists scheduled, by scorer tier"),
+             &registry.counter("ads_server_refinement_plans_total", "tier=\"extended\"",
+                               "Version 3 AdsLists scheduled, by scorer tier")},
+            counter("ads_server_write_failures_total", "AdsList writes that failed"),
+            counter("ads_server_adslists_delta_total",
+                    "AdsLists written as a delta against the previous version"),
+        };
+    }();
+    return counters;
+}
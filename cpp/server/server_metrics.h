@@ -0,0 +1,78 @@
+#pragma once
+
+#include "refinement_policy.h"
+#include "../common/metrics.h"
+
+/**
+ * Latency histograms of the GetAds stages, shared by the sync and callback
+ * handlers:
+ *
+ *   context_read           waiting for each Context message
+ *   generation[v - 1]      generateAds for version v
+ *   write                  handing one AdsList to the stream
+ *   time_to_first_adslist  stream start until the version 1 write completed
+ *   session_duration       stream start until the handler/reactor finished
+ *   refinement_delay       version 3 delay chosen by the RefinementPolicy
+ */
+struct ServerStageMetrics {
+    metrics::Histogram& context_read;
+    metrics::Histogram* generation[3];
+    metrics::Histogram& write;
+    metrics::Histogram& time_to_first_adslist;
+    metrics::Histogram& session_duration;
+    metrics::Histogram& refinement_delay;
+
+    static ServerStageMetrics& get();
+
+    metrics::Histogram& generationFor(int version) {
+        return *generation[version < 1 ? 0 : (version > 3 ? 2 : version - 1)];
+    }
+};
+
+/**
+ * Session and write counters exported on /metrics (see MetricsHttpServer).
+ *
+ * A version 3 miss is a session whose version 3 AdsList was not delivered
+ * because the client had already cancelled the stream by the time it was
+ * due, i.e. the 50ms refinement came too late for that client. A skipped
+ * version 3 was never generated because the client's deadline would have
+ * passed before it was due. Scheduled ones are counted by scorer tier.
+ * delta_writes counts refinements sent as an AdsDelta (see ads_delta.h).
+ */
+struct ServerCounters {
+    metrics::Counter& active_streams;
+    metrics::Counter& sessions_started;
+    metrics::Counter& sessions_completed;
+    metrics::Counter& sessions_cancelled;
+    metrics::Counter& sessions_failed;
+    metrics::Counter* adslists_written[3];
+    metrics::Counter& version3_misses;
+    metrics::Counter& version3_skipped;
+    metrics::Counter* refinement_plans[2];
+    metrics::Counter& write_failures;
+    metrics::Counter& delta_writes;
+
+    static ServerCounters& get();
+
+    metrics::Counter& adslistsWrittenFor(int version) {
+        return *adslists_written[version < 1 ? 0 : (version > 3 ? 2 : version - 1)];
+    }
+
+    // Count a RefinementPolicy decision
+    void recordPlan(const RefinementPlan& plan) {
+        if (!plan.send_version3) {
+            version3_skipped.add();
+        } else {
+            refinement_plans[plan.tier == ScorerTier::EXTENDED ? 1 : 0]->add();
+        }
+    }
+
+    // Count the outcome of writing the AdsList of version
+    void recordWrite(int version, bool ok) {
+        if (ok) {
+            adslistsWrittenFor(version).add();
+        } else {
+            write_failures.add();
+        }
+    }
+};
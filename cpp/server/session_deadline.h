@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+
+/**
+ * The GetAds deadline the client attached to the call (ServerContext::
+ * deadline()). Clients send their result-selection timeout as the deadline,
+ * so an AdsList that cannot be written before it would be generated for
+ * nothing.
+ */
+class SessionDeadline {
+public:
+    using Clock = std::chrono::system_clock;
+
+    // gRPC reports "no deadline" as time_point::max()
+    explicit SessionDeadline(Clock::time_point deadline) : deadline_(deadline) {}
+
+    bool isSet() const { return deadline_ != Clock::time_point::max(); }
+
+    // True if work that completes delay from now still lands before the deadline
+    bool allows(std::chrono::milliseconds delay) const {
+        return !isSet() || Clock::now() + delay < deadline_;
+    }
+
+    // Milliseconds left (negative once passed); -1 when no deadline is set
+    long remainingMs() const {
+        if (!isSet()) {
+            return -1;
+        }
+        return static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline_ - Clock::now()).count());
+    }
+
+private:
+    Clock::time_point deadline_;
+};
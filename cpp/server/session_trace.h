@@ -0,0 +1,22 @@
+#pragma once
+
+#include <grpcpp/server_context.h>
+#include "../common/tracing.h"
+
+/**
+ * The trace a GetAds session belongs to: the client's, from its
+ * traceparent metadata, or a new one sampled here when the client sent
+ * none. Invalid when tracing is disabled and the client sent nothing.
+ */
+inline tracing::SpanContext SessionTrace(const grpc::ServerContextBase& context) {
+    const auto& metadata = context.client_metadata();
+    auto entry = metadata.find(tracing::kTraceparentKey);
+    if (entry != metadata.end()) {
+        tracing::SpanContext parent =
+            tracing::SpanContext::parse(std::string_view(entry->second.data(), entry->second.size()));
+        if (parent.valid()) {
+            return parent;
+        }
+    }
+    return tracing::startTrace();
+}
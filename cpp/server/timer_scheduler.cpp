@@ -0,0 +1,106 @@
+#include "timer_scheduler.h"
+
+TimerScheduler::TimerScheduler(size_t worker_threads) {
+    if (worker_threads == 0) {
+        worker_threads = 1;
+    }
+    workers_.reserve(worker_threads);
+    for (size_t i = 0; i < worker_threads; ++i) {
+        workers_.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+TimerScheduler::~TimerScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        shutdown_ = true;
+        // Timers that have not fired yet are dropped
+        pending_.clear();
+    }
+    work_cv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+TimerScheduler::TimerId TimerScheduler::schedule(std::chrono::milliseconds delay,
+                                                 std::function<void()> task) {
+    TimerId id;
+    bool new_earliest;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        id = next_id_++;
+        Clock::time_point deadline = Clock::now() + delay;
+        new_earliest = heap_.empty() || deadline < heap_.top().deadline;
+        heap_.push(HeapEntry{deadline, id});
+        pending_.emplace(id, std::move(task));
+    }
+    // Workers only need waking if their current wait deadline moved earlier
+    if (new_earliest) {
+        work_cv_.notify_one();
+    }
+    return id;
+}
+
+bool TimerScheduler::tryCancel(TimerId id) {
+    std::lock_guard<std::mutex> lock(mu_);
+    // The heap entry is left behind and skipped when it reaches the top
+    return pending_.erase(id) > 0;
+}
+
+bool TimerScheduler::cancel(TimerId id) {
+    std::unique_lock<std::mutex> lock(mu_);
+    if (pending_.erase(id) > 0) {
+        return true;
+    }
+    done_cv_.wait(lock, [this, id]() {
+        auto it = running_.find(id);
+        // Never wait on ourselves when called from inside the task
+        return it == running_.end() || it->second == std::this_thread::get_id();
+    });
+    return false;
+}
+
+void TimerScheduler::workerLoop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+        if (shutdown_) {
+            return;
+        }
+        if (heap_.empty()) {
+            work_cv_.wait(lock);
+            continue;
+        }
+
+        HeapEntry top = heap_.top();
+        if (pending_.find(top.id) == pending_.end()) {
+            // Cancelled timer
+            heap_.pop();
+            continue;
+        }
+        if (Clock::now() < top.deadline) {
+            work_cv_.wait_until(lock, top.deadline);
+            continue;
+        }
+
+        heap_.pop();
+        auto it = pending_.find(top.id);
+        std::function<void()> task = std::move(it->second);
+        pending_.erase(it);
+        running_.emplace(top.id, std::this_thread::get_id());
+
+        // Another timer may already be due; let a second worker pick it up
+        if (!heap_.empty()) {
+            work_cv_.notify_one();
+        }
+
+        lock.unlock();
+        task();
+        // Release captured state before cancel() callers are released
+        task = nullptr;
+        lock.lock();
+
+        running_.erase(top.id);
+        done_cv_.notify_all();
+    }
+}
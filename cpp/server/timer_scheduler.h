@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Shared delayed-task scheduler for the server.
+ *
+ * Timers live in a min-heap ordered by deadline and are executed by a small
+ * fixed pool of worker threads, so scheduling the delayed version 3 AdsList
+ * costs a heap push instead of an OS thread per session.
+ */
+class TimerScheduler {
+public:
+    using TimerId = uint64_t;
+    using Clock = std::chrono::steady_clock;
+
+    explicit TimerScheduler(size_t worker_threads = 2);
+    ~TimerScheduler();
+
+    TimerScheduler(const TimerScheduler&) = delete;
+    TimerScheduler& operator=(const TimerScheduler&) = delete;
+
+    // Run task on a worker thread once delay has elapsed
+    TimerId schedule(std::chrono::milliseconds delay, std::function<void()> task);
+
+    // Remove a timer that has not started yet. Returns true if the task will
+    // never run, false if it already ran or is running right now.
+    bool tryCancel(TimerId id);
+
+    // Like tryCancel, but if the task is currently running on another thread
+    // wait for it to return. After this call the task no longer touches any
+    // state it captured.
+    bool cancel(TimerId id);
+
+private:
+    struct HeapEntry {
+        Clock::time_point deadline;
+        TimerId id;
+        bool operator>(const HeapEntry& other) const {
+            return deadline > other.deadline || (deadline == other.deadline && id > other.id);
+        }
+    };
+
+    void workerLoop();
+
+    std::mutex mu_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> heap_;
+    std::unordered_map<TimerId, std::function<void()>> pending_;
+    std::unordered_map<TimerId, std::thread::id> running_;
+    TimerId next_id_ = 1;
+    bool shutdown_ = false;
+    std::vector<std::thread> workers_;
+};
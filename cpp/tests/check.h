@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+/**
+ * Assertions for the test executables. A failed check prints where it
+ * failed and exits non-zero, which is all ctest looks at; unlike assert()
+ * they stay on in release builds.
+ */
+#define CHECK(condition)                                                              \
+    do {                                                                              \
+        if (!(condition)) {                                                           \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,     \
+                         #condition);                                                 \
+            std::exit(1);                                                             \
+        }                                                                             \
+    } while (0)
+
+// statement must throw exception_type (or a subclass)
+#define CHECK_THROWS(statement, exception_type)                                       \
+    do {                                                                              \
+        bool thrown = false;                                                          \
+        try {                                                                         \
+            statement;                                                                \
+        } catch (const exception_type&) {                                             \
+            thrown = true;                                                            \
+        }                                                                             \
+        if (!thrown) {                                                                \
+            std::fprintf(stderr, "%s:%d: CHECK_THROWS failed: %s did not throw %s\n", \
+                         __FILE__, __LINE__, #statement, #exception_type);            \
+            std::exit(1);                                                             \
+        }                                                                             \
+    } while (0)
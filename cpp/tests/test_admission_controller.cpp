@@ -0,0 +1,218 @@
+#include "../server/admission_controller.h"
+#include "check.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using Algorithm = AdmissionController::Algorithm;
+using Options = AdmissionController::Options;
+using Ticket = AdmissionController::Ticket;
+
+static constexpr uint64_t kMs = 1000000;
+
+static Options makeOptions(Algorithm algorithm, size_t initial, size_t min, size_t max) {
+    Options options;
+    options.algorithm = algorithm;
+    options.initial_limit = initial;
+    options.min_limit = min;
+    options.max_limit = max;
+    return options;
+}
+
+// Admits until in_flight reaches count; growth needs at least half of the
+// estimated limit, which may be fractionally above limit(), in use
+static void holdAtLeast(AdmissionController& controller, std::vector<Ticket>& held, size_t count) {
+    while (held.size() < count) {
+        Ticket ticket = controller.tryAdmit();
+        CHECK(ticket);
+        held.push_back(std::move(ticket));
+    }
+}
+
+static void testInvalidOptions() {
+    CHECK_THROWS(AdmissionController(makeOptions(Algorithm::AIMD, 8, 0, 16)), std::invalid_argument);
+    CHECK_THROWS(AdmissionController(makeOptions(Algorithm::AIMD, 8, 32, 16)), std::invalid_argument);
+    CHECK_THROWS(AdmissionController(makeOptions(Algorithm::AIMD, 4, 8, 16)), std::invalid_argument);
+    CHECK_THROWS(AdmissionController(makeOptions(Algorithm::AIMD, 32, 8, 16)), std::invalid_argument);
+    Options shed_order = makeOptions(Algorithm::AIMD, 8, 1, 16);
+    shed_order.skip_version3_at = 0.9;
+    shed_order.skip_version2_at = 0.8;
+    CHECK_THROWS(AdmissionController{shed_order}, std::invalid_argument);
+
+    CHECK(AdmissionController::parseAlgorithm("aimd") == Algorithm::AIMD);
+    CHECK(AdmissionController::parseAlgorithm("gradient") == Algorithm::GRADIENT);
+    CHECK_THROWS(AdmissionController::parseAlgorithm("vegas"), std::invalid_argument);
+}
+
+// Sessions beyond the limit are rejected; every admitted ticket gives its
+// slot back exactly once, however it is moved around
+static void testTickets() {
+    AdmissionController controller(makeOptions(Algorithm::AIMD, 4, 1, 8));
+    std::vector<Ticket> held;
+    holdAtLeast(controller, held, 4);
+    CHECK(controller.inFlight() == 4);
+    {
+        Ticket rejected = controller.tryAdmit();
+        CHECK(!rejected);
+    }
+    CHECK(controller.inFlight() == 4);
+
+    Ticket moved(std::move(held[0]));
+    CHECK(!held[0]);
+    CHECK(controller.inFlight() == 4);
+    // Assigning over a live ticket releases the slot it held
+    held[1] = std::move(moved);
+    CHECK(controller.inFlight() == 3);
+    held[2] = Ticket();
+    CHECK(controller.inFlight() == 2);
+
+    Ticket again = controller.tryAdmit();
+    CHECK(again);
+    CHECK(controller.inFlight() == 3);
+    held.clear();
+    again = Ticket();
+    CHECK(controller.inFlight() == 0);
+    CHECK(Ticket() ? false : true);
+}
+
+// Concurrent admission never overshoots the limit and leaks no slot
+static void testConcurrentTickets() {
+    AdmissionController controller(makeOptions(Algorithm::AIMD, 6, 1, 8));
+    std::atomic<size_t> peak{0};
+    std::atomic<uint64_t> admitted{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&]() {
+            for (int i = 0; i < 20000; ++i) {
+                Ticket ticket = controller.tryAdmit();
+                if (ticket) {
+                    admitted++;
+                    size_t in_flight = controller.inFlight();
+                    size_t previous = peak.load();
+                    while (in_flight > previous && !peak.compare_exchange_weak(previous, in_flight)) {
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(admitted > 0);
+    CHECK(peak <= controller.limit());
+    CHECK(controller.inFlight() == 0);
+}
+
+// AIMD: slow samples back off multiplicatively down to min_limit; fast ones
+// add one per sample while the limit is in use, up to max_limit
+static void testAimd() {
+    Options options = makeOptions(Algorithm::AIMD, 64, 8, 96);
+    options.latency_target = std::chrono::milliseconds(10);
+    options.backoff = 0.9;
+    AdmissionController controller(options);
+
+    size_t previous = controller.limit();
+    controller.recordLatency(20 * kMs);
+    CHECK(controller.limit() == 57);  // 64 * 0.9
+    for (int i = 0; i < 100; ++i) {
+        controller.recordLatency(20 * kMs);
+        CHECK(controller.limit() <= previous);
+        CHECK(controller.limit() >= options.min_limit);
+        previous = controller.limit();
+    }
+    CHECK(controller.limit() == options.min_limit);
+
+    // Fast but idle: demand, not latency, bounds concurrency
+    for (int i = 0; i < 20; ++i) {
+        controller.recordLatency(1 * kMs);
+    }
+    CHECK(controller.limit() == options.min_limit);
+
+    std::vector<Ticket> held;
+    for (int i = 0; i < 200; ++i) {
+        holdAtLeast(controller, held, controller.limit() / 2 + 1);
+        size_t before = controller.limit();
+        controller.recordLatency(1 * kMs);
+        CHECK(controller.limit() == std::min(before + 1, options.max_limit));
+    }
+    CHECK(controller.limit() == options.max_limit);
+}
+
+// Gradient: steady latency with demand grows the limit to max_limit; a
+// latency jump well past the long-term average shrinks it to min_limit
+static void testGradient() {
+    Options options = makeOptions(Algorithm::GRADIENT, 32, 8, 256);
+    AdmissionController controller(options);
+
+    std::vector<Ticket> held;
+    size_t previous = controller.limit();
+    for (int i = 0; i < 500 && controller.limit() < options.max_limit; ++i) {
+        holdAtLeast(controller, held, controller.limit() / 2 + 1);
+        controller.recordLatency(5 * kMs);
+        CHECK(controller.limit() >= previous);
+        CHECK(controller.limit() <= options.max_limit);
+        previous = controller.limit();
+    }
+    CHECK(controller.limit() == options.max_limit);
+
+    held.clear();
+    int samples = 0;
+    while (controller.limit() > options.min_limit && samples < 80) {
+        controller.recordLatency(50 * kMs);
+        CHECK(controller.limit() <= previous);
+        CHECK(controller.limit() >= options.min_limit);
+        previous = controller.limit();
+        samples++;
+    }
+    CHECK(controller.limit() == options.min_limit);
+}
+
+// Refinements are shed at the configured fractions of the limit in flight:
+// version 3 first, from skip_version3_at, then version 2 as well
+static void testShedding() {
+    Options options = makeOptions(Algorithm::AIMD, 100, 10, 100);
+    options.skip_version3_at = 0.8;
+    options.skip_version2_at = 0.95;
+    AdmissionController controller(options);
+    metrics::Counter& shed_v2 = metrics::Registry::instance().counter(
+        "ads_server_shed_adslists_total", "version=\"2\"", "");
+    metrics::Counter& shed_v3 = metrics::Registry::instance().counter(
+        "ads_server_shed_adslists_total", "version=\"3\"", "");
+
+    std::vector<Ticket> held;
+    holdAtLeast(controller, held, 79);
+    CHECK(!controller.shed(3));
+    CHECK(!controller.shed(2));
+
+    holdAtLeast(controller, held, 80);
+    int64_t v3_before = shed_v3.value();
+    CHECK(controller.shed(3));
+    CHECK(shed_v3.value() == v3_before + 1);
+    CHECK(!controller.shed(2));
+
+    holdAtLeast(controller, held, 94);
+    CHECK(!controller.shed(2));
+    holdAtLeast(controller, held, 95);
+    int64_t v2_before = shed_v2.value();
+    CHECK(controller.shed(2));
+    CHECK(controller.shed(3));
+    CHECK(shed_v2.value() == v2_before + 1);
+
+    held.clear();
+    CHECK(!controller.shed(3));
+    CHECK(!controller.shed(2));
+}
+
+int main() {
+    testInvalidOptions();
+    testTickets();
+    testConcurrentTickets();
+    testAimd();
+    testGradient();
+    testShedding();
+    std::printf("admission_controller: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include "../common/ads_delta.h"
+#include "../server/ad_generator.h"
+#include "../server/hash_ad_engine.h"
+#include "check.h"
+#include <algorithm>
+#include <cstdio>
+#include <google/protobuf/arena.h>
+#include <stdexcept>
+#include <string>
+
+static Context makeContext(const std::string& query, const std::string& asin_id,
+                           const std::string& understanding) {
+    Context context;
+    context.set_query(query);
+    context.set_asin_id(asin_id);
+    context.set_understanding(understanding);
+    return context;
+}
+
+static ads::Ad makeAd(const std::string& asin_id, const std::string& ad_id, double score) {
+    ads::Ad ad;
+    ad.set_asin_id(asin_id);
+    ad.set_ad_id(ad_id);
+    ad.set_score(score);
+    return ad;
+}
+
+// Encodes target against base, applies the result and expects target back
+// byte for byte
+static void checkRoundTrip(const AdsList& base, const AdsList& target) {
+    AdsList message;
+    ads_delta::encode(base, target, &message);
+    CHECK(message.has_delta());
+    CHECK(message.version() == target.version());
+    CHECK(message.delta().base_version() == base.version());
+
+    AdsList rebuilt;
+    ads_delta::apply(base, message, &rebuilt);
+    CHECK(rebuilt.SerializeAsString() == target.SerializeAsString());
+}
+
+// Versions 1-3 as the server generates them, each encoded against the one
+// before, with and without the top-K stage (which reorders and drops ads)
+static void testGeneratedVersions() {
+    const Context contexts[] = {
+        makeContext("coffee maker", "B000123456", "user wants high-quality coffee brewing equipment"),
+        makeContext("running shoes", "B000TEST01", "lightweight trail running"),
+        makeContext("laptop", "B000LAPTOP", ""),
+    };
+    for (size_t top_k : {size_t(0), size_t(5)}) {
+        AdGenerator generator(makeHashAdEngine(), top_k);
+        for (const Context& context : contexts) {
+            Context first = makeContext(context.query(), context.asin_id(), "");
+            AdsList v1 = generator.generateAds(first, 1);
+            AdsList v2 = generator.generateAds(context, 2);
+            AdsList v3 = generator.generateAds(context, 3);
+            CHECK(v1.ads_size() > 0);
+
+            checkRoundTrip(v1, v2);
+            checkRoundTrip(v2, v3);
+
+            // Without top-K, ad i has the same ids in every version, so only
+            // the ads beyond the base's count are sent in full
+            if (top_k == 0) {
+                AdsList message;
+                ads_delta::encode(v1, v2, &message);
+                CHECK(message.delta().inserted_size() == std::max(0, v2.ads_size() - v1.ads_size()));
+            }
+        }
+    }
+}
+
+// Ads missing from base, or whose ad_id now belongs to another asin, travel
+// in full as inserted ads
+static void testInsertedAds() {
+    AdsList base;
+    base.set_version(1);
+    *base.add_ads() = makeAd("B000000001", "AD00000001", 0.5);
+    *base.add_ads() = makeAd("B000000002", "AD00000002", 0.4);
+
+    AdsList target;
+    target.set_version(2);
+    *target.add_ads() = makeAd("B000000002", "AD00000002", 0.9);
+    *target.add_ads() = makeAd("B000000003", "AD00000003", 0.8);
+    *target.add_ads() = makeAd("B000000009", "AD00000001", 0.7);
+    *target.add_ads() = makeAd("B000000001", "AD00000001", 0.6);
+
+    AdsList message;
+    ads_delta::encode(base, target, &message);
+    CHECK(message.delta().base_index_size() == 4);
+    CHECK(message.delta().base_index(0) == 1);
+    CHECK(message.delta().base_index(1) == -1);
+    CHECK(message.delta().base_index(2) == -1);
+    CHECK(message.delta().base_index(3) == 0);
+    CHECK(message.delta().inserted_size() == 2);
+    checkRoundTrip(base, target);
+
+    // An empty target rebuilds to an empty list
+    AdsList empty;
+    empty.set_version(3);
+    checkRoundTrip(target, empty);
+}
+
+// What the server writes: deltas only against a base, only when smaller,
+// never for batched lists
+static void testWireForm() {
+    google::protobuf::Arena arena;
+    AdGenerator generator;
+    Context context = makeContext("coffee maker", "B000123456", "espresso");
+    AdsList v1 = generator.generateAds(context, 1);
+    AdsList v2 = generator.generateAds(context, 2);
+
+    CHECK(&ads_delta::wireForm(nullptr, v2, &arena) == &v2);
+    const AdsList& wire = ads_delta::wireForm(&v1, v2, &arena);
+    CHECK(wire.has_delta());
+    CHECK(wire.ads_size() == 0);
+
+    // A list with nothing in common with its base is cheaper sent in full
+    AdsList unrelated;
+    unrelated.set_version(2);
+    *unrelated.add_ads() = makeAd("B000000042", "AD00000042", 0.1);
+    CHECK(&ads_delta::wireForm(&v1, unrelated, &arena) == &unrelated);
+
+    AdsList batched = v2;
+    batched.add_items();
+    CHECK(&ads_delta::wireForm(&v1, batched, &arena) == &batched);
+}
+
+// Deltas that don't fit the buffered base are rejected, never half-applied
+// into a list that looks valid
+static void testRejectedDeltas() {
+    AdsList base;
+    base.set_version(1);
+    *base.add_ads() = makeAd("B000000001", "AD00000001", 0.5);
+    *base.add_ads() = makeAd("B000000002", "AD00000002", 0.4);
+    AdsList target;
+    target.set_version(2);
+    *target.add_ads() = makeAd("B000000002", "AD00000002", 0.9);
+    *target.add_ads() = makeAd("B000000003", "AD00000003", 0.8);
+
+    AdsList good;
+    ads_delta::encode(base, target, &good);
+    AdsList rebuilt;
+
+    // Wrong base version
+    AdsList other_base = base;
+    other_base.set_version(2);
+    CHECK_THROWS(ads_delta::apply(other_base, good, &rebuilt), std::invalid_argument);
+
+    // Base index past the end of base
+    AdsList out_of_range = good;
+    out_of_range.mutable_delta()->set_base_index(0, base.ads_size());
+    CHECK_THROWS(ads_delta::apply(base, out_of_range, &rebuilt), std::invalid_argument);
+
+    // More inserted references than inserted ads
+    AdsList overrun = good;
+    overrun.mutable_delta()->clear_inserted();
+    CHECK_THROWS(ads_delta::apply(base, overrun, &rebuilt), std::invalid_argument);
+
+    // A score missing for one of the ads
+    AdsList short_scores = good;
+    short_scores.mutable_delta()->mutable_score()->RemoveLast();
+    CHECK_THROWS(ads_delta::apply(base, short_scores, &rebuilt), std::invalid_argument);
+
+    // The untouched delta still applies
+    ads_delta::apply(base, good, &rebuilt);
+    CHECK(rebuilt.SerializeAsString() == target.SerializeAsString());
+}
+
+int main() {
+    testGeneratedVersions();
+    testInsertedAds();
+    testWireForm();
+    testRejectedDeltas();
+    std::printf("ads_delta: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include "../server/generation_coalescer.h"
+#include "../server/hash_ad_engine.h"
+#include "check.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+// Holds the first retrieve() open until release(), so a generation can be
+// kept in flight while other callers ask for the same key
+class GatedRetriever final : public CandidateRetriever {
+public:
+    void retrieve(const Context& context, int version, std::vector<AdCandidate>& candidates) override {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (calls_++ == 0) {
+            cv_.notify_all();
+            if (!cv_.wait_for(lock, 5s, [this]() { return released_; })) {
+                std::fprintf(stderr, "gated generation was never released\n");
+                std::_Exit(1);
+            }
+        }
+        lock.unlock();
+        inner_.retrieve(context, version, candidates);
+    }
+
+    void awaitFirstCall() {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (!cv_.wait_for(lock, 5s, [this]() { return calls_ > 0; })) {
+            std::fprintf(stderr, "timed out waiting for the gated generation\n");
+            std::_Exit(1);
+        }
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mu_);
+        released_ = true;
+        cv_.notify_all();
+    }
+
+    int calls() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return calls_;
+    }
+
+private:
+    HashCandidateRetriever inner_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    int calls_ = 0;
+    bool released_ = false;
+};
+
+static Context makeContext(const std::string& query, const std::string& asin_id) {
+    Context context;
+    context.set_query(query);
+    context.set_asin_id(asin_id);
+    context.set_understanding("espresso");
+    return context;
+}
+
+static metrics::Counter& generations(const char* result) {
+    return metrics::Registry::instance().counter(
+        "ads_server_coalesced_generations_total", std::string("result=\"") + result + "\"", "");
+}
+
+// While a key is in flight, generateAds() joins it and tryGenerateAds()
+// returns at once; once it completes both share the cached result
+static void testInFlight() {
+    auto retriever = std::make_shared<GatedRetriever>();
+    AdEngine engine = makeHashAdEngine();
+    engine.retriever = retriever;
+    AdGenerator generator(engine);
+    GenerationCoalescer::Options options;
+    options.ttl = 10s;
+    GenerationCoalescer coalescer(generator, options);
+    const Context context = makeContext("coffee maker", "B000123456");
+    const int64_t bypassed = generations("bypassed").value();
+    const int64_t joined = generations("joined").value();
+
+    std::future<CoalescedAdsListPtr> owner = std::async(std::launch::async, [&]() {
+        return coalescer.generateAds(context, 2);
+    });
+    retriever->awaitFirstCall();
+    std::future<CoalescedAdsListPtr> joiner = std::async(std::launch::async, [&]() {
+        return coalescer.generateAds(context, 2);
+    });
+
+    CHECK(coalescer.tryGenerateAds(context, 2) == nullptr);
+    CHECK(generations("bypassed").value() == bypassed + 1);
+
+    // The session generates its own copy without waiting for the owner
+    google::protobuf::Arena arena;
+    SessionScoreCache cache;
+    CoalescedAdsListPtr shared;
+    const AdsList& local = generateSessionAds(generator, &coalescer, context, 2, &arena, &cache,
+                                              ScorerTier::STANDARD, shared, InFlightPolicy::GENERATE);
+    CHECK(shared == nullptr);
+    CHECK(retriever->calls() == 2);
+    CHECK(generations("bypassed").value() == bypassed + 2);
+
+    // The joiner counts itself before it waits
+    for (int i = 0; generations("joined").value() == joined; ++i) {
+        if (i == 5000) {
+            std::fprintf(stderr, "timed out waiting for the joiner\n");
+            std::_Exit(1);
+        }
+        std::this_thread::sleep_for(1ms);
+    }
+    CHECK(joiner.wait_for(10ms) != std::future_status::ready);
+
+    retriever->release();
+    CoalescedAdsListPtr generated = owner.get();
+    CHECK(generated != nullptr);
+    CHECK(joiner.get() == generated);
+    CHECK(local.SerializeAsString() == generated->ads_list.SerializeAsString());
+
+    // Completed: shared on both paths, nothing generated again
+    CHECK(coalescer.tryGenerateAds(context, 2) == generated);
+    generateSessionAds(generator, &coalescer, context, 2, &arena, &cache, ScorerTier::STANDARD,
+                       shared, InFlightPolicy::GENERATE);
+    CHECK(shared == generated);
+    CHECK(retriever->calls() == 2);
+    CHECK(generations("bypassed").value() == bypassed + 2);
+}
+
+// A key nobody is generating is generated and cached by tryGenerateAds()
+// like by generateAds()
+static void testTryGeneratesMissingKeys() {
+    AdGenerator generator;
+    GenerationCoalescer::Options options;
+    options.ttl = 10s;
+    GenerationCoalescer coalescer(generator, options);
+    const Context context = makeContext("running shoes", "B000TEST01");
+
+    CoalescedAdsListPtr first = coalescer.tryGenerateAds(context, 1);
+    CHECK(first != nullptr);
+    CHECK(first->ads_list.SerializeAsString() == generator.generateAds(context, 1).SerializeAsString());
+    CHECK(coalescer.generateAds(context, 1) == first);
+    CHECK(coalescer.tryGenerateAds(context, 1) == first);
+    CHECK(coalescer.tryGenerateAds(context, 2) != first);
+}
+
+int main() {
+    testInFlight();
+    testTryGeneratesMissingKeys();
+    std::printf("generation_coalescer: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include "../server/timer_scheduler.h"
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+using TimerId = TimerScheduler::TimerId;
+
+// Waits for future, or gives up on the whole test: a scheduler stuck in a
+// deadlock can't be destroyed, so returning would hang in its destructor
+template <typename Future>
+static void awaitOrExit(Future& future, const char* what) {
+    if (future.wait_for(5s) != std::future_status::ready) {
+        std::fprintf(stderr, "timed out waiting for %s\n", what);
+        std::_Exit(1);
+    }
+}
+
+// A timer cancelled before its deadline never runs
+static void testCancelBeforeRun() {
+    TimerScheduler scheduler(2);
+    std::atomic<int> runs{0};
+    TimerId first = scheduler.schedule(100ms, [&]() { runs++; });
+    TimerId second = scheduler.schedule(100ms, [&]() { runs++; });
+
+    CHECK(scheduler.tryCancel(first));
+    CHECK(scheduler.cancel(second));
+    // Nothing left to cancel
+    CHECK(!scheduler.tryCancel(first));
+    CHECK(!scheduler.cancel(second));
+
+    std::this_thread::sleep_for(200ms);
+    CHECK(runs == 0);
+}
+
+// tryCancel() on a running task returns at once; cancel() waits for it and
+// for its captured state to be released
+static void testCancelWhileRunning() {
+    TimerScheduler scheduler(2);
+    std::promise<void> started;
+    std::atomic<bool> finished{false};
+    auto captured = std::make_shared<int>(0);
+    TimerId id = scheduler.schedule(0ms, [&started, &finished, captured]() {
+        started.set_value();
+        std::this_thread::sleep_for(100ms);
+        finished = true;
+    });
+    std::future<void> running = started.get_future();
+    awaitOrExit(running, "the task to start");
+
+    CHECK(!scheduler.tryCancel(id));
+    CHECK(!finished);
+    CHECK(!scheduler.cancel(id));
+    CHECK(finished);
+    CHECK(captured.use_count() == 1);
+}
+
+// A task cancelling its own timer must not wait for itself
+static void testCancelFromTask() {
+    TimerScheduler scheduler(1);
+    std::promise<TimerId> id_promise;
+    std::shared_future<TimerId> own_id = id_promise.get_future().share();
+    std::promise<bool> cancelled;
+    TimerId id = scheduler.schedule(10ms, [&]() {
+        cancelled.set_value(scheduler.cancel(own_id.get()));
+    });
+    id_promise.set_value(id);
+
+    std::future<bool> result = cancelled.get_future();
+    awaitOrExit(result, "cancel() from inside the task");
+    CHECK(!result.get());
+}
+
+// With one worker, timers fire in deadline order whatever the order they
+// were scheduled in
+static void testFiringOrder() {
+    TimerScheduler scheduler(1);
+    constexpr int kTimers = 64;
+    std::mutex mu;
+    std::vector<int> fired;
+    std::promise<void> all_fired;
+    for (int i = 0; i < kTimers; ++i) {
+        // 37 is coprime to 64, so this visits every slot once
+        int slot = (i * 37) % kTimers;
+        scheduler.schedule(std::chrono::milliseconds(5 * slot), [&, slot]() {
+            std::lock_guard<std::mutex> lock(mu);
+            fired.push_back(slot);
+            if (fired.size() == kTimers) {
+                all_fired.set_value();
+            }
+        });
+    }
+    std::future<void> done = all_fired.get_future();
+    awaitOrExit(done, "all timers to fire");
+
+    std::lock_guard<std::mutex> lock(mu);
+    for (int i = 0; i < kTimers; ++i) {
+        CHECK(fired[i] == i);
+    }
+}
+
+// Every timer runs exactly once and never before its deadline, also with
+// several workers taking turns
+static void testManyTimers() {
+    TimerScheduler scheduler(4);
+    constexpr int kTimers = 1000;
+    std::vector<std::atomic<int>> runs(kTimers);
+    std::atomic<int> early{0};
+    std::atomic<int> remaining{kTimers};
+    std::promise<void> all_fired;
+    for (int i = 0; i < kTimers; ++i) {
+        auto delay = std::chrono::milliseconds(i % 50);
+        auto deadline = TimerScheduler::Clock::now() + delay;
+        scheduler.schedule(delay, [&, i, deadline]() {
+            if (TimerScheduler::Clock::now() < deadline) {
+                early++;
+            }
+            runs[i]++;
+            if (--remaining == 0) {
+                all_fired.set_value();
+            }
+        });
+    }
+    std::future<void> done = all_fired.get_future();
+    awaitOrExit(done, "all timers to fire");
+
+    CHECK(early == 0);
+    for (int i = 0; i < kTimers; ++i) {
+        CHECK(runs[i] == 1);
+    }
+}
+
+// Destroying the scheduler drops timers that have not fired
+static void testShutdownDropsPending() {
+    std::atomic<int> runs{0};
+    auto start = TimerScheduler::Clock::now();
+    {
+        TimerScheduler scheduler(2);
+        scheduler.schedule(10s, [&]() { runs++; });
+    }
+    CHECK(runs == 0);
+    CHECK(TimerScheduler::Clock::now() - start < 1s);
+}
+
+int main() {
+    testCancelBeforeRun();
+    testCancelWhileRunning();
+    testCancelFromTask();
+    testFiringOrder();
+    testManyTimers();
+    testShutdownDropsPending();
+    std::printf("timer_scheduler: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include "inventory_index.h"
+
+/**
+ * Builds an inventory file from tab-separated lines of
+ *
+ *   <key asin_id> \t <ad asin_id> \t <ad_id> \t <prior>
+ *
+ * Blank lines and lines starting with '#' are skipped. The output replaces
+ * OUTPUT atomically, so it can be rebuilt under a running server which is
+ * then told to remap it with SIGHUP.
+ */
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " INPUT.tsv OUTPUT.inv" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1]);
+    if (!in) {
+        std::cerr << "Cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    InventoryIndexWriter writer;
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(in, line)) {
+        ++line_number;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::string_view fields[4];
+        std::string_view rest(line);
+        size_t field_count = 0;
+        while (field_count < 4) {
+            size_t tab = rest.find('\t');
+            fields[field_count++] = rest.substr(0, tab);
+            if (tab == std::string_view::npos) {
+                rest = std::string_view();
+                break;
+            }
+            rest.remove_prefix(tab + 1);
+        }
+        if (field_count != 4 || !rest.empty() || fields[0].empty()) {
+            std::cerr << argv[1] << ":" << line_number << ": expected 4 tab-separated fields"
+                      << std::endl;
+            return 1;
+        }
+
+        std::string prior_text(fields[3]);
+        char* end = nullptr;
+        double prior = std::strtod(prior_text.c_str(), &end);
+        if (end == prior_text.c_str() || *end != '\0') {
+            std::cerr << argv[1] << ":" << line_number << ": invalid prior '" << prior_text
+                      << "'" << std::endl;
+            return 1;
+        }
+        writer.add(fields[0], fields[1], fields[2], prior);
+    }
+
+    try {
+        writer.build(argv[2]);
+        std::shared_ptr<const InventoryIndex> index = InventoryIndex::open(argv[2]);
+        std::cout << "Wrote " << argv[2] << ": " << index->keyCount() << " keys, "
+                  << index->adCount() << " ads" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
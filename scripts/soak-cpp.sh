@@ -0,0 +1,296 @@
+#!/bin/bash
+
+# Sustained-load soak and regression harness for the C++ server.
+#
+# Starts ads_server, drives it with ads_loadgen at stepped open-loop QPS
+# levels (optionally followed by a long constant-load phase), samples the
+# server's RSS, thread count and CPU time from /proc, and writes one TSV
+# row per step into a report that can be compared with an earlier one:
+#
+#   ./scripts/soak-cpp.sh --report=base.tsv
+#   ./scripts/soak-cpp.sh --report=new.tsv --compare=base.tsv
+#   ./scripts/soak-cpp.sh --qps=200 --soak-duration=14400   # 4h leak hunt
+#
+# Fails (exit 1) when threads or memory keep growing, or, with --compare,
+# when a step got slower or more expensive than --max-regression allows.
+
+set -e
+
+# Source common utilities
+source "$(dirname "$0")/common.sh"
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(cd "$SCRIPT_DIR/.." && pwd)"
+
+BUILD_DIR="$PROJECT_ROOT/cpp/build"
+QPS_STEPS="50,100,200,400"
+STEP_DURATION=30
+SOAK_DURATION=0
+SOAK_QPS=""
+SAMPLE_INTERVAL=5
+CLIENT="async"
+PORT=50151
+SERVER_ARGS=""
+LOADGEN_ARGS=""
+REPORT="soak-report.tsv"
+COMPARE=""
+MAX_REGRESSION=10
+MAX_THREAD_GROWTH=4
+MAX_RSS_GROWTH=50
+
+usage() {
+    cat <<EOF
+Usage: $0 [options]
+  --build-dir=DIR          C++ build directory (cpp/build)
+  --qps=LIST               comma-separated QPS steps ($QPS_STEPS)
+  --step-duration=S        seconds per step ($STEP_DURATION)
+  --soak-duration=S        constant-load phase after the steps (0 = none)
+  --soak-qps=R             load of that phase (the last step)
+  --sample-interval=S      seconds between /proc samples ($SAMPLE_INTERVAL)
+  --client=sync|async      ads_loadgen client ($CLIENT)
+  --port=N                 GetAds port of the server under test ($PORT)
+  --server-args="..."      extra ads_server flags
+  --loadgen-args="..."     extra ads_loadgen flags
+  --report=PATH            report to write ($REPORT)
+  --compare=PATH           earlier report to check for regressions
+  --max-regression=PCT     allowed p99/p99.9/CPU-per-request increase ($MAX_REGRESSION)
+  --max-thread-growth=N    allowed idle thread count increase ($MAX_THREAD_GROWTH)
+  --max-rss-growth=MB      allowed RSS growth per hour in the soak phase ($MAX_RSS_GROWTH)
+
+Environment variables SOAK_QPS_STEPS, SOAK_STEP_DURATION and SOAK_DURATION
+override the defaults (used by the CMake 'soak' target).
+EOF
+}
+
+QPS_STEPS="${SOAK_QPS_STEPS:-$QPS_STEPS}"
+STEP_DURATION="${SOAK_STEP_DURATION:-$STEP_DURATION}"
+SOAK_DURATION="${SOAK_DURATION:-$SOAK_DURATION}"
+
+for arg in "$@"; do
+    case "$arg" in
+        --build-dir=*) BUILD_DIR="${arg#*=}" ;;
+        --qps=*) QPS_STEPS="${arg#*=}" ;;
+        --step-duration=*) STEP_DURATION="${arg#*=}" ;;
+        --soak-duration=*) SOAK_DURATION="${arg#*=}" ;;
+        --soak-qps=*) SOAK_QPS="${arg#*=}" ;;
+        --sample-interval=*) SAMPLE_INTERVAL="${arg#*=}" ;;
+        --client=*) CLIENT="${arg#*=}" ;;
+        --port=*) PORT="${arg#*=}" ;;
+        --server-args=*) SERVER_ARGS="${arg#*=}" ;;
+        --loadgen-args=*) LOADGEN_ARGS="${arg#*=}" ;;
+        --report=*) REPORT="${arg#*=}" ;;
+        --compare=*) COMPARE="${arg#*=}" ;;
+        --max-regression=*) MAX_REGRESSION="${arg#*=}" ;;
+        --max-thread-growth=*) MAX_THREAD_GROWTH="${arg#*=}" ;;
+        --max-rss-growth=*) MAX_RSS_GROWTH="${arg#*=}" ;;
+        -h|--help) usage; exit 0 ;;
+        *) print_status "red" "Unknown argument: $arg"; usage; exit 2 ;;
+    esac
+done
+
+SERVER="$BUILD_DIR/server/ads_server"
+LOADGEN="$BUILD_DIR/client/ads_loadgen"
+for binary in "$SERVER" "$LOADGEN"; do
+    if [ ! -x "$binary" ]; then
+        print_status "red" "$binary not found; build first (./scripts/build-cpp.sh)"
+        exit 2
+    fi
+done
+if [ -n "$COMPARE" ] && [ ! -f "$COMPARE" ]; then
+    print_status "red" "No report to compare with at $COMPARE"
+    exit 2
+fi
+IFS=',' read -r -a STEPS <<< "$QPS_STEPS"
+SOAK_QPS="${SOAK_QPS:-${STEPS[${#STEPS[@]}-1]}}"
+
+WORK_DIR="$(mktemp -d "${TMPDIR:-/tmp}/ads-soak.XXXXXX")"
+SERVER_PID=""
+SAMPLER_PID=""
+cleanup() {
+    [ -n "$SAMPLER_PID" ] && kill "$SAMPLER_PID" 2>/dev/null || true
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null || true
+    wait 2>/dev/null || true
+}
+trap cleanup EXIT
+
+CLK_TCK="$(getconf CLK_TCK)"
+
+# "rss_kb threads cpu_ticks" of the server right now
+proc_sample() {
+    local rss threads ticks
+    rss="$(awk '/^VmRSS:/ { print $2 }' "/proc/$SERVER_PID/status")"
+    threads="$(awk '/^Threads:/ { print $2 }' "/proc/$SERVER_PID/status")"
+    # utime and stime; the command name may contain spaces, so cut after ")"
+    ticks="$(sed 's/^.*) //' "/proc/$SERVER_PID/stat" | awk '{ print $12 + $13 }')"
+    echo "$rss $threads $ticks"
+}
+
+# Appends "elapsed_s phase rss_kb threads" every SAMPLE_INTERVAL seconds;
+# the phase is whatever the harness last wrote into $WORK_DIR/phase
+run_sampler() {
+    local start=$SECONDS
+    while kill -0 "$SERVER_PID" 2>/dev/null; do
+        read -r rss threads _ <<< "$(proc_sample)"
+        echo "$((SECONDS - start)) $(cat "$WORK_DIR/phase") $rss $threads" >> "$WORK_DIR/samples"
+        sleep "$SAMPLE_INTERVAL"
+    done
+}
+
+# Column $2 of the single data row of loadgen report $1
+report_field() {
+    awk -F'\t' -v name="$2" 'NR == 1 { for (i = 1; i <= NF; i++) if ($i == name) col = i; next }
+                             { print $col }' "$1"
+}
+
+echo "warmup" > "$WORK_DIR/phase"
+print_status "blue" "Starting ads_server on port $PORT ($SERVER_ARGS)"
+# shellcheck disable=SC2086
+LOG_LEVEL="${LOG_LEVEL:-WARN}" "$SERVER" --listen="0.0.0.0:$PORT" $SERVER_ARGS > "$WORK_DIR/server.log" 2>&1 &
+SERVER_PID=$!
+for _ in $(seq 1 50); do
+    if (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null; then
+        break
+    fi
+    sleep 0.1
+done
+if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+    print_status "red" "ads_server exited during startup:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+run_sampler &
+SAMPLER_PID=$!
+
+# One open-loop run at $2 QPS for $3 seconds; the loadgen report goes to $1
+run_load() {
+    # shellcheck disable=SC2086
+    "$LOADGEN" --target="127.0.0.1:$PORT" --client="$CLIENT" --mode=poisson --qps="$2" \
+        --duration="$3" --report="$1" $LOADGEN_ARGS > "$WORK_DIR/loadgen.log" 2>&1 || {
+        print_status "red" "ads_loadgen failed:"
+        cat "$WORK_DIR/loadgen.log"
+        exit 1
+    }
+}
+
+# Threads left once in-flight streams and their version 3 timers are done
+idle_threads() {
+    sleep 2
+    read -r _ threads _ <<< "$(proc_sample)"
+    echo "$threads"
+}
+
+print_status "blue" "Warming up at ${STEPS[0]} QPS"
+run_load "$WORK_DIR/warmup.tsv" "${STEPS[0]}" 5
+IDLE_THREADS_START="$(idle_threads)"
+read -r RSS_START _ _ <<< "$(proc_sample)"
+
+ROWS="$WORK_DIR/rows"
+: > "$ROWS"
+
+# Runs one measured phase and appends its report row
+run_step() {
+    local name="$1" qps="$2" duration="$3"
+    local load_report="$WORK_DIR/step-$name.tsv"
+    echo "$name" > "$WORK_DIR/phase"
+    read -r rss_before _ ticks_before <<< "$(proc_sample)"
+    run_load "$load_report" "$qps" "$duration"
+    read -r rss_after _ ticks_after <<< "$(proc_sample)"
+    local requests
+    requests="$(report_field "$load_report" requests)"
+    local cpu_us
+    cpu_us="$(awk -v t="$((ticks_after - ticks_before))" -v hz="$CLK_TCK" -v n="$requests" \
+        'BEGIN { printf "%.1f", (n > 0 ? t * 1e6 / hz / n : 0) }')"
+    local peak
+    peak="$(awk -v phase="$name" '$2 == phase && $4 > peak { peak = $4 } END { print peak + 0 }' "$WORK_DIR/samples")"
+    local idle
+    idle="$(idle_threads)"
+    printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n' \
+        "$name" "$qps" "$(report_field "$load_report" rps)" "$requests" \
+        "$(report_field "$load_report" errors_pct)" "$(report_field "$load_report" p50_ms)" \
+        "$(report_field "$load_report" p99_ms)" "$(report_field "$load_report" p999_ms)" \
+        "$(report_field "$load_report" v1_pct)" "$(report_field "$load_report" v2_pct)" \
+        "$(report_field "$load_report" v3_pct)" "$(report_field "$load_report" none_pct)" \
+        "$cpu_us" "$rss_before" "$rss_after" "$peak" "$idle" >> "$ROWS"
+    print_status "green" "$name: $qps QPS -> $(report_field "$load_report" rps) req/s, \
+p99=$(report_field "$load_report" p99_ms)ms, ${cpu_us}us CPU/request, $idle idle threads"
+}
+
+for qps in "${STEPS[@]}"; do
+    print_status "blue" "Step at $qps QPS for ${STEP_DURATION}s"
+    run_step "qps-$qps" "$qps" "$STEP_DURATION"
+done
+if [ "$SOAK_DURATION" -gt 0 ]; then
+    print_status "blue" "Soak at $SOAK_QPS QPS for ${SOAK_DURATION}s"
+    run_step "soak" "$SOAK_QPS" "$SOAK_DURATION"
+fi
+IDLE_THREADS_END="$(tail -n 1 "$ROWS" | cut -f 17)"
+read -r RSS_END _ _ <<< "$(proc_sample)"
+
+# Least-squares RSS slope over the soak phase, skipping its first fifth
+# while allocator pools and caches fill up
+RSS_GROWTH="NA"
+if [ "$SOAK_DURATION" -gt 0 ]; then
+    RSS_GROWTH="$(awk -v skip="$((SOAK_DURATION / 5))" '
+        $2 == "soak" { if (first == "") first = $1; if ($1 - first < skip) next
+                       n++; sx += $1; sy += $3; sxx += $1 * $1; sxy += $1 * $3 }
+        END { if (n < 3 || n * sxx == sx * sx) { print "NA"; exit }
+              printf "%.2f", (n * sxy - sx * sy) / (n * sxx - sx * sx) * 3600 / 1024 }' "$WORK_DIR/samples")"
+fi
+
+COMMIT="$(git -C "$PROJECT_ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+if [ -n "$(git -C "$PROJECT_ROOT" status --porcelain --untracked-files=no 2>/dev/null)" ]; then
+    COMMIT="$COMMIT-dirty"
+fi
+{
+    echo "# ads soak report"
+    echo "# commit=$COMMIT date=$(date -u +%Y-%m-%dT%H:%M:%SZ) host=$(hostname) cpus=$(nproc)"
+    echo "# client=$CLIENT step_duration_s=$STEP_DURATION soak_duration_s=$SOAK_DURATION server_args=$SERVER_ARGS loadgen_args=$LOADGEN_ARGS"
+    printf 'step\ttarget_qps\trps\trequests\terrors_pct\tp50_ms\tp99_ms\tp999_ms\tv1_pct\tv2_pct\tv3_pct\tnone_pct'
+    printf '\tcpu_us_per_req\trss_start_kb\trss_end_kb\tthreads_peak\tthreads_idle\n'
+    cat "$ROWS"
+    echo "# summary idle_threads_start=$IDLE_THREADS_START idle_threads_end=$IDLE_THREADS_END rss_start_kb=$RSS_START rss_end_kb=$RSS_END rss_growth_mb_per_hour=$RSS_GROWTH"
+} > "$REPORT"
+cp "$WORK_DIR/samples" "${REPORT%.tsv}.samples"
+print_status "blue" "Report written to $REPORT (samples in ${REPORT%.tsv}.samples)"
+
+FAILED=0
+if [ $((IDLE_THREADS_END - IDLE_THREADS_START)) -gt "$MAX_THREAD_GROWTH" ]; then
+    print_status "red" "Thread leak: $IDLE_THREADS_START idle threads after warmup, $IDLE_THREADS_END at the end"
+    FAILED=1
+fi
+if [ "$RSS_GROWTH" != "NA" ] && awk -v g="$RSS_GROWTH" -v max="$MAX_RSS_GROWTH" 'BEGIN { exit !(g > max) }'; then
+    print_status "red" "Memory growth: RSS rises ${RSS_GROWTH}MB/hour under constant load (max $MAX_RSS_GROWTH)"
+    FAILED=1
+fi
+
+# A step regressed when p99, p99.9 or CPU per request rose by more than
+# MAX_REGRESSION percent (and by more than 1ms, or 2us of CPU, so noise on
+# tiny values does not count) or throughput fell by more than that
+if [ -n "$COMPARE" ]; then
+    if ! awk -F'\t' -v pct="$MAX_REGRESSION" '
+        function col(name,    i) { for (i = 1; i <= NF; i++) if ($i == name) return i; return 0 }
+        /^#/ { next }
+        $1 == "step" { p99 = col("p99_ms"); p999 = col("p999_ms")
+                       cpu = col("cpu_us_per_req"); rps = col("rps"); next }
+        FNR == NR { old_p99[$1] = $p99; old_p999[$1] = $p999; old_cpu[$1] = $cpu; old_rps[$1] = $rps; next }
+        !($1 in old_p99) { printf "  %-10s no baseline\n", $1; next }
+        {
+            limit = 1 + pct / 100; bad = ""
+            if ($p99 > old_p99[$1] * limit && $p99 - old_p99[$1] > 1) bad = bad " p99"
+            if ($p999 > old_p999[$1] * limit && $p999 - old_p999[$1] > 1) bad = bad " p99.9"
+            if ($cpu > old_cpu[$1] * limit && $cpu - old_cpu[$1] > 2) bad = bad " cpu"
+            if ($rps < old_rps[$1] * (1 - pct / 100)) bad = bad " rps"
+            printf "  %-10s p99 %s -> %s ms, p99.9 %s -> %s ms, cpu %s -> %s us, rps %s -> %s%s\n",
+                   $1, old_p99[$1], $p99, old_p999[$1], $p999, old_cpu[$1], $cpu, old_rps[$1], $rps,
+                   bad == "" ? "" : "   REGRESSED:" bad
+            if (bad != "") failed = 1
+        }
+        END { exit failed }' "$COMPARE" "$REPORT"; then
+        print_status "red" "Regressions against $COMPARE (more than $MAX_REGRESSION%)"
+        FAILED=1
+    else
+        print_status "green" "No regressions against $COMPARE"
+    fi
+fi
+
+exit $FAILED
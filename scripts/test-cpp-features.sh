@@ -0,0 +1,382 @@
+#!/bin/bash
+
+# Test suite for the C++-only GetAds extensions, run against each server
+# API (sync, callback, raw):
+#   delta   refinements sent as an AdsDelta rebuild into the same lists the
+#           client gets without deltas
+#   batch   a batched stream returns each item the ads of a single request
+#           for that item; more than 256 items is INVALID_ARGUMENT
+#   admission
+#           streams over the admission limit are rejected with
+#           RESOURCE_EXHAUSTED, and every admitted stream gives its slot back
+#   signals SIGUSR1, SIGUSR2 and SIGHUP reconfigure a LOG_ASYNC=1 server
+#           with tracing enabled instead of killing it
+
+set -e
+
+# Source common utilities
+source "$(dirname "$0")/common.sh"
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+
+BUILD_DIR="$PROJECT_ROOT/cpp/build"
+PORT=50161
+METRICS_PORT=9561
+APIS=("sync" "callback" "raw")
+
+SERVER_PID=""
+WORK_DIR="$(mktemp -d "${TMPDIR:-/tmp}/ads-cpp-features.XXXXXX")"
+TESTS_PASSED=0
+TESTS_TOTAL=0
+
+# Start ads_server with the given API and extra flags; waits until /metrics
+# answers, which happens after the GetAds port is bound. The server logs at
+# SERVER_LOG_LEVEL, WARN by default.
+start_server() {
+    local api="$1"
+    shift
+    LOG_LEVEL="${SERVER_LOG_LEVEL:-WARN}" "$BUILD_DIR/server/ads_server" --listen="127.0.0.1:$PORT" \
+        --metrics-port="$METRICS_PORT" --api="$api" "$@" > "$WORK_DIR/server.log" 2>&1 &
+    SERVER_PID=$!
+    local count=0
+    while [ $count -lt 50 ]; do
+        if curl -sf "http://127.0.0.1:$METRICS_PORT/metrics" >/dev/null 2>&1; then
+            return 0
+        fi
+        if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+            break
+        fi
+        sleep 0.1
+        count=$((count + 1))
+    done
+    print_status "red" "ads_server --api=$api did not start:"
+    cat "$WORK_DIR/server.log"
+    return 1
+}
+
+stop_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+        SERVER_PID=""
+    fi
+}
+
+# Value of an unlabelled counter on the running server's /metrics
+metric_value() {
+    curl -sf "http://127.0.0.1:$METRICS_PORT/metrics" | awk -v name="$1" '$1 == name { print $2 }'
+}
+
+# The selected list as printed by ads_client: version line and ad lines
+client_result() {
+    LOG_LEVEL=ERROR "$BUILD_DIR/client/ads_client" --target="127.0.0.1:$PORT" "$@" 2>&1 |
+        grep -E '^(AdsList version|Ad [0-9]+:)' || true
+}
+
+# Record one check; the suite fails if any check failed
+check() {
+    local name="$1"
+    local passed="$2"
+    local detail="$3"
+    TESTS_TOTAL=$((TESTS_TOTAL + 1))
+    if [ "$passed" = true ]; then
+        TESTS_PASSED=$((TESTS_PASSED + 1))
+        print_status "green" "$name"
+    else
+        print_status "red" "$name: $detail"
+    fi
+}
+
+# Deltas rebuild into byte-identical lists: the same call with and without
+# --delta selects the same version 3 ads, the server really wrote deltas,
+# and neither client dropped one under load
+test_delta() {
+    local api="$1"
+    print_status "blue" "Testing delta-encoded refinements against the $api API..."
+    start_server "$api" || { check "delta/$api: server start" false "see log above"; return; }
+
+    local full delta
+    full="$(client_result --timeout-ms=1000)"
+    delta="$(client_result --timeout-ms=1000 --delta)"
+    if [ "$(echo "$full" | head -1)" != "AdsList version: 3" ]; then
+        check "delta/$api: version 3 selected" false "got '$(echo "$full" | head -1)'"
+    elif [ "$full" != "$delta" ]; then
+        check "delta/$api: rebuilt lists match full lists" false \
+            "$(diff <(echo "$full") <(echo "$delta") | head -5 | tr '\n' ' ')"
+    else
+        check "delta/$api: rebuilt lists match full lists" true
+    fi
+
+    local writes
+    writes="$(metric_value ads_server_adslists_delta_total)"
+    if [ "${writes:-0}" -gt 0 ]; then
+        check "delta/$api: server wrote deltas" true
+    else
+        check "delta/$api: server wrote deltas" false "ads_server_adslists_delta_total=${writes:-missing}"
+    fi
+
+    local client output
+    for client in sync async; do
+        output="$(LOG_LEVEL=ERROR "$BUILD_DIR/client/ads_loadgen" --target="127.0.0.1:$PORT" \
+            --client="$client" --delta --concurrency=4 --duration=2 --timeout-ms=300 2>&1)"
+        if echo "$output" | grep -q "Dropping AdsList delta"; then
+            check "delta/$api: $client client rebuilt every delta" false \
+                "$(echo "$output" | grep -m1 "Dropping AdsList delta")"
+        elif ! echo "$output" | grep -q "^Errors: *0 "; then
+            check "delta/$api: $client client rebuilt every delta" false \
+                "$(echo "$output" | grep "^Errors:")"
+        elif echo "$output" | grep -q "v2=0.0% v3=0.0%"; then
+            check "delta/$api: $client client rebuilt every delta" false "no refinement was selected"
+        else
+            check "delta/$api: $client client rebuilt every delta" true
+        fi
+    done
+
+    stop_server
+}
+
+# Ad lines of item number $2 in ads_client --batch output $1
+batch_item_ads() {
+    echo "$1" | awk -v item="$2" '
+        /^Item [0-9]+:/ { current = ($2 == item ":") }
+        current && /^  Ad [0-9]+:/ { sub(/^  /, ""); print }'
+}
+
+test_batch() {
+    local api="$1"
+    local asin="B000123456"
+    print_status "blue" "Testing batch mode against the $api API..."
+    start_server "$api" || { check "batch/$api: server start" false "see log above"; return; }
+
+    local output
+    output="$(LOG_LEVEL=ERROR "$BUILD_DIR/client/ads_client" --target="127.0.0.1:$PORT" \
+        --timeout-ms=1000 --asin-id="$asin" --batch=3 2>&1)"
+    if ! echo "$output" | grep -q "^Number of items: 3$"; then
+        check "batch/$api: one list per item" false \
+            "$(echo "$output" | grep -E "^(Number of items|No ads)|error_code" | head -1)"
+    elif ! echo "$output" | grep -q "^AdsList version: 3$"; then
+        check "batch/$api: version 3 selected" false "$(echo "$output" | grep "^AdsList version")"
+    else
+        # Item i asks for asin-i (item 1 for asin itself), see ads_client --batch
+        local item item_asin batched single mismatch=""
+        for item in 1 2 3; do
+            item_asin="$asin"
+            [ "$item" -gt 1 ] && item_asin="$asin-$((item - 1))"
+            batched="$(batch_item_ads "$output" "$item")"
+            single="$(client_result --timeout-ms=1000 --asin-id="$item_asin" | grep "^Ad ")"
+            if [ -z "$batched" ] || [ "$batched" != "$single" ]; then
+                mismatch="item $item ($item_asin) differs from a single request"
+                break
+            fi
+        done
+        if [ -z "$mismatch" ]; then
+            check "batch/$api: each item gets its own ads" true
+        else
+            check "batch/$api: each item gets its own ads" false "$mismatch"
+        fi
+    fi
+
+    output="$(LOG_LEVEL=ERROR "$BUILD_DIR/client/ads_client" --target="127.0.0.1:$PORT" \
+        --timeout-ms=1000 --batch=256 2>&1)"
+    if echo "$output" | grep -q "^Number of items: 256$"; then
+        check "batch/$api: 256 items accepted" true
+    else
+        check "batch/$api: 256 items accepted" false \
+            "$(echo "$output" | grep -E "^(Number of items|No ads)|error_code" | head -1)"
+    fi
+
+    output="$(LOG_LEVEL=ERROR "$BUILD_DIR/client/ads_client" --target="127.0.0.1:$PORT" \
+        --timeout-ms=1000 --batch=257 2>&1)"
+    if echo "$output" | grep -q "error_code=3, error_message=Too many batch items"; then
+        check "batch/$api: 257 items rejected with INVALID_ARGUMENT" true
+    else
+        check "batch/$api: 257 items rejected with INVALID_ARGUMENT" false \
+            "$(echo "$output" | grep -E "^(Number of items|No ads)|error_code" | head -1)"
+    fi
+
+    local client
+    for client in sync async; do
+        output="$(LOG_LEVEL=ERROR "$BUILD_DIR/client/ads_loadgen" --target="127.0.0.1:$PORT" \
+            --client="$client" --batch=8 --concurrency=4 --duration=2 --timeout-ms=300 2>&1)"
+        if echo "$output" | grep -q "^Errors: *0 " && ! echo "$output" | grep -q "none=100.0%"; then
+            check "batch/$api: $client client batches under load" true
+        else
+            check "batch/$api: $client client batches under load" false \
+                "$(echo "$output" | grep -E "^(Errors|Selected):" | tr '\n' ' ')"
+        fi
+    done
+
+    stop_server
+}
+
+# With a limit of one stream, concurrent sessions are turned away before they
+# start; once the load stops the one slot must be free again, so a single
+# request still gets through
+test_admission() {
+    local api="$1"
+    print_status "blue" "Testing admission control against the $api API..."
+    start_server "$api" --admission=aimd --admission-initial-limit=1 \
+        --admission-min-limit=1 --admission-max-limit=1 ||
+        { check "admission/$api: server start" false "see log above"; return; }
+
+    local output
+    output="$(LOG_LEVEL=ERROR "$BUILD_DIR/client/ads_loadgen" --target="127.0.0.1:$PORT" \
+        --concurrency=8 --duration=2 --timeout-ms=300 2>&1)"
+    if echo "$output" | grep -q "error_code=8, error_message=Server overloaded"; then
+        check "admission/$api: overload rejected with RESOURCE_EXHAUSTED" true
+    else
+        check "admission/$api: overload rejected with RESOURCE_EXHAUSTED" false \
+            "$(echo "$output" | grep -E "^Errors:|error_code" | head -1)"
+    fi
+
+    local rejected admitted
+    rejected="$(metric_value 'ads_server_admission_total{result="rejected"}')"
+    admitted="$(metric_value 'ads_server_admission_total{result="admitted"}')"
+    if [ "${rejected:-0}" -gt 0 ] && [ "${admitted:-0}" -gt 0 ]; then
+        check "admission/$api: streams admitted and rejected" true
+    else
+        check "admission/$api: streams admitted and rejected" false \
+            "admitted=${admitted:-missing} rejected=${rejected:-missing}"
+    fi
+
+    # The only slot is in use by this request, so refinements are shed
+    output="$(client_result --timeout-ms=1000)"
+    if [ "$(echo "$output" | head -1)" = "AdsList version: 1" ]; then
+        check "admission/$api: slot released after load" true
+    else
+        check "admission/$api: slot released after load" false \
+            "got '$(echo "$output" | head -1)'"
+    fi
+
+    stop_server
+}
+
+# The async log writer and the trace exporter start during static init,
+# before main() blocks the control signals; a signal the kernel hands to
+# either of them would take the default action and kill the server
+test_signals() {
+    local api="$1"
+    print_status "blue" "Testing control signals against the $api API..."
+    # At INFO the file-scope logger's "Logger configured" line starts the
+    # writer during static init. Nothing listens on port 9: span exports
+    # fail, which is fine.
+    SERVER_LOG_LEVEL=INFO LOG_ASYNC=1 OTEL_EXPORTER_OTLP_ENDPOINT="http://127.0.0.1:9" \
+        start_server "$api" ||
+        { check "signals/$api: server start" false "see log above"; return; }
+
+    local signal
+    for signal in USR1 USR1 USR2 HUP USR1 USR2; do
+        kill -"$signal" "$SERVER_PID" 2>/dev/null || true
+        sleep 0.2
+    done
+
+    if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+        local status=0
+        wait "$SERVER_PID" 2>/dev/null || status=$?
+        check "signals/$api: server survives SIGUSR1/SIGUSR2/SIGHUP" false "exit status $status"
+        SERVER_PID=""
+        return
+    fi
+    local reconfigured
+    reconfigured="$(grep -c "^Logging reconfigured" "$WORK_DIR/server.log" || true)"
+    if [ "$reconfigured" -ne 5 ]; then
+        check "signals/$api: server survives SIGUSR1/SIGUSR2/SIGHUP" false \
+            "logging reconfigured $reconfigured times, expected 5"
+    elif [ -z "$(client_result --timeout-ms=1000)" ]; then
+        check "signals/$api: server survives SIGUSR1/SIGUSR2/SIGHUP" false "no ads after the signals"
+    else
+        check "signals/$api: server survives SIGUSR1/SIGUSR2/SIGHUP" true
+    fi
+
+    stop_server
+}
+
+run_tests() {
+    local suite="$1"
+    local api
+    for api in "${APIS[@]}"; do
+        "test_$suite" "$api"
+    done
+}
+
+# Main execution
+main() {
+    local action="all"
+    local arg
+    for arg in "$@"; do
+        case "$arg" in
+            --build-dir=*) BUILD_DIR="${arg#*=}" ;;
+            --port=*) PORT="${arg#*=}" ;;
+            --metrics-port=*) METRICS_PORT="${arg#*=}" ;;
+            help|--help|-h) print_usage; exit 0 ;;
+            -*) print_status "red" "Unknown option: $arg"; print_usage; exit 1 ;;
+            *) action="$arg" ;;
+        esac
+    done
+
+    local binary
+    for binary in server/ads_server client/ads_client client/ads_loadgen; do
+        if [ ! -x "$BUILD_DIR/$binary" ]; then
+            print_status "red" "$BUILD_DIR/$binary not found; build first (./scripts/build-cpp.sh)"
+            exit 1
+        fi
+    done
+
+    echo "=================================================="
+    echo "gRPC Bidirectional Streaming - C++ Extension Tests"
+    echo "=================================================="
+    print_status "blue" "Build directory: $BUILD_DIR"
+    echo ""
+
+    case "$action" in
+        delta|batch|admission|signals)
+            run_tests "$action"
+            ;;
+        all)
+            run_tests delta
+            run_tests batch
+            run_tests admission
+            run_tests signals
+            ;;
+        *)
+            print_status "red" "Unknown action: $action"
+            print_usage
+            exit 1
+            ;;
+    esac
+
+    echo ""
+    print_status "blue" "C++ extension results: $TESTS_PASSED/$TESTS_TOTAL passed"
+    if [ "$TESTS_PASSED" -eq "$TESTS_TOTAL" ]; then
+        print_status "green" "All C++ extension tests passed!"
+        return 0
+    fi
+    print_status "red" "Some C++ extension tests failed"
+    return 1
+}
+
+# Print usage information
+print_usage() {
+    echo "Usage: $0 [ACTION] [--build-dir=DIR] [--port=N] [--metrics-port=N]"
+    echo ""
+    echo "ACTIONS:"
+    echo "  delta           - Delta-encoded refinements (--delta)"
+    echo "  batch           - Batch mode (--batch=N) and its 256-item limit"
+    echo "  admission       - Admission control rejects overload (--admission)"
+    echo "  signals         - SIGUSR1/SIGUSR2/SIGHUP with LOG_ASYNC=1 and tracing"
+    echo "  all             - Run every test (default)"
+    echo ""
+    echo "Each test runs against ads_server --api=sync, callback and raw."
+    echo "DIR defaults to cpp/build."
+}
+
+cleanup() {
+    stop_server
+    rm -rf "$WORK_DIR"
+}
+
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+main "$@"
@@ -278,6 +278,9 @@ main() {
         full-interop)
             "$SCRIPT_DIR/test-interop.sh" all
             ;;
+        cpp-features)
+            "$SCRIPT_DIR/test-cpp-features.sh" "${@:2}"
+            ;;
         proto)
             test_proto_generation
             ;;
@@ -339,6 +342,7 @@ print_usage() {
     echo "  smoke           - Run smoke tests (default)"
     echo "  quick-interop   - Run quick interoperability test"
     echo "  full-interop    - Run full interoperability test suite"
+    echo "  cpp-features    - Test C++-only extensions (delta, batch, admission, signals) on each server API"
     echo "  proto           - Test protobuf code generation"
     echo "  build [LANG]    - Test build process (java|cpp|rust|all)"
     echo "  server [LANG]   - Test server startup (java|cpp|rust)"